@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ca.h"
+#include "ensemble.h"
+#include "hashlife_ca.h"
+#include "numa_topology.h"
+#include "nibble_ca.h"
+#include "packed_ca.h"
+
+/**
+ * Benchmarks the engines and kernels on random grids, and checks that they all produce
+ * identical results. Prints one line of JSON per run, so results can be compared between
+ * builds or machines.
+ *
+ * To build:
+ *     g++ -std=c++14 -O2 bench.cc ca.cc block_kernels.cc hashlife_ca.cc nibble_ca.cc \
+ *         packed_ca.cc ensemble.cc numa_topology.cc run_stats.cc torus_hash.cc worker_pool.cc \
+ *         -lpthread
+ */
+
+using namespace Critters;
+
+namespace {
+    const char* BUILT_IN_RULES[] = {
+        "critters", "tron", "highlander", "billiardball", "schaeffer", "singlerotation",
+    };
+
+    struct Options {
+        std::vector<uint32_t> sizes = {64, 256, 1024, 4096, 16384, 32768};
+        std::vector<double> densities = {0.1, 0.5};
+        std::vector<std::string> rules;
+        uint32_t num_random_rules = 2;
+        std::vector<uint32_t> thread_counts;
+        std::vector<bool> reversed = {false, true};
+        // "packed-generic" is the packed engine without the kernels generated for built-in
+        // rules.
+        std::vector<std::string> engines = {"bytes", "packed", "packed-generic", "nibble"};
+        std::vector<std::string> kernels;
+        // Whether the bytes engine uses NUMA placement.
+        bool numa = false;
+        // Each run is this many cell updates (rounded to an even number of frames, at least 2).
+        uint64_t cell_updates = 1ULL << 28;
+        uint64_t seed = 1;
+        // Runs whose engine would need more memory than this are skipped.
+        uint64_t max_memory_mb = 4096;
+    };
+
+    struct Variant {
+        std::string engine;
+        // Only for the bytes engine.
+        KernelType kernel = KernelType::AUTO;
+        uint32_t num_threads;
+        bool numa = false;
+    };
+
+    // One grid configuration, which every variant runs from the same initial state.
+    struct Config {
+        uint32_t size;
+        double density;
+        std::string rule;
+        std::shared_ptr<TransitionTable> table;
+        bool reversed;
+        uint64_t num_frames;
+    };
+
+    struct Result {
+        double seconds;
+        uint64_t hash;
+    };
+
+    // Returns 16 hex digits for a random permutation of 0 to 15.
+    std::string random_permutation_hex(uint64_t& state) {
+        std::string digits = "0123456789ABCDEF";
+        for (uint32_t i = 15; i > 0; i--) {
+            std::swap(digits[i], digits[splitmix64(state) % (i + 1)]);
+        }
+        return digits;
+    }
+}
+
+void usage_error() {
+    std::cerr << "Arguments: (--sizes=N,...) (--densities=D,...) (--rules=RULE,...) "
+              << "(--random-rules=N) (--threads=N,...) (--directions=[forward|reversed],...) "
+              << "(--engines=[bytes|packed|packed-generic|nibble|hashlife],...) "
+              << "(--kernels=[scalar|ssse3|avx2],...) (--numa) "
+              << "(--cell-updates=N) (--seed=N) (--max-memory=MB)\n";
+    std::exit(1);
+}
+
+bool starts_with(const std::string& s, const std::string& prefix) {
+    return s.length() >= prefix.length() && s.substr(0, prefix.length()) == prefix;
+}
+
+std::string string_after_equal_sign(const std::string& s) {
+    size_t index = s.find('=');
+    return s.substr(index + 1);
+}
+
+std::vector<std::string> split_list(const std::string& s) {
+    std::vector<std::string> items;
+    std::istringstream stream(string_after_equal_sign(s));
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+Options parse_options(int argc, char** argv) {
+    Options opts;
+    uint32_t hardware_threads = std::max(std::thread::hardware_concurrency(), 1U);
+    opts.thread_counts = {1};
+    if (hardware_threads > 1) {
+        opts.thread_counts.push_back(hardware_threads);
+    }
+    opts.rules.assign(std::begin(BUILT_IN_RULES), std::end(BUILT_IN_RULES));
+    for (KernelType type : {KernelType::SCALAR, KernelType::SSSE3, KernelType::AVX2}) {
+        if (is_kernel_supported(type)) {
+            opts.kernels.push_back(kernel_name(type));
+        }
+    }
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string s {argv[i]};
+            if (starts_with(s, "--sizes=")) {
+                opts.sizes.clear();
+                for (auto& item : split_list(s)) {
+                    opts.sizes.push_back(std::stoul(item));
+                }
+            }
+            else if (starts_with(s, "--densities=")) {
+                opts.densities.clear();
+                for (auto& item : split_list(s)) {
+                    opts.densities.push_back(std::stod(item));
+                }
+            }
+            else if (starts_with(s, "--rules=")) {
+                opts.rules = split_list(s);
+            }
+            else if (starts_with(s, "--random-rules=")) {
+                opts.num_random_rules = std::stoul(string_after_equal_sign(s));
+            }
+            else if (starts_with(s, "--threads=")) {
+                opts.thread_counts.clear();
+                for (auto& item : split_list(s)) {
+                    opts.thread_counts.push_back(std::stoul(item));
+                }
+            }
+            else if (starts_with(s, "--directions=")) {
+                opts.reversed.clear();
+                for (auto& item : split_list(s)) {
+                    if (item != "forward" && item != "reversed") {
+                        throw std::invalid_argument("Unknown direction: " + item);
+                    }
+                    opts.reversed.push_back(item == "reversed");
+                }
+            }
+            else if (starts_with(s, "--engines=")) {
+                opts.engines = split_list(s);
+            }
+            else if (starts_with(s, "--kernels=")) {
+                opts.kernels = split_list(s);
+            }
+            else if (s == "--numa") {
+                opts.numa = true;
+            }
+            else if (starts_with(s, "--cell-updates=")) {
+                opts.cell_updates = std::stoull(string_after_equal_sign(s));
+            }
+            else if (starts_with(s, "--seed=")) {
+                opts.seed = std::stoull(string_after_equal_sign(s));
+            }
+            else if (starts_with(s, "--max-memory=")) {
+                opts.max_memory_mb = std::stoull(string_after_equal_sign(s));
+            }
+            else {
+                std::cerr << "Unrecognized argument: " << s << "\n";
+                usage_error();
+            }
+        }
+    }
+    catch (std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        usage_error();
+    }
+    for (uint32_t size : opts.sizes) {
+        if (size == 0 || size % 2 != 0 || size > 65534) {
+            std::cerr << "Bad grid size: " << size << "\n";
+            usage_error();
+        }
+    }
+    for (auto& engine : opts.engines) {
+        if (engine != "bytes" && engine != "packed" && engine != "packed-generic" &&
+                engine != "nibble" && engine != "hashlife") {
+            std::cerr << "Unknown engine: " << engine << "\n";
+            usage_error();
+        }
+    }
+    return opts;
+}
+
+std::vector<Variant> variants_for_options(const Options& opts) {
+    std::vector<Variant> variants;
+    for (uint32_t num_threads : opts.thread_counts) {
+        for (auto& engine : opts.engines) {
+            if (engine == "bytes") {
+                for (auto& kernel : opts.kernels) {
+                    variants.push_back(
+                        {engine, kernel_type_for_name(kernel), num_threads, opts.numa});
+                }
+            }
+            // HashLifeCA is single threaded.
+            else if (engine != "hashlife" || num_threads == opts.thread_counts[0]) {
+                variants.push_back({engine, KernelType::AUTO, num_threads});
+            }
+        }
+    }
+    return variants;
+}
+
+bool is_power_of_two(uint32_t n) {
+    return (n & (n - 1)) == 0;
+}
+
+// Approximate peak memory for the grid, or 0 if it can't be estimated in advance.
+uint64_t estimated_memory_bytes(const Variant& variant, uint32_t size) {
+    uint64_t num_cells = (uint64_t)size * size;
+    if (variant.engine == "bytes") {
+        // The grid, and the halos for `advance`.
+        return num_cells + num_cells / 4;
+    }
+    if (variant.engine == "packed" || variant.engine == "packed-generic" ||
+            variant.engine == "nibble") {
+        return num_cells / 8;
+    }
+    return 0;
+}
+
+// Bytes of grid storage read and written per frame if every frame makes one pass over the grid,
+// which is what the memory bandwidth is estimated from. Temporal blocking in MargolusCA reads
+// and writes less than this, so its bandwidth can exceed what the hardware actually delivers.
+// 0 for engines that don't store the grid directly.
+uint64_t grid_bytes_per_frame(const Variant& variant, uint32_t size) {
+    uint64_t num_cells = (uint64_t)size * size;
+    if (variant.engine == "bytes") {
+        return 2 * num_cells;
+    }
+    if (variant.engine == "packed" || variant.engine == "packed-generic" ||
+            variant.engine == "nibble") {
+        return 2 * num_cells / 8;
+    }
+    return 0;
+}
+
+std::unique_ptr<MargolusEngine> make_engine(
+        const Variant& variant, uint32_t size, std::shared_ptr<TransitionTable> table) {
+    std::unique_ptr<MargolusEngine> engine;
+    if (variant.engine == "bytes") {
+        auto ca = std::make_unique<MargolusCA>(size, size, table);
+        ca->set_kernel(variant.kernel);
+        ca->set_numa_placement(variant.numa);
+        engine = std::move(ca);
+    }
+    else if (variant.engine == "packed" || variant.engine == "packed-generic") {
+        auto ca = std::make_unique<PackedMargolusCA>(size, size, table);
+        ca->set_use_specialized_kernels(variant.engine == "packed");
+        engine = std::move(ca);
+    }
+    else if (variant.engine == "nibble") {
+        engine = std::make_unique<NibbleMargolusCA>(size, size, table);
+    }
+    else {
+        engine = std::make_unique<HashLifeCA>(size, size, table);
+    }
+    engine->set_num_threads(variant.num_threads);
+    return engine;
+}
+
+// Fills a grid and times advancing it. Only the advance is timed, not the fill or hash.
+Result run_variant(
+        const Variant& variant, const Config& config, uint64_t seed, WorkerPool* fill_pool) {
+    auto grid = make_engine(variant, config.size, config.table);
+    fill_random(*grid, seed, config.density, fill_pool);
+    if (config.reversed) {
+        grid->set_frame_number(config.num_frames);
+        grid->set_reversed(true);
+    }
+    auto start = std::chrono::steady_clock::now();
+    grid->advance(config.num_frames);
+    auto end = std::chrono::steady_clock::now();
+    return {std::chrono::duration<double>(end - start).count(), grid_hash(*grid)};
+}
+
+// Splits `bandwidth` between the NUMA nodes that a variant's threads are pinned to. Each thread
+// updates an equal band of the grid that's on its own node, so a node's share is in proportion
+// to its number of threads. Empty unless the variant uses NUMA placement with several threads.
+std::vector<double> node_bandwidths(const Variant& variant, double bandwidth) {
+    std::vector<double> bandwidths;
+    if (!variant.numa || variant.num_threads <= 1) {
+        return bandwidths;
+    }
+    NumaTopology topology = NumaTopology::detect();
+    std::vector<uint32_t> cpus = topology.cpus_for_threads(variant.num_threads);
+    bandwidths.resize(topology.num_nodes(), 0);
+    for (uint32_t cpu : cpus) {
+        bandwidths[topology.node_for_cpu(cpu)] += bandwidth / cpus.size();
+    }
+    return bandwidths;
+}
+
+void print_result(const Variant& variant, const Config& config,
+        const Result& result, bool identical) {
+    double cell_updates = (double)config.size * config.size * config.num_frames;
+    double bytes = (double)grid_bytes_per_frame(variant, config.size) * config.num_frames;
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)result.hash);
+    std::ostringstream ss;
+    ss << "{\"engine\": \"" << variant.engine << "\", \"kernel\": ";
+    if (variant.engine == "bytes") {
+        ss << "\"" << kernel_name(variant.kernel) << "\"";
+    }
+    else {
+        ss << "null";
+    }
+    ss << ", \"threads\": " << variant.num_threads
+        << ", \"numa\": " << (variant.numa ? "true" : "false")
+        << ", \"rows\": " << config.size << ", \"cols\": " << config.size
+        << ", \"rule\": \"" << config.rule << "\", \"density\": " << config.density
+        << ", \"direction\": \"" << (config.reversed ? "reversed" : "forward") << "\""
+        << ", \"frames\": " << config.num_frames << ", \"seconds\": " << result.seconds
+        << ", \"cells_per_second\": " << cell_updates / result.seconds
+        << ", \"ns_per_block\": " << result.seconds * 1e9 / (cell_updates / 4)
+        << ", \"bandwidth_gb_per_second\": ";
+    if (bytes > 0) {
+        ss << bytes / result.seconds / 1e9;
+    }
+    else {
+        ss << "null";
+    }
+    ss << ", \"node_bandwidth_gb_per_second\": ";
+    std::vector<double> per_node = node_bandwidths(variant, bytes / result.seconds / 1e9);
+    if (bytes > 0 && !per_node.empty()) {
+        ss << "[";
+        for (size_t i = 0; i < per_node.size(); i++) {
+            ss << (i > 0 ? ", " : "") << per_node[i];
+        }
+        ss << "]";
+    }
+    else {
+        ss << "null";
+    }
+    ss << ", \"hash\": \"" << hash << "\", \"identical\": " << (identical ? "true" : "false")
+        << "}\n";
+    std::cout << ss.str();
+    std::cout.flush();
+}
+
+int main(int argc, char** argv) {
+    Options opts = parse_options(argc, argv);
+    std::vector<Variant> variants;
+    std::vector<std::pair<std::string, std::shared_ptr<TransitionTable>>> rules;
+    try {
+        variants = variants_for_options(opts);
+        for (auto& rule : opts.rules) {
+            rules.push_back({rule, TransitionTable::fromName(rule)});
+        }
+    }
+    catch (std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        usage_error();
+    }
+    uint64_t rule_state = opts.seed;
+    for (uint32_t i = 0; i < opts.num_random_rules; i++) {
+        std::string hex = random_permutation_hex(rule_state) + random_permutation_hex(rule_state);
+        rules.push_back({hex, TransitionTable::fromHex(hex)});
+    }
+
+    // Filling the largest grids one row at a time would take longer than running them.
+    std::unique_ptr<WorkerPool> fill_pool;
+    if (std::thread::hardware_concurrency() > 1) {
+        fill_pool = std::make_unique<WorkerPool>(std::thread::hardware_concurrency());
+    }
+
+    bool all_identical = true;
+    for (uint32_t size : opts.sizes) {
+        uint64_t num_frames = std::max<uint64_t>(opts.cell_updates / size / size, 2) & ~1ULL;
+        for (double density : opts.densities) {
+            for (auto& rule : rules) {
+                for (bool reversed : opts.reversed) {
+                    Config config = {size, density, rule.first, rule.second, reversed, num_frames};
+                    // Every variant for a configuration starts from the same grid, and is
+                    // compared with the first one that ran.
+                    bool has_reference = false;
+                    uint64_t reference_hash = 0;
+                    for (auto& variant : variants) {
+                        if (variant.engine == "hashlife" && !is_power_of_two(size)) {
+                            continue;
+                        }
+                        if (estimated_memory_bytes(variant, size) > (opts.max_memory_mb << 20)) {
+                            std::cerr << "Skipping " << variant.engine << " at " << size << "x"
+                                << size << ", which needs more than --max-memory\n";
+                            continue;
+                        }
+                        Result result = run_variant(variant, config, opts.seed, fill_pool.get());
+                        if (!has_reference) {
+                            has_reference = true;
+                            reference_hash = result.hash;
+                        }
+                        bool identical = (result.hash == reference_hash);
+                        all_identical = all_identical && identical;
+                        print_result(variant, config, result, identical);
+                    }
+                }
+            }
+        }
+    }
+    if (!all_identical) {
+        std::cerr << "Some variants produced different grids\n";
+        return 1;
+    }
+    return 0;
+}
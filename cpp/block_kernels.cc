@@ -0,0 +1,187 @@
+#include <stdexcept>
+
+#include "block_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRITTERS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace Critters {
+
+BlockLookup::BlockLookup(const std::array<uint32_t, 16>& states) {
+    for (uint32_t s = 0; s < 16; s++) {
+        for (uint32_t i = 0; i < 4; i++) {
+            cells[i][s] = (states[s] >> (3 - i)) & 1;
+        }
+    }
+}
+
+namespace {
+    void update_blocks_scalar(const uint8_t* top, const uint8_t* bottom,
+            uint8_t* out_top, uint8_t* out_bottom, uint32_t num_blocks,
+            const BlockLookup& lookup) {
+        for (uint32_t i = 0; i < num_blocks; i++) {
+            uint32_t c = 2 * i;
+            uint32_t index = (top[c] << 3) | (top[c + 1] << 2) | (bottom[c] << 1) | bottom[c + 1];
+            out_top[c] = lookup.cells[0][index];
+            out_top[c + 1] = lookup.cells[1][index];
+            out_bottom[c] = lookup.cells[2][index];
+            out_bottom[c + 1] = lookup.cells[3][index];
+        }
+    }
+
+#ifdef CRITTERS_X86_KERNELS
+    // The vector kernels build the block index with `maddubs`, which multiplies each pair of
+    // adjacent cells by (8, 4) for the top row or (2, 1) for the bottom row and adds them into
+    // a 16-bit lane. Packing the lanes to bytes gives one index per block, which `pshufb` looks
+    // up in each of the four per-cell tables. Interleaving the left and right cell results
+    // restores the row layout. (In the AVX2 version `packus` and `unpack` both work within
+    // 128-bit lanes, so their reorderings cancel out.)
+
+    __attribute__((target("ssse3")))
+    void update_blocks_ssse3(const uint8_t* top, const uint8_t* bottom,
+            uint8_t* out_top, uint8_t* out_bottom, uint32_t num_blocks,
+            const BlockLookup& lookup) {
+        const __m128i top_weights = _mm_set1_epi16(0x0408);
+        const __m128i bottom_weights = _mm_set1_epi16(0x0102);
+        const __m128i tl_table = _mm_loadu_si128((const __m128i*) lookup.cells[0].data());
+        const __m128i tr_table = _mm_loadu_si128((const __m128i*) lookup.cells[1].data());
+        const __m128i bl_table = _mm_loadu_si128((const __m128i*) lookup.cells[2].data());
+        const __m128i br_table = _mm_loadu_si128((const __m128i*) lookup.cells[3].data());
+        uint32_t i = 0;
+        // 16 blocks (32 bytes of each row) per iteration.
+        for (; i + 16 <= num_blocks; i += 16) {
+            uint32_t c = 2 * i;
+            __m128i t0 = _mm_loadu_si128((const __m128i*) (top + c));
+            __m128i t1 = _mm_loadu_si128((const __m128i*) (top + c + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i*) (bottom + c));
+            __m128i b1 = _mm_loadu_si128((const __m128i*) (bottom + c + 16));
+            __m128i index0 = _mm_add_epi16(
+                _mm_maddubs_epi16(t0, top_weights), _mm_maddubs_epi16(b0, bottom_weights));
+            __m128i index1 = _mm_add_epi16(
+                _mm_maddubs_epi16(t1, top_weights), _mm_maddubs_epi16(b1, bottom_weights));
+            __m128i index = _mm_packus_epi16(index0, index1);
+            __m128i tl = _mm_shuffle_epi8(tl_table, index);
+            __m128i tr = _mm_shuffle_epi8(tr_table, index);
+            __m128i bl = _mm_shuffle_epi8(bl_table, index);
+            __m128i br = _mm_shuffle_epi8(br_table, index);
+            _mm_storeu_si128((__m128i*) (out_top + c), _mm_unpacklo_epi8(tl, tr));
+            _mm_storeu_si128((__m128i*) (out_top + c + 16), _mm_unpackhi_epi8(tl, tr));
+            _mm_storeu_si128((__m128i*) (out_bottom + c), _mm_unpacklo_epi8(bl, br));
+            _mm_storeu_si128((__m128i*) (out_bottom + c + 16), _mm_unpackhi_epi8(bl, br));
+        }
+        update_blocks_scalar(top + 2 * i, bottom + 2 * i,
+            out_top + 2 * i, out_bottom + 2 * i, num_blocks - i, lookup);
+    }
+
+    __attribute__((target("avx2")))
+    void update_blocks_avx2(const uint8_t* top, const uint8_t* bottom,
+            uint8_t* out_top, uint8_t* out_bottom, uint32_t num_blocks,
+            const BlockLookup& lookup) {
+        const __m256i top_weights = _mm256_set1_epi16(0x0408);
+        const __m256i bottom_weights = _mm256_set1_epi16(0x0102);
+        const __m256i tl_table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*) lookup.cells[0].data()));
+        const __m256i tr_table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*) lookup.cells[1].data()));
+        const __m256i bl_table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*) lookup.cells[2].data()));
+        const __m256i br_table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*) lookup.cells[3].data()));
+        uint32_t i = 0;
+        // 32 blocks (64 bytes of each row) per iteration.
+        for (; i + 32 <= num_blocks; i += 32) {
+            uint32_t c = 2 * i;
+            __m256i t0 = _mm256_loadu_si256((const __m256i*) (top + c));
+            __m256i t1 = _mm256_loadu_si256((const __m256i*) (top + c + 32));
+            __m256i b0 = _mm256_loadu_si256((const __m256i*) (bottom + c));
+            __m256i b1 = _mm256_loadu_si256((const __m256i*) (bottom + c + 32));
+            __m256i index0 = _mm256_add_epi16(
+                _mm256_maddubs_epi16(t0, top_weights), _mm256_maddubs_epi16(b0, bottom_weights));
+            __m256i index1 = _mm256_add_epi16(
+                _mm256_maddubs_epi16(t1, top_weights), _mm256_maddubs_epi16(b1, bottom_weights));
+            __m256i index = _mm256_packus_epi16(index0, index1);
+            __m256i tl = _mm256_shuffle_epi8(tl_table, index);
+            __m256i tr = _mm256_shuffle_epi8(tr_table, index);
+            __m256i bl = _mm256_shuffle_epi8(bl_table, index);
+            __m256i br = _mm256_shuffle_epi8(br_table, index);
+            _mm256_storeu_si256((__m256i*) (out_top + c), _mm256_unpacklo_epi8(tl, tr));
+            _mm256_storeu_si256((__m256i*) (out_top + c + 32), _mm256_unpackhi_epi8(tl, tr));
+            _mm256_storeu_si256((__m256i*) (out_bottom + c), _mm256_unpacklo_epi8(bl, br));
+            _mm256_storeu_si256((__m256i*) (out_bottom + c + 32), _mm256_unpackhi_epi8(bl, br));
+        }
+        // Avoid AVX to SSE transition penalties in the non-VEX encoded SSSE3 kernel.
+        _mm256_zeroupper();
+        update_blocks_ssse3(top + 2 * i, bottom + 2 * i,
+            out_top + 2 * i, out_bottom + 2 * i, num_blocks - i, lookup);
+    }
+#endif
+}
+
+bool is_kernel_supported(KernelType type) {
+    switch (type) {
+        case KernelType::AUTO:
+        case KernelType::SCALAR:
+            return true;
+#ifdef CRITTERS_X86_KERNELS
+        case KernelType::SSSE3:
+            return __builtin_cpu_supports("ssse3");
+        case KernelType::AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+KernelType best_kernel_type() {
+    if (is_kernel_supported(KernelType::AVX2)) {
+        return KernelType::AVX2;
+    }
+    if (is_kernel_supported(KernelType::SSSE3)) {
+        return KernelType::SSSE3;
+    }
+    return KernelType::SCALAR;
+}
+
+BlockRowKernel block_row_kernel(KernelType type) {
+    if (type == KernelType::AUTO) {
+        type = best_kernel_type();
+    }
+    if (!is_kernel_supported(type)) {
+        throw std::invalid_argument("kernel not supported on this CPU: " + kernel_name(type));
+    }
+    switch (type) {
+#ifdef CRITTERS_X86_KERNELS
+        case KernelType::SSSE3:
+            return update_blocks_ssse3;
+        case KernelType::AVX2:
+            return update_blocks_avx2;
+#endif
+        default:
+            return update_blocks_scalar;
+    }
+}
+
+std::string kernel_name(KernelType type) {
+    switch (type) {
+        case KernelType::AUTO: return "auto";
+        case KernelType::SCALAR: return "scalar";
+        case KernelType::SSSE3: return "ssse3";
+        case KernelType::AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+KernelType kernel_type_for_name(const std::string& name) {
+    for (KernelType type :
+            {KernelType::AUTO, KernelType::SCALAR, KernelType::SSSE3, KernelType::AVX2}) {
+        if (kernel_name(type) == name) {
+            return type;
+        }
+    }
+    throw std::invalid_argument("unknown kernel: " + name);
+}
+
+}  // namespace
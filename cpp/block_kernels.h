@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+namespace Critters {
+
+/**
+ * Lookup tables for a single transition mapping, split by output cell so that vectorized
+ * kernels can produce each cell of the next state with a single 16-entry byte shuffle.
+ */
+struct BlockLookup {
+    BlockLookup() = default;
+    // `states` is a mapping from `TransitionTable` (a StateArray, which is declared in ca.h).
+    explicit BlockLookup(const std::array<uint32_t, 16>& states);
+
+    // Indexed by output cell (top left, top right, bottom left, bottom right), then by the
+    // four bit state of the input block. Every entry is 0 or 1.
+    std::array<std::array<uint8_t, 16>, 4> cells {};
+};
+
+/**
+ * Updates `num_blocks` horizontally adjacent 2x2 blocks of a one byte per cell grid. Block `i`
+ * consists of `top[2 * i]`, `top[2 * i + 1]`, `bottom[2 * i]`, and `bottom[2 * i + 1]`, and its
+ * next state is written to the same positions of `out_top` and `out_bottom`. The outputs may
+ * be the same as the inputs, but must not otherwise overlap them.
+ */
+using BlockRowKernel = void (*)(const uint8_t* top, const uint8_t* bottom,
+    uint8_t* out_top, uint8_t* out_bottom, uint32_t num_blocks, const BlockLookup& lookup);
+
+enum class KernelType {AUTO, SCALAR, SSSE3, AVX2};
+
+/**
+ * Returns the fastest kernel type supported by the current CPU.
+ */
+KernelType best_kernel_type();
+
+bool is_kernel_supported(KernelType type);
+
+/**
+ * Returns the kernel for the given type, resolving AUTO with `best_kernel_type`. Throws
+ * std::invalid_argument if the CPU doesn't support the requested type.
+ */
+BlockRowKernel block_row_kernel(KernelType type);
+
+std::string kernel_name(KernelType type);
+KernelType kernel_type_for_name(const std::string& name);
+
+}  // namespace
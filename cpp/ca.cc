@@ -1,12 +1,16 @@
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <set>
-#include <thread>
+#include <stdexcept>
 #include <utility>
 
 #include "ca.h"
+#include "cell_batcher.h"
+#include "numa_topology.h"
 
 namespace Critters {
 
@@ -30,6 +34,31 @@ const auto INTEGER_BITS = std::array<std::array<uint8_t, 4>, 16> {{
     {1, 1, 1, 1},
 }};
 
+// Tile size in cells for multithreaded ticks. Tiles are wide so that the vectorized kernels
+// run over long stretches of each row.
+const uint32_t TILE_ROWS = 64;
+const uint32_t TILE_COLS = 2048;
+
+// Tile size in cells and maximum number of frames per pass for `MargolusCA::advance`. With
+// the border, a tile is about 80KB, which fits in L2 cache. Grids smaller than the minimum size
+// fit in cache anyway, so they're updated a frame at a time.
+const uint32_t TEMPORAL_TILE_ROWS = 128;
+const uint32_t TEMPORAL_TILE_COLS = 512;
+const uint32_t TEMPORAL_MAX_FRAMES = 8;
+const uint64_t TEMPORAL_MIN_CELLS = 1 << 20;
+
+// Tile size in cells for tracking empty regions, and the fraction of tiles above which
+// tracking them costs more than it saves. In that case, the whole grid is updated for the
+// given number of ticks before checking again.
+const uint32_t ACTIVE_TILE_ROWS = 64;
+const uint32_t ACTIVE_TILE_COLS = 128;
+const double DENSE_TILE_FRACTION = 0.5;
+const uint32_t DENSE_RECHECK_TICKS = 64;
+
+// Number of blocks that `MargolusCA::update_blocks_recording_changes` updates at a time.
+const uint32_t CHANGE_CHUNK_BLOCKS = 256;
+
+
 const auto HEX_DIGIT_MAP = std::map<char, int> {
     {'0', 0}, {'1', 1}, {'2', 2}, {'3', 3}, {'4', 4}, {'5', 5}, {'6', 6}, {'7', 7},
     {'8', 8}, {'9', 9}, {'A', 10}, {'B', 11}, {'C', 12}, {'D', 13}, {'E', 14}, {'F', 15},
@@ -91,150 +120,1306 @@ TransitionTable::TransitionTable(const StateArray& even_forward, const StateArra
     }
 }
 
+/* static */ std::unique_ptr<TransitionTable> TransitionTable::fromName(const std::string& name) {
+    if (name.empty() || name == "critters") {
+        return CRITTERS();
+    }
+    if (name == "tron") {
+        return TRON();
+    }
+    if (name == "highlander") {
+        return HIGHLANDER();
+    }
+    if (name == "billiardball") {
+        return BILLIARD_BALL();
+    }
+    if (name == "schaeffer") {
+        return SCHAEFFER();
+    }
+    if (name == "singlerotation") {
+        return SINGLE_ROTATION();
+    }
+    if (name.size() == 16 || name.size() == 32) {
+        return fromHex(name);
+    }
+    throw std::invalid_argument("Unknown CA type: " + name);
+}
+
+std::string TransitionTable::toHex() const {
+    const char* digits = "0123456789ABCDEF";
+    std::string hex;
+    for (const StateArray* states : {&m_even_forward, &m_odd_forward}) {
+        for (uint32_t s : *states) {
+            hex += digits[s];
+        }
+    }
+    return hex;
+}
+
 uint32_t TransitionTable::next_block_state(
         bool use_even_grid, bool is_forward,
         bool top_left, bool top_right, bool bottom_left, bool bottom_right) const {
     uint32_t index = (top_left << 3) | (top_right << 2) | (bottom_left << 1) | (bottom_right);
-    const StateArray& table = use_even_grid ?
-        (is_forward ? m_even_forward : m_even_backward) :
-        (is_forward ? m_odd_forward : m_odd_backward);
-    return table[index];
+    return states(use_even_grid, is_forward)[index];
 }
 
-MargolusCA::MargolusCA(
+MargolusEngine::MargolusEngine(
         uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transition_table) {
     m_num_rows = num_rows;
     m_num_cols = num_cols;
     m_transition_table = transition_table;
-    m_grid.resize(num_cells(), 0);
-    m_scratch_grid.resize(num_cells(), 0);
 }
 
-bool MargolusCA::at(uint32_t row, uint32_t col) const {
-    return m_grid[index_for_rc(row, col)];
+void MargolusEngine::set_cells(const std::vector<std::vector<uint32_t>>& cells, bool active) {
+    std::vector<uint32_t> coords;
+    coords.reserve(2 * cells.size());
+    for (auto& rc : cells) {
+        coords.push_back(rc[0]);
+        coords.push_back(rc[1]);
+    }
+    set_cells(coords.data(), cells.size(), active);
 }
 
-void MargolusCA::set_cells(const std::vector<std::vector<uint32_t>>& cells, bool active) {
-    for (auto& rc : cells) {
-        m_grid[index_for_rc(rc[0], rc[1])] = active;
+void MargolusEngine::visit_active_cells(const CellVisitor& visit) const {
+    CellBatcher<uint32_t> batcher(visit);
+    std::vector<uint64_t> row(num_row_words());
+    for (uint32_t r = 0; r < num_rows(); r++) {
+        get_row_bits(r, row.data());
+        for (uint32_t i = 0; i < num_row_words(); i++) {
+            for (uint64_t bits = row[i]; bits; bits &= bits - 1) {
+                batcher.add(r, 64 * i + __builtin_ctzll(bits));
+            }
+        }
     }
+    batcher.flush();
 }
 
-std::vector<std::vector<uint32_t>> MargolusCA::get_active_cells() const {
+std::vector<std::vector<uint32_t>> MargolusEngine::get_active_cells() const {
     std::vector<std::vector<uint32_t>> cells;
-    for (uint32_t r = 0; r < num_rows(); r++) {
+    visit_active_cells([&cells](const uint32_t* coords, size_t num_cells) {
+        for (size_t i = 0; i < num_cells; i++) {
+            cells.push_back({coords[2 * i], coords[2 * i + 1]});
+        }
+    });
+    return cells;
+}
+
+void MargolusEngine::get_row_bits(uint32_t row, uint64_t* words) const {
+    std::fill(words, words + num_row_words(), 0);
+    for (uint32_t c = 0; c < num_cols(); c++) {
+        if (at(row, c)) {
+            words[c / 64] |= 1ULL << (c % 64);
+        }
+    }
+}
+
+void MargolusEngine::set_row_bits(uint32_t row, const uint64_t* words) {
+    std::vector<uint32_t> active;
+    std::vector<uint32_t> inactive;
+    for (uint32_t c = 0; c < num_cols(); c++) {
+        bool is_active = (words[c / 64] >> (c % 64)) & 1;
+        if (is_active != at(row, c)) {
+            std::vector<uint32_t>& coords = is_active ? active : inactive;
+            coords.push_back(row);
+            coords.push_back(c);
+        }
+    }
+    set_cells(active.data(), active.size() / 2, true);
+    set_cells(inactive.data(), inactive.size() / 2, false);
+}
+
+void MargolusEngine::get_rows(uint32_t first_row, uint32_t end_row, uint8_t* cells) const {
+    if (first_row > end_row || end_row > num_rows()) {
+        throw std::out_of_range("Rows are outside the grid");
+    }
+    std::vector<uint64_t> words(num_row_words());
+    for (uint32_t r = first_row; r < end_row; r++) {
+        get_row_bits(r, words.data());
         for (uint32_t c = 0; c < num_cols(); c++) {
-            if (at(r, c)) {
-                cells.push_back({r, c});
+            *cells++ = (words[c / 64] >> (c % 64)) & 1;
+        }
+    }
+}
+
+void MargolusEngine::set_rows(uint32_t first_row, uint32_t end_row, const uint8_t* cells) {
+    if (first_row > end_row || end_row > num_rows()) {
+        throw std::out_of_range("Rows are outside the grid");
+    }
+    std::vector<uint64_t> words(num_row_words());
+    for (uint32_t r = first_row; r < end_row; r++) {
+        std::fill(words.begin(), words.end(), 0);
+        for (uint32_t c = 0; c < num_cols(); c++) {
+            words[c / 64] |= (uint64_t)*cells++ << (c % 64);
+        }
+        set_row_bits(r, words.data());
+    }
+}
+
+void MargolusEngine::set_tracking_changes(bool track) {
+    m_tracking_changes = track;
+    m_previous_row_bits.clear();
+    if (track) {
+        m_previous_row_bits.resize((size_t)num_rows() * num_row_words());
+        for (uint32_t r = 0; r < num_rows(); r++) {
+            get_row_bits(r, &m_previous_row_bits[(size_t)r * num_row_words()]);
+        }
+    }
+}
+
+void MargolusEngine::take_changed_cells(const CellVisitor& visit) {
+    CellBatcher<uint32_t> batcher(visit);
+    std::vector<uint64_t> row(num_row_words());
+    for (uint32_t r = 0; r < num_rows(); r++) {
+        uint64_t* previous = &m_previous_row_bits[(size_t)r * num_row_words()];
+        get_row_bits(r, row.data());
+        for (uint32_t i = 0; i < num_row_words(); i++) {
+            uint64_t changed = row[i] ^ previous[i];
+            while (changed) {
+                batcher.add(r, 64 * i + __builtin_ctzll(changed));
+                changed &= changed - 1;
             }
+            previous[i] = row[i];
         }
     }
+    batcher.flush();
+}
+
+std::vector<std::vector<uint32_t>> MargolusEngine::take_changed_cells() {
+    std::vector<std::vector<uint32_t>> cells;
+    take_changed_cells([&cells](const uint32_t* coords, size_t num_cells) {
+        for (size_t i = 0; i < num_cells; i++) {
+            cells.push_back({coords[2 * i], coords[2 * i + 1]});
+        }
+    });
     return cells;
 }
 
+// Mask of the bits of `words[word_index]` for columns `begin` up to `end`.
+uint64_t column_range_mask(uint32_t word_index, uint32_t begin, uint32_t end) {
+    uint32_t word_start = 64 * word_index;
+    uint32_t low = std::max(begin, word_start) - word_start;
+    uint32_t high = std::min(end, word_start + 64) - word_start;
+    if (high <= low) {
+        return 0;
+    }
+    uint64_t mask = (high == 64) ? ~0ULL : (1ULL << high) - 1;
+    return mask & (~0ULL << low);
+}
+
+uint64_t MargolusEngine::population() const {
+    std::vector<uint64_t> row(num_row_words());
+    uint64_t total = 0;
+    for (uint32_t r = 0; r < num_rows(); r++) {
+        get_row_bits(r, row.data());
+        for (uint64_t word : row) {
+            total += __builtin_popcountll(word);
+        }
+    }
+    return total;
+}
+
+uint64_t MargolusEngine::region_population(
+        uint32_t top, uint32_t left, uint32_t bottom, uint32_t right) const {
+    if (top > bottom || left > right || bottom > num_rows() || right > num_cols()) {
+        throw std::out_of_range("Region is outside the grid");
+    }
+    if (left == right) {
+        return 0;
+    }
+    std::vector<uint64_t> row(num_row_words());
+    uint64_t total = 0;
+    for (uint32_t r = top; r < bottom; r++) {
+        get_row_bits(r, row.data());
+        for (uint32_t i = left / 64; i <= (right - 1) / 64; i++) {
+            total += __builtin_popcountll(row[i] & column_range_mask(i, left, right));
+        }
+    }
+    return total;
+}
+
+CellBounds MargolusEngine::bounding_box() const {
+    CellBounds bounds;
+    std::vector<uint64_t> row(num_row_words());
+    for (uint32_t r = 0; r < num_rows(); r++) {
+        get_row_bits(r, row.data());
+        for (uint32_t i = 0; i < row.size(); i++) {
+            if (row[i] == 0) {
+                continue;
+            }
+            int64_t first = 64 * i + __builtin_ctzll(row[i]);
+            int64_t last = 64 * i + 63 - __builtin_clzll(row[i]);
+            if (bounds.is_empty()) {
+                bounds.min_row = r;
+                bounds.min_col = first;
+                bounds.max_col = last;
+            }
+            bounds.max_row = r;
+            bounds.min_col = std::min(bounds.min_col, first);
+            bounds.max_col = std::max(bounds.max_col, last);
+        }
+    }
+    return bounds;
+}
+
+std::array<uint64_t, 16> MargolusEngine::block_histogram(bool even_grid) const {
+    std::array<uint64_t, 16> counts {};
+    uint32_t offset = even_grid ? 0 : 1;
+    std::vector<uint64_t> top(num_row_words());
+    std::vector<uint64_t> bottom(num_row_words());
+    auto bit = [](const std::vector<uint64_t>& words, uint32_t c) {
+        return (uint32_t)(words[c / 64] >> (c % 64)) & 1;
+    };
+    for (uint32_t r = offset; r < num_rows(); r += 2) {
+        get_row_bits(r, top.data());
+        get_row_bits((r + 1) % num_rows(), bottom.data());
+        for (uint32_t c = offset; c < num_cols(); c += 2) {
+            uint32_t right = (c + 1) % num_cols();
+            counts[(bit(top, c) << 3) | (bit(top, right) << 2) |
+                (bit(bottom, c) << 1) | bit(bottom, right)]++;
+        }
+    }
+    return counts;
+}
+
+const TorusHash& MargolusEngine::torus_hash() {
+    if (!m_torus_hash) {
+        m_torus_hash = std::make_unique<TorusHash>(num_rows(), num_cols());
+    }
+    return *m_torus_hash;
+}
+
+// Passes the active cells of each row to the hash together, in batches, since the keys for a
+// row share a factor.
+TorusHash::Value MargolusEngine::translation_hash() {
+    const TorusHash& hasher = torus_hash();
+    TorusHash::Value hash {};
+    std::vector<uint64_t> row(num_row_words());
+    const size_t batch_size = 256;
+    uint32_t cols[batch_size];
+    for (uint32_t r = 0; r < num_rows(); r++) {
+        get_row_bits(r, row.data());
+        size_t num_active = 0;
+        for (uint32_t i = 0; i < num_row_words(); i++) {
+            for (uint64_t bits = row[i]; bits; bits &= bits - 1) {
+                cols[num_active++] = 64 * i + __builtin_ctzll(bits);
+                if (num_active == batch_size) {
+                    hasher.update_row(hash, r, cols, num_active, nullptr, 0);
+                    num_active = 0;
+                }
+            }
+        }
+        if (num_active > 0) {
+            hasher.update_row(hash, r, cols, num_active, nullptr, 0);
+        }
+    }
+    return hash;
+}
+
+void MargolusEngine::advance(uint64_t num_frames) {
+    for (uint64_t i = 0; i < num_frames; i++) {
+        tick();
+    }
+}
+
+bool MargolusEngine::use_even_grid() const {
+    return (frame_number() % 2 == 0) != is_reversed();
+}
+
+MargolusCA::MargolusCA(
+        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transition_table) :
+        MargolusEngine(num_rows, num_cols, transition_table) {
+    allocate_zeroed(m_grid);
+    m_empty_blocks_stay_empty = true;
+    for (int even = 0; even < 2; even++) {
+        for (int forward = 0; forward < 2; forward++) {
+            m_lookups[even][forward] = BlockLookup(transition_table->states(even, forward));
+            m_empty_blocks_stay_empty &= (transition_table->states(even, forward)[0] == 0);
+        }
+    }
+    m_kernel = block_row_kernel(KernelType::AUTO);
+    m_num_tile_rows = (num_rows + ACTIVE_TILE_ROWS - 1) / ACTIVE_TILE_ROWS;
+    m_num_tile_cols = (num_cols + ACTIVE_TILE_COLS - 1) / ACTIVE_TILE_COLS;
+    m_tile_occupied.resize(num_tiles(), 0);
+    m_tile_touched.resize(num_tiles(), 0);
+}
+
+bool MargolusCA::at(uint32_t row, uint32_t col) const {
+    return m_grid[index_for_rc(row, col)];
+}
+
+void MargolusCA::set_cells(const uint32_t* coords, size_t num_cells, bool active) {
+    ChangeDelta delta;
+    for (size_t i = 0; i < num_cells; i++) {
+        uint32_t row = coords[2 * i];
+        uint32_t col = coords[2 * i + 1];
+        size_t index = index_for_rc(row, col);
+        if (is_counting_changes() && m_grid[index] != active) {
+            record_change(index, active, delta);
+        }
+        m_grid[index] = active;
+        if (active) {
+            uint32_t tile = (row / ACTIVE_TILE_ROWS) * m_num_tile_cols + col / ACTIVE_TILE_COLS;
+            m_tile_occupied[tile] = 1;
+        }
+    }
+    if (is_counting_changes()) {
+        add_change_delta(delta);
+    }
+}
+
+// Number of active cells in `cells`. Each cell is 0 or 1, so a popcount of 8 cells counts them.
+uint64_t count_active_cells(const uint8_t* cells, size_t num_cells) {
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 8 <= num_cells; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, cells + i, 8);
+        total += __builtin_popcountll(word);
+    }
+    for (; i < num_cells; i++) {
+        total += cells[i];
+    }
+    return total;
+}
+
+// Index of the first or last active cell in `cells`, or `num_cells` if there aren't any.
+size_t first_active_cell(const uint8_t* cells, size_t num_cells) {
+    size_t i = 0;
+    for (; i + 8 <= num_cells; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, cells + i, 8);
+        if (word != 0) {
+            return i + __builtin_ctzll(word) / 8;
+        }
+    }
+    for (; i < num_cells; i++) {
+        if (cells[i]) {
+            return i;
+        }
+    }
+    return num_cells;
+}
+
+size_t last_active_cell(const uint8_t* cells, size_t num_cells) {
+    size_t i = num_cells;
+    for (; i >= 8; i -= 8) {
+        uint64_t word;
+        std::memcpy(&word, cells + i - 8, 8);
+        if (word != 0) {
+            return i - 8 + (63 - __builtin_clzll(word)) / 8;
+        }
+    }
+    while (i > 0) {
+        i--;
+        if (cells[i]) {
+            return i;
+        }
+    }
+    return num_cells;
+}
+
+// Skips 8 inactive cells at a time, and finds the active cells in a word from its set bits.
+void MargolusCA::visit_active_cells(const CellVisitor& visit) const {
+    CellBatcher<uint32_t> batcher(visit);
+    for (uint32_t r = 0; r < num_rows(); r++) {
+        const uint8_t* row = &m_grid[index_for_rc(r, 0)];
+        uint32_t c = 0;
+        for (; c + 8 <= num_cols(); c += 8) {
+            uint64_t word;
+            std::memcpy(&word, row + c, 8);
+            for (; word != 0; word &= word - 1) {
+                batcher.add(r, c + __builtin_ctzll(word) / 8);
+            }
+        }
+        for (; c < num_cols(); c++) {
+            if (row[c]) {
+                batcher.add(r, c);
+            }
+        }
+    }
+    batcher.flush();
+}
+
+uint64_t MargolusCA::population() const {
+    return count_active_cells(m_grid.data(), m_grid.size());
+}
+
+uint64_t MargolusCA::region_population(
+        uint32_t top, uint32_t left, uint32_t bottom, uint32_t right) const {
+    if (top > bottom || left > right || bottom > num_rows() || right > num_cols()) {
+        throw std::out_of_range("Region is outside the grid");
+    }
+    uint64_t total = 0;
+    for (uint32_t r = top; r < bottom; r++) {
+        total += count_active_cells(&m_grid[index_for_rc(r, left)], right - left);
+    }
+    return total;
+}
+
+CellBounds MargolusCA::bounding_box() const {
+    CellBounds bounds;
+    for (uint32_t r = 0; r < num_rows(); r++) {
+        const uint8_t* row = &m_grid[index_for_rc(r, 0)];
+        int64_t first = first_active_cell(row, num_cols());
+        if (first == num_cols()) {
+            continue;
+        }
+        int64_t last = last_active_cell(row, num_cols());
+        if (bounds.is_empty()) {
+            bounds.min_row = r;
+            bounds.min_col = first;
+            bounds.max_col = last;
+        }
+        bounds.max_row = r;
+        bounds.min_col = std::min(bounds.min_col, first);
+        bounds.max_col = std::max(bounds.max_col, last);
+    }
+    return bounds;
+}
+
+// Counts 4 blocks at a time: each block's state is assembled from the bytes of its left and
+// right columns, and ends up in the low byte of a 16-bit lane. Separate counters for each lane
+// avoid stalls on incrementing the same counter twice in a row.
+std::array<uint64_t, 16> MargolusCA::block_histogram(bool even_grid) const {
+    const uint64_t left_bytes = 0x00FF00FF00FF00FFULL;
+    uint64_t lane_counts[4][16] = {};
+    uint32_t offset = even_grid ? 0 : 1;
+    // On odd grids, the last block in each row wraps around and is counted separately.
+    uint32_t num_blocks = num_cols() / 2 - offset;
+    for (uint32_t r = offset; r < num_rows(); r += 2) {
+        const uint8_t* top_row = &m_grid[index_for_rc(r, 0)];
+        const uint8_t* bottom_row = &m_grid[index_for_rc((r + 1) % num_rows(), 0)];
+        const uint8_t* top = top_row + offset;
+        const uint8_t* bottom = bottom_row + offset;
+        uint32_t b = 0;
+        for (; b + 4 <= num_blocks; b += 4) {
+            uint64_t t;
+            uint64_t u;
+            std::memcpy(&t, top + 2 * b, 8);
+            std::memcpy(&u, bottom + 2 * b, 8);
+            uint64_t bits = (((t << 3) | (u << 1)) & left_bytes) |
+                (((t << 2) | u) & ~left_bytes);
+            uint64_t states = (bits & left_bytes) + ((bits >> 8) & left_bytes);
+            for (int lane = 0; lane < 4; lane++) {
+                lane_counts[lane][(states >> (16 * lane)) & 0xF]++;
+            }
+        }
+        for (; b < num_blocks; b++) {
+            lane_counts[0][(top[2 * b] << 3) | (top[2 * b + 1] << 2) |
+                (bottom[2 * b] << 1) | bottom[2 * b + 1]]++;
+        }
+        if (offset) {
+            uint32_t last = num_cols() - 1;
+            lane_counts[0][(top_row[last] << 3) | (top_row[0] << 2) |
+                (bottom_row[last] << 1) | bottom_row[0]]++;
+        }
+    }
+    std::array<uint64_t, 16> counts {};
+    for (int lane = 0; lane < 4; lane++) {
+        for (int state = 0; state < 16; state++) {
+            counts[state] += lane_counts[lane][state];
+        }
+    }
+    return counts;
+}
+
+void MargolusCA::get_row_bits(uint32_t row, uint64_t* words) const {
+    const uint8_t* cells = &m_grid[index_for_rc(row, 0)];
+    std::fill(words, words + num_row_words(), 0);
+    uint32_t c = 0;
+    // Packs 8 cells at a time: multiplying moves the low bit of byte i (which is the whole
+    // cell) to bit 56 + i, without any of the partial products overlapping.
+    for (; c + 8 <= num_cols(); c += 8) {
+        uint64_t eight_cells;
+        std::memcpy(&eight_cells, cells + c, 8);
+        words[c / 64] |= ((eight_cells * 0x0102040810204080ULL) >> 56) << (c % 64);
+    }
+    for (; c < num_cols(); c++) {
+        words[c / 64] |= (uint64_t)cells[c] << (c % 64);
+    }
+}
+
+void MargolusCA::set_row_bits(uint32_t row, const uint64_t* words) {
+    size_t index = index_for_rc(row, 0);
+    uint8_t* cells = &m_grid[index];
+    bool recording = is_counting_changes();
+    ChangeDelta delta;
+    for (uint32_t c = 0; c < num_cols(); c++) {
+        uint8_t cell = (words[c / 64] >> (c % 64)) & 1;
+        if (recording && cells[c] != cell) {
+            record_change(index + c, cell, delta);
+        }
+        cells[c] = cell;
+    }
+    if (recording) {
+        add_change_delta(delta);
+    }
+    // Recompute which tiles are occupied before the next sparse update.
+    m_tile_occupancy_valid = false;
+    m_ticks_until_occupancy_check = 0;
+}
+
+void MargolusCA::get_rows(uint32_t first_row, uint32_t end_row, uint8_t* cells) const {
+    if (first_row > end_row || end_row > num_rows()) {
+        throw std::out_of_range("Rows are outside the grid");
+    }
+    std::memcpy(cells, &m_grid[index_for_rc(first_row, 0)],
+        (size_t)(end_row - first_row) * num_cols());
+}
+
+void MargolusCA::set_rows(uint32_t first_row, uint32_t end_row, const uint8_t* cells) {
+    if (first_row > end_row || end_row > num_rows()) {
+        throw std::out_of_range("Rows are outside the grid");
+    }
+    size_t index = index_for_rc(first_row, 0);
+    if (is_counting_changes()) {
+        ChangeDelta delta;
+        for (uint32_t r = first_row; r < end_row; r++) {
+            size_t offset = index_for_rc(r - first_row, 0);
+            record_row_changes(index + offset, cells + offset, num_cols(), delta);
+        }
+        add_change_delta(delta);
+    }
+    std::memcpy(&m_grid[index], cells, (size_t)(end_row - first_row) * num_cols());
+    m_tile_occupancy_valid = false;
+    m_ticks_until_occupancy_check = 0;
+}
+
+void MargolusCA::set_tracking_changes(bool track) {
+    m_tracking_changes = track;
+    m_changes.clear();
+    m_changes.shrink_to_fit();
+    if (track) {
+        allocate_zeroed(m_changes);
+        if (m_numa_placement && m_pool) {
+            place_on_nodes(m_changes);
+        }
+    }
+}
+
+void MargolusCA::take_changed_cells(const CellVisitor& visit) {
+    CellBatcher<uint32_t> batcher(visit);
+    size_t n = num_cells();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, &m_changes[i], 8);
+        if (word == 0) {
+            continue;
+        }
+        for (; word != 0; word &= word - 1) {
+            size_t j = i + __builtin_ctzll(word) / 8;
+            batcher.add(j / num_cols(), j % num_cols());
+        }
+        std::memset(&m_changes[i], 0, 8);
+    }
+    for (; i < n; i++) {
+        if (m_changes[i]) {
+            batcher.add(i / num_cols(), i % num_cols());
+            m_changes[i] = 0;
+        }
+    }
+    batcher.flush();
+}
+
+void MargolusCA::set_hashing(bool hashing) {
+    m_hashing = false;
+    if (hashing) {
+        m_hash = MargolusEngine::translation_hash();
+        m_hash_population = population();
+        m_num_changes_since_hash = 0;
+        m_incremental_hash = true;
+        m_hashing = true;
+    }
+}
+
+// Keeping the hash up to date costs about as much for each cell that changes as recomputing it
+// costs for each active cell, so until the next call this does whichever would have been
+// cheaper since the last one. In a dense soup most cells change every frame, and recomputing
+// wins.
+TorusHash::Value MargolusCA::translation_hash() {
+    if (!m_hashing) {
+        return MargolusEngine::translation_hash();
+    }
+    if (!m_incremental_hash) {
+        m_hash = MargolusEngine::translation_hash();
+    }
+    m_incremental_hash = m_num_changes_since_hash <= m_hash_population;
+    m_num_changes_since_hash = 0;
+    return m_hash;
+}
+
+void MargolusCA::set_stats(RunStats* stats) {
+    m_stats = stats;
+    if (m_stats) {
+        m_stats->set_population(num_cells() - std::count(m_grid.begin(), m_grid.end(), 0));
+    }
+}
+
 void MargolusCA::reset() {
     m_reversed = false;
     m_frame_number = 0;
+    if (m_tracking_changes) {
+        for (size_t i = 0; i < num_cells(); i++) {
+            m_changes[i] ^= m_grid[i];
+        }
+    }
+    m_hash = TorusHash::Value {};
+    m_hash_population = 0;
+    if (m_stats) {
+        m_stats->set_population(0);
+    }
     std::fill(m_grid.begin(), m_grid.end(), 0);
+    std::fill(m_tile_occupied.begin(), m_tile_occupied.end(), 0);
+    m_tile_occupancy_valid = true;
+    m_ticks_until_occupancy_check = 0;
 }
 
-bool MargolusCA::use_even_grid() const {
-    return (frame_number() % 2 == 0) != is_reversed();
+void MargolusCA::set_skip_empty_tiles(bool skip) {
+    m_skip_empty_tiles = skip;
+    m_tile_occupancy_valid = false;
+    m_ticks_until_occupancy_check = 0;
 }
 
-void MargolusCA::update_2x2_block(bool is_even,
-        uint32_t top_left, uint32_t top_right,
-        uint32_t bottom_left, uint32_t bottom_right) {
-    uint32_t state_index = m_transition_table->next_block_state(is_even, !is_reversed(),
-        m_grid[top_left], m_grid[top_right], m_grid[bottom_left], m_grid[bottom_right]);
-    auto next_states = INTEGER_BITS[state_index];
-    m_scratch_grid[top_left] = next_states[0];
-    m_scratch_grid[top_right] = next_states[1];
-    m_scratch_grid[bottom_left] = next_states[2];
-    m_scratch_grid[bottom_right] = next_states[3];
+// `states` is the mapping for the current phase and direction.
+void MargolusCA::update_2x2_block(const StateArray& states,
+        size_t top_left, size_t top_right,
+        size_t bottom_left, size_t bottom_right,
+        ChangeDelta& delta) {
+    uint32_t index = (m_grid[top_left] << 3) | (m_grid[top_right] << 2) |
+        (m_grid[bottom_left] << 1) | m_grid[bottom_right];
+    auto next_states = INTEGER_BITS[states[index]];
+    if (is_counting_changes()) {
+        const size_t indices[4] = {top_left, top_right, bottom_left, bottom_right};
+        for (int i = 0; i < 4; i++) {
+            if (m_grid[indices[i]] != next_states[i]) {
+                record_change(indices[i], next_states[i], delta);
+            }
+        }
+    }
+    m_grid[top_left] = next_states[0];
+    m_grid[top_right] = next_states[1];
+    m_grid[bottom_left] = next_states[2];
+    m_grid[bottom_right] = next_states[3];
 }
 
 // All parameters must be even numbers.
 void MargolusCA::update_grid(
         uint32_t start_row, uint32_t start_col, uint32_t end_row, uint32_t end_col) {
-    // If using odd subgrids, shift the starting position and make sure to not
-    // hit the bottom or right edges; those are handled separately.
+    // If using odd subgrids, shift the starting position by one. The blocks in the last row
+    // and column then wrap around to the top and left edges.
     bool odd_grid = !use_even_grid();
-    if (odd_grid) {
-        start_row += 1;
-        start_col += 1;
-        end_row = std::min(end_row, num_rows() - 1);
-        end_col = std::min(end_col, num_cols() - 1);
-    }
-    bool has_bottom_edge = odd_grid && (end_row == num_rows() - 1);
-    bool has_right_edge = odd_grid && (end_col == num_cols() - 1);
-    // Interior points.
-    for (uint32_t r = start_row; r < end_row; r += 2) {
-        uint32_t row_offset = r * num_cols();
-        for (uint32_t c = start_col; c < end_col; c += 2) {
-            uint32_t offset = row_offset + c;
-            update_2x2_block(!odd_grid,
-                offset, offset + 1,
-                offset + num_cols(), offset + num_cols() + 1);
-        }
-    }
-    if (has_bottom_edge) {
-        // Along bottom row, wrapping to top.
-        uint32_t lastrow_offset = num_cols() * (num_rows() - 1);
-        for (uint32_t c = start_col; c < end_col; c += 2) {
-            update_2x2_block(!odd_grid,
-                lastrow_offset + c, lastrow_offset + c + 1,
-                c, c + 1);
+    uint32_t offset = odd_grid ? 1 : 0;
+    const BlockLookup& lookup = m_lookups[!odd_grid][!is_reversed()];
+    const StateArray& states = m_transition_table->states(!odd_grid, !is_reversed());
+    uint32_t first_col = start_col + offset;
+    uint32_t num_blocks = (end_col - start_col) / 2;
+    bool has_right_edge = odd_grid && (end_col == num_cols());
+    if (has_right_edge) {
+        // Handled below with `update_2x2_block`.
+        num_blocks--;
+    }
+    ChangeDelta delta;
+    for (uint32_t r = start_row + offset; r < end_row; r += 2) {
+        size_t top_offset = index_for_rc(r, 0);
+        size_t bottom_offset = index_for_rc((r + 1) % num_rows(), 0);
+        if (is_recording_changes()) {
+            update_blocks_recording_changes(top_offset + first_col, bottom_offset + first_col,
+                num_blocks, lookup, delta);
+        }
+        else if (m_stats) {
+            update_blocks_counting_changes(top_offset + first_col, bottom_offset + first_col,
+                num_blocks, lookup, delta);
+        }
+        else {
+            uint8_t* top = &m_grid[top_offset + first_col];
+            uint8_t* bottom = &m_grid[bottom_offset + first_col];
+            m_kernel(top, bottom, top, bottom, num_blocks, lookup);
+        }
+        if (has_right_edge) {
+            // Along right edge, wrapping to left.
+            update_2x2_block(states,
+                top_offset + num_cols() - 1, top_offset,
+                bottom_offset + num_cols() - 1, bottom_offset, delta);
         }
     }
-    if (has_right_edge) {
-        // Along right edge, wrapping to left.
-        for (uint32_t r = start_row; r < end_row; r += 2) {
-            uint32_t row_offset = r * num_cols();
-            update_2x2_block(!odd_grid,
-                row_offset + num_cols() - 1, row_offset,
-                row_offset + 2 * num_cols() - 1, row_offset + num_cols());
+    if (is_counting_changes()) {
+        add_change_delta(delta);
+    }
+}
+
+// Notes that the cell at `index` is about to change to `value`. Hash changes and counts are
+// added to `delta`, which is local to a task.
+void MargolusCA::record_change(size_t index, uint8_t value, ChangeDelta& delta) {
+    if (m_tracking_changes) {
+        m_changes[index] ^= 1;
+    }
+    if (m_hashing && m_incremental_hash) {
+        m_torus_hash->update(delta.hash, index / num_cols(), index % num_cols(), value);
+    }
+    if (value) {
+        delta.num_activated++;
+    }
+    else {
+        delta.num_deactivated++;
+    }
+}
+
+// Loads up to 8 cells into the bytes of a word, with zeros past `num_cells`.
+uint64_t load_cells(const uint8_t* cells, size_t num_cells) {
+    uint64_t word = 0;
+    if (num_cells >= 8) {
+        std::memcpy(&word, cells, 8);
+    }
+    else {
+        std::memcpy(&word, cells, num_cells);
+    }
+    return word;
+}
+
+// Sum of the bytes of a word. Adding pairs of bytes into 16-bit lanes and then multiplying
+// adds every lane into the top one, which is faster than popcount without the POPCNT
+// instruction.
+uint32_t sum_bytes(uint64_t word) {
+    uint64_t pairs = (word & 0x00FF00FF00FF00FFULL) + ((word >> 8) & 0x00FF00FF00FF00FFULL);
+    return (pairs * 0x0001000100010001ULL) >> 48;
+}
+
+// Records which of the `num_cells` cells in a row starting at `index` differ from `new_cells`.
+// Each cell is 0 or 1, so comparing 8 cells at a time gives a word with a bit set in the byte of
+// each changed cell, which is also what flips those cells in `m_changes`. Only the hash needs
+// to visit the changed cells one at a time.
+void MargolusCA::record_row_changes(
+        size_t index, const uint8_t* new_cells, uint32_t num_cells, ChangeDelta& delta) {
+    const uint8_t* cells = &m_grid[index];
+    uint32_t row = index / num_cols();
+    uint32_t first_col = index % num_cols();
+    bool hashing = m_hashing && m_incremental_hash;
+    // Columns that changed, passed to the hash in batches.
+    const size_t batch_size = 64;
+    uint32_t activated[batch_size];
+    uint32_t deactivated[batch_size];
+    size_t num_activated = 0;
+    size_t num_deactivated = 0;
+    for (uint32_t i = 0; i < num_cells; i += 8) {
+        uint32_t n = std::min(num_cells - i, 8U);
+        uint64_t old_word = load_cells(cells + i, n);
+        uint64_t new_word = load_cells(new_cells + i, n);
+        uint64_t changed = old_word ^ new_word;
+        if (changed == 0) {
+            continue;
+        }
+        if (m_tracking_changes) {
+            uint64_t flipped = load_cells(&m_changes[index + i], n) ^ changed;
+            std::memcpy(&m_changes[index + i], &flipped, n);
+        }
+        delta.num_activated += sum_bytes(changed & new_word);
+        delta.num_deactivated += sum_bytes(changed & old_word);
+        if (!hashing) {
+            continue;
+        }
+        for (; changed != 0; changed &= changed - 1) {
+            uint32_t byte = __builtin_ctzll(changed) / 8;
+            if (new_cells[i + byte]) {
+                activated[num_activated++] = first_col + i + byte;
+            }
+            else {
+                deactivated[num_deactivated++] = first_col + i + byte;
+            }
+            if (num_activated == batch_size || num_deactivated == batch_size) {
+                m_torus_hash->update_row(delta.hash, row,
+                    activated, num_activated, deactivated, num_deactivated);
+                num_activated = 0;
+                num_deactivated = 0;
+            }
         }
     }
-    if (has_bottom_edge && has_right_edge) {
-        // "Top left" at bottom right, wrapping to the other corners.
-        update_2x2_block(!odd_grid,
-            num_rows() * num_cols() - 1, (num_rows() - 1) * num_cols(),
-            num_cols() - 1, 0);
+    if (num_activated > 0 || num_deactivated > 0) {
+        m_torus_hash->update_row(
+            delta.hash, row, activated, num_activated, deactivated, num_deactivated);
     }
 }
 
-// You might think that it would be better to have a thread pool rather than creating
-// threads on every call to `tick`. At least in initial testing, it turns out that a
-// thread pool is actually slower due to the required synchronization, which also makes the
-// code much more complex. For small grids (e.g. 100x100), threads don't help at all.
-void MargolusCA::tick() {
+// Adds the number of cells that differ between `old_cells` and `new_cells` to `delta`. The
+// changed cells of each word of 8 are added up in the bytes of a word, which can each count up
+// to 255 before they have to be added together.
+void MargolusCA::count_changes(const uint8_t* old_cells, const uint8_t* new_cells,
+        uint32_t num_cells, ChangeDelta& delta) const {
+    const uint32_t max_words_per_sum = 255;
+    uint32_t i = 0;
+    while (i + 8 <= num_cells) {
+        uint64_t activated = 0;
+        uint64_t deactivated = 0;
+        uint32_t end = std::min(num_cells / 8 * 8, i + 8 * max_words_per_sum);
+        for (; i < end; i += 8) {
+            uint64_t old_word;
+            uint64_t new_word;
+            std::memcpy(&old_word, old_cells + i, 8);
+            std::memcpy(&new_word, new_cells + i, 8);
+            activated += new_word & ~old_word;
+            deactivated += old_word & ~new_word;
+        }
+        delta.num_activated += sum_bytes(activated);
+        delta.num_deactivated += sum_bytes(deactivated);
+    }
+    for (; i < num_cells; i++) {
+        delta.num_activated += new_cells[i] & ~old_cells[i];
+        delta.num_deactivated += old_cells[i] & ~new_cells[i];
+    }
+}
+
+void MargolusCA::add_change_delta(const ChangeDelta& delta) {
+    if (m_hashing) {
+        std::lock_guard<std::mutex> lock(m_hash_mutex);
+        if (m_incremental_hash) {
+            m_torus_hash->combine(m_hash, delta.hash);
+        }
+        m_num_changes_since_hash += delta.num_activated + delta.num_deactivated;
+        m_hash_population += delta.num_activated;
+        m_hash_population -= delta.num_deactivated;
+    }
+    if (m_stats) {
+        m_stats->add_changes(delta.num_activated, delta.num_deactivated);
+    }
+}
+
+// Same as calling the kernel on the blocks starting at grid indices `top` and `bottom`, but the
+// kernel writes to small buffers that are compared with the grid before they're copied back.
+void MargolusCA::update_blocks_recording_changes(size_t top, size_t bottom,
+        uint32_t num_blocks, const BlockLookup& lookup, ChangeDelta& delta) {
+    uint8_t new_top[2 * CHANGE_CHUNK_BLOCKS];
+    uint8_t new_bottom[2 * CHANGE_CHUNK_BLOCKS];
+    for (uint32_t b = 0; b < num_blocks; b += CHANGE_CHUNK_BLOCKS) {
+        uint32_t n = std::min(CHANGE_CHUNK_BLOCKS, num_blocks - b);
+        uint8_t* top_cells = &m_grid[top + 2 * b];
+        uint8_t* bottom_cells = &m_grid[bottom + 2 * b];
+        m_kernel(top_cells, bottom_cells, new_top, new_bottom, n, lookup);
+        record_row_changes(top + 2 * b, new_top, 2 * n, delta);
+        record_row_changes(bottom + 2 * b, new_bottom, 2 * n, delta);
+        std::copy(new_top, new_top + 2 * n, top_cells);
+        std::copy(new_bottom, new_bottom + 2 * n, bottom_cells);
+    }
+}
+
+// Runs the kernel in place on the blocks starting at grid indices `top` and `bottom`, and counts
+// the cells that changed by comparing them with a copy of the cells from before.
+void MargolusCA::update_blocks_counting_changes(size_t top, size_t bottom,
+        uint32_t num_blocks, const BlockLookup& lookup, ChangeDelta& delta) {
+    uint8_t old_top[2 * CHANGE_CHUNK_BLOCKS];
+    uint8_t old_bottom[2 * CHANGE_CHUNK_BLOCKS];
+    for (uint32_t b = 0; b < num_blocks; b += CHANGE_CHUNK_BLOCKS) {
+        uint32_t n = std::min(CHANGE_CHUNK_BLOCKS, num_blocks - b);
+        uint8_t* top_cells = &m_grid[top + 2 * b];
+        uint8_t* bottom_cells = &m_grid[bottom + 2 * b];
+        std::memcpy(old_top, top_cells, 2 * n);
+        std::memcpy(old_bottom, bottom_cells, 2 * n);
+        m_kernel(top_cells, bottom_cells, top_cells, bottom_cells, n, lookup);
+        count_changes(old_top, top_cells, 2 * n, delta);
+        count_changes(old_bottom, bottom_cells, 2 * n, delta);
+    }
+}
+
+void MargolusCA::set_numa_placement(bool numa) {
+    if (numa != m_numa_placement) {
+        m_numa_placement = numa;
+        // Started again when it's next needed.
+        m_pool.reset();
+    }
+}
+
+// Creates the worker pool if it doesn't exist or has a different number of threads. With NUMA
+// placement, its threads are pinned and the grid is moved to match.
+void MargolusCA::start_pool(uint32_t nthreads) {
+    if (m_pool && m_pool->num_threads() == nthreads) {
+        return;
+    }
+    // Destroyed first, so that a pinned pool restores the calling thread's CPUs.
+    m_pool.reset();
+    if (!m_numa_placement) {
+        m_pool = std::make_unique<WorkerPool>(nthreads);
+        return;
+    }
+    m_pool = std::make_unique<WorkerPool>(
+        nthreads, NumaTopology::detect().cpus_for_threads(nthreads));
+    place_on_nodes(m_grid);
+    if (m_tracking_changes) {
+        place_on_nodes(m_changes);
+    }
+}
+
+// Resizes `cells` to one byte per cell, all zero. Large arrays are mapped, and so already zero,
+// so they aren't written here; their pages are allocated on the NUMA node of whichever thread
+// writes them first, which `place_on_nodes` relies on.
+void MargolusCA::allocate_zeroed(GridBytes& cells) {
+    cells.resize(num_cells());
+    if (!GridBytes::allocator_type::is_mapped(cells.size())) {
+        std::fill(cells.begin(), cells.end(), 0);
+    }
+}
+
+// Moves the pages of `cells`, which has one byte per cell, so that each thread of the pinned
+// pool has an equal band of rows on its own node. A pinned pool runs task i of a batch of N on
+// thread i, and passes over the whole grid list their tiles in row major order, so these are the
+// rows that each thread updates (give or take a partial tile row). Each thread copies its band
+// out a huge page at a time, discards the page, and copies it back, so at most one page per
+// thread is copied at once. Pages that haven't been written yet are just zero, and the ones that
+// span two bands stay where they are.
+void MargolusCA::place_on_nodes(GridBytes& cells) {
+    using Allocator = GridBytes::allocator_type;
+    if (!Allocator::is_mapped(cells.size())) {
+        return;
+    }
+    uint32_t nthreads = m_pool->num_threads();
+    m_pool->run(nthreads, [this, &cells, nthreads](uint32_t i, uint32_t) {
+        const size_t page_size = Allocator::HUGE_PAGE_SIZE;
+        size_t begin = index_for_rc((uint64_t)num_rows() * i / nthreads, 0);
+        size_t end = index_for_rc((uint64_t)num_rows() * (i + 1) / nthreads, 0);
+        std::vector<uint8_t> page(page_size);
+        for (size_t p = (begin + page_size - 1) / page_size * page_size;
+                p + page_size <= end; p += page_size) {
+            std::memcpy(page.data(), &cells[p], page_size);
+            Allocator::discard(&cells[p], page_size);
+            std::memcpy(&cells[p], page.data(), page_size);
+        }
+    });
+}
+
+// Decides whether to split the next tick across the worker pool (see `PoolCrossover`).
+bool MargolusCA::should_use_pool() {
     uint32_t nthreads = num_threads();
     if (nthreads <= 1) {
-        update_grid(0, 0, num_rows(), num_cols());
+        return false;
+    }
+    start_pool(nthreads);
+    return m_pool_crossover.should_use_pool(*m_pool);
+}
+
+void MargolusCA::run_tasks(bool parallel,
+        uint32_t num_tasks, const std::function<void(uint32_t, uint32_t)>& task) {
+    std::function<void(uint32_t, uint32_t)> timed_task;
+    if (m_stats) {
+        timed_task = [this, &task](uint32_t i, uint32_t thread_index) {
+            auto start = std::chrono::steady_clock::now();
+            task(i, thread_index);
+            std::chrono::duration<uint64_t, std::nano> elapsed =
+                std::chrono::steady_clock::now() - start;
+            m_stats->add_busy_ns(thread_index, elapsed.count());
+        };
+    }
+    const auto& run_task = m_stats ? timed_task : task;
+    if (parallel) {
+        m_pool->run(num_tasks, run_task);
     }
     else {
-        // Spawn N-1 threads, handling the last batch in the main thread.
-        std::vector<std::thread> threads;
-        for (uint32_t i = 0; i < nthreads; i++) {
-            uint32_t start_row = 2 * (i * (num_rows() / 2) / nthreads);
-            uint32_t end_row = 2 * ((i + 1) * (num_rows() / 2) / nthreads);
-            if (i < nthreads - 1) {
-                std::thread t(
-                    [this, start_row, end_row] {update_grid(start_row, 0, end_row, num_cols());});
-                threads.push_back(std::move(t));
+        for (uint32_t i = 0; i < num_tasks; i++) {
+            run_task(i, 0);
+        }
+    }
+}
+
+// Updates the blocks whose top left cell is in the given tile. On odd frames those extend into
+// the tiles to the right and below.
+void MargolusCA::update_tile(uint32_t tile) {
+    uint32_t start_row = (tile / m_num_tile_cols) * ACTIVE_TILE_ROWS;
+    uint32_t start_col = (tile % m_num_tile_cols) * ACTIVE_TILE_COLS;
+    update_grid(start_row, start_col,
+        std::min(start_row + ACTIVE_TILE_ROWS, num_rows()),
+        std::min(start_col + ACTIVE_TILE_COLS, num_cols()));
+}
+
+bool MargolusCA::tile_has_active_cells(uint32_t tile) const {
+    uint32_t start_row = (tile / m_num_tile_cols) * ACTIVE_TILE_ROWS;
+    uint32_t start_col = (tile % m_num_tile_cols) * ACTIVE_TILE_COLS;
+    uint32_t end_row = std::min(start_row + ACTIVE_TILE_ROWS, num_rows());
+    uint32_t width = std::min(start_col + ACTIVE_TILE_COLS, num_cols()) - start_col;
+    for (uint32_t r = start_row; r < end_row; r++) {
+        const uint8_t* cells = &m_grid[index_for_rc(r, start_col)];
+        uint64_t any = 0;
+        uint32_t c = 0;
+        for (; c + 8 <= width; c += 8) {
+            uint64_t word;
+            std::memcpy(&word, cells + c, 8);
+            any |= word;
+        }
+        for (; c < width; c++) {
+            any |= cells[c];
+        }
+        if (any) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fills `m_active_tiles` with the tiles that need to be updated on this frame. Returns false if
+// the whole grid should be updated instead.
+bool MargolusCA::find_active_tiles() {
+    if (m_ticks_until_occupancy_check > 0) {
+        m_ticks_until_occupancy_check--;
+        return false;
+    }
+    if (!m_tile_occupancy_valid) {
+        for (uint32_t t = 0; t < num_tiles(); t++) {
+            m_tile_occupied[t] = tile_has_active_cells(t);
+        }
+        m_tile_occupancy_valid = true;
+    }
+    bool odd_grid = !use_even_grid();
+    m_active_tiles.clear();
+    for (uint32_t tr = 0; tr < m_num_tile_rows; tr++) {
+        uint32_t next_tr = (tr + 1) % m_num_tile_rows;
+        for (uint32_t tc = 0; tc < m_num_tile_cols; tc++) {
+            uint32_t next_tc = (tc + 1) % m_num_tile_cols;
+            bool active = m_tile_occupied[tr * m_num_tile_cols + tc];
+            if (odd_grid) {
+                active = active ||
+                    m_tile_occupied[tr * m_num_tile_cols + next_tc] ||
+                    m_tile_occupied[next_tr * m_num_tile_cols + tc] ||
+                    m_tile_occupied[next_tr * m_num_tile_cols + next_tc];
             }
-            else {
-                update_grid(start_row, 0, end_row, num_cols());
+            if (active) {
+                m_active_tiles.push_back(tr * m_num_tile_cols + tc);
             }
         }
-        for (auto& t : threads) {
-            t.join();
+    }
+    if (m_active_tiles.size() > DENSE_TILE_FRACTION * num_tiles()) {
+        // Full updates don't keep track of which tiles are occupied.
+        m_tile_occupancy_valid = false;
+        m_ticks_until_occupancy_check = DENSE_RECHECK_TICKS;
+        return false;
+    }
+    return true;
+}
+
+// Rechecks the tiles that could have changed in the last update of `m_active_tiles`.
+void MargolusCA::update_tile_occupancy(bool parallel) {
+    bool odd_grid = !use_even_grid();
+    m_touched_tiles.clear();
+    auto touch = [this](uint32_t tile) {
+        if (!m_tile_touched[tile]) {
+            m_tile_touched[tile] = 1;
+            m_touched_tiles.push_back(tile);
+        }
+    };
+    for (uint32_t tile : m_active_tiles) {
+        touch(tile);
+        if (odd_grid) {
+            uint32_t tr = tile / m_num_tile_cols;
+            uint32_t tc = tile % m_num_tile_cols;
+            uint32_t next_tr = (tr + 1) % m_num_tile_rows;
+            uint32_t next_tc = (tc + 1) % m_num_tile_cols;
+            touch(tr * m_num_tile_cols + next_tc);
+            touch(next_tr * m_num_tile_cols + tc);
+            touch(next_tr * m_num_tile_cols + next_tc);
+        }
+    }
+    run_tasks(parallel, m_touched_tiles.size(), [this](uint32_t i, uint32_t) {
+        uint32_t tile = m_touched_tiles[i];
+        m_tile_occupied[tile] = tile_has_active_cells(tile);
+        m_tile_touched[tile] = 0;
+    });
+}
+
+bool MargolusCA::is_mostly_empty() {
+    if (!m_tile_occupancy_valid) {
+        for (uint32_t t = 0; t < num_tiles(); t++) {
+            m_tile_occupied[t] = tile_has_active_cells(t);
         }
+        m_tile_occupancy_valid = true;
+        m_ticks_until_occupancy_check = 0;
+    }
+    uint32_t occupied = std::count(m_tile_occupied.begin(), m_tile_occupied.end(), 1);
+    return occupied <= DENSE_TILE_FRACTION * num_tiles();
+}
+
+// Each tick is split into tiles that the worker pool schedules dynamically, so threads that
+// fall behind (because the machine is busy, or their memory is further away) get help from the
+// others instead of holding up the whole tick. The pool's threads live as long as the grid, so
+// the per tick cost is just waking them up.
+void MargolusCA::tick() {
+    bool parallel = should_use_pool();
+    auto start = std::chrono::steady_clock::now();
+    if (is_skipping_empty_tiles() && find_active_tiles()) {
+        m_num_active_tiles = m_active_tiles.size();
+        run_tasks(parallel, m_active_tiles.size(),
+            [this](uint32_t i, uint32_t) {update_tile(m_active_tiles[i]);});
+        update_tile_occupancy(parallel);
+    }
+    else {
+        m_num_active_tiles = num_tiles();
+        uint32_t tile_rows = (num_rows() + TILE_ROWS - 1) / TILE_ROWS;
+        uint32_t tile_cols = (num_cols() + TILE_COLS - 1) / TILE_COLS;
+        run_tasks(parallel, tile_rows * tile_cols, [this, tile_cols](uint32_t tile, uint32_t) {
+            uint32_t start_row = (tile / tile_cols) * TILE_ROWS;
+            uint32_t start_col = (tile % tile_cols) * TILE_COLS;
+            update_grid(start_row, start_col,
+                std::min(start_row + TILE_ROWS, num_rows()),
+                std::min(start_col + TILE_COLS, num_cols()));
+        });
+    }
+    bool timing_serial_tick = !parallel && num_threads() > 1 && m_pool_crossover.is_timing();
+    std::chrono::duration<double, std::nano> elapsed {0};
+    if (timing_serial_tick || m_stats) {
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    if (timing_serial_tick) {
+        m_pool_crossover.record_serial_tick(elapsed.count());
     }
-    // `m_scratch_grid` now holds the state for the next frame, so swap it with `m_grid`.
-    std::swap(m_grid, m_scratch_grid);
     m_frame_number += (is_reversed()) ? -1 : 1;
+    if (m_stats) {
+        m_stats->record_active_tiles(1, m_num_active_tiles, num_tiles());
+        m_stats->record_frames(m_frame_number, 1, num_cells(),
+            parallel ? m_pool->num_threads() : 1, elapsed.count());
+    }
+}
+
+// Copies the cells within `border` of each boundary between tiles into `m_row_halos` and
+// `m_col_halos`, so that tiles can read their borders after the neighboring tiles have been
+// written back. Halos wrap around the edges of the grid, and if `border` is larger than a tile,
+// cells appear in more than one halo.
+void MargolusCA::capture_halos(bool parallel, uint32_t border) {
+    uint32_t tile_rows = (num_rows() + TEMPORAL_TILE_ROWS - 1) / TEMPORAL_TILE_ROWS;
+    uint32_t tile_cols = (num_cols() + TEMPORAL_TILE_COLS - 1) / TEMPORAL_TILE_COLS;
+    m_row_halos.resize((size_t)tile_rows * 2 * border * num_cols());
+    m_col_halos.resize((size_t)tile_cols * num_rows() * 2 * border);
+    // Each task captures the rows around the top of a tile row, and the columns around the
+    // tile boundaries within it.
+    run_tasks(parallel, tile_rows, [this, border, tile_cols](uint32_t tr, uint32_t) {
+        uint32_t first_row = tr * TEMPORAL_TILE_ROWS + num_rows() - border % num_rows();
+        for (uint32_t k = 0; k < 2 * border; k++) {
+            const uint8_t* src = &m_grid[index_for_rc((first_row + k) % num_rows(), 0)];
+            std::copy(src, src + num_cols(),
+                &m_row_halos[((size_t)tr * 2 * border + k) * num_cols()]);
+        }
+        uint32_t end_row = std::min(tr * TEMPORAL_TILE_ROWS + TEMPORAL_TILE_ROWS, num_rows());
+        for (uint32_t tc = 0; tc < tile_cols; tc++) {
+            uint32_t first_col = tc * TEMPORAL_TILE_COLS + num_cols() - border % num_cols();
+            for (uint32_t r = tr * TEMPORAL_TILE_ROWS; r < end_row; r++) {
+                const uint8_t* src = &m_grid[index_for_rc(r, 0)];
+                uint8_t* dst = &m_col_halos[((size_t)tc * num_rows() + r) * 2 * border];
+                for (uint32_t k = 0; k < 2 * border; k++) {
+                    dst[k] = src[(first_col + k) % num_cols()];
+                }
+            }
+        }
+    });
+}
+
+// Copies the tile at `tile_row` and `tile_col` plus a border of `num_frames` cells (rounded up
+// to even) into `buffer`, advances it `num_frames` frames, and writes the tile back to `m_grid`.
+// The border comes from the halos captured at the start of the pass, and wraps around the edges
+// of the grid. If the grid is smaller than the buffer, cells appear more than once; that's fine
+// because each copy evolves exactly as the original would.
+void MargolusCA::advance_tile(uint32_t tile_row, uint32_t tile_col, uint32_t num_frames,
+        std::vector<uint8_t>& buffer) {
+    uint32_t tile_rows = (num_rows() + TEMPORAL_TILE_ROWS - 1) / TEMPORAL_TILE_ROWS;
+    uint32_t tile_cols = (num_cols() + TEMPORAL_TILE_COLS - 1) / TEMPORAL_TILE_COLS;
+    uint32_t start_row = tile_row * TEMPORAL_TILE_ROWS;
+    uint32_t start_col = tile_col * TEMPORAL_TILE_COLS;
+    uint32_t end_row = std::min(start_row + TEMPORAL_TILE_ROWS, num_rows());
+    uint32_t end_col = std::min(start_col + TEMPORAL_TILE_COLS, num_cols());
+    uint32_t tile_height = end_row - start_row;
+    uint32_t tile_width = end_col - start_col;
+    uint32_t border = num_frames + (num_frames % 2);
+    uint32_t height = tile_height + 2 * border;
+    uint32_t width = tile_width + 2 * border;
+    buffer.resize((size_t)height * width);
+    // The buffer starts at an even row and column of the grid, so blocks line up the same way.
+    uint32_t first_col = (start_col + num_cols() - border % num_cols()) % num_cols();
+    auto copy_halo_row = [this, &buffer, width, first_col](const uint8_t* src_row, uint32_t r) {
+        uint8_t* dst = &buffer[(size_t)r * width];
+        uint32_t c = first_col;
+        for (uint32_t copied = 0; copied < width; ) {
+            uint32_t n = std::min(width - copied, num_cols() - c);
+            std::copy(src_row + c, src_row + c + n, dst + copied);
+            copied += n;
+            c = 0;
+        }
+    };
+    const uint8_t* top_halo = &m_row_halos[(size_t)tile_row * 2 * border * num_cols()];
+    const uint8_t* bottom_halo =
+        &m_row_halos[((size_t)((tile_row + 1) % tile_rows) * 2 + 1) * border * num_cols()];
+    const uint8_t* left_halo = &m_col_halos[(size_t)tile_col * num_rows() * 2 * border];
+    const uint8_t* right_halo =
+        &m_col_halos[(size_t)((tile_col + 1) % tile_cols) * num_rows() * 2 * border + border];
+    for (uint32_t i = 0; i < border; i++) {
+        copy_halo_row(top_halo + (size_t)i * num_cols(), i);
+        copy_halo_row(bottom_halo + (size_t)i * num_cols(), border + tile_height + i);
+    }
+    for (uint32_t r = start_row; r < end_row; r++) {
+        uint8_t* dst = &buffer[(size_t)(r - start_row + border) * width];
+        const uint8_t* left = left_halo + (size_t)r * 2 * border;
+        const uint8_t* right = right_halo + (size_t)r * 2 * border;
+        const uint8_t* cells = &m_grid[index_for_rc(r, start_col)];
+        std::copy(left, left + border, dst);
+        std::copy(cells, cells + tile_width, dst + border);
+        std::copy(right, right + border, dst + border + tile_width);
+    }
+    // Blocks that extend past the buffer are skipped, so the cells near the edges become
+    // invalid, one more row and column every frame. Each frame only needs to update the part
+    // of the buffer that can still affect the tile, which shrinks in the same way.
+    bool even = use_even_grid();
+    for (uint32_t f = 0; f < num_frames; f++) {
+        const BlockLookup& lookup = m_lookups[even][!is_reversed()];
+        uint32_t offset = even ? 0 : 1;
+        uint32_t margin = (f >= 2) ? ((f - 2) & ~1U) : 0;
+        uint32_t first_block_col = margin + offset;
+        uint32_t num_blocks = (width - margin - first_block_col) / 2;
+        for (uint32_t r = margin + offset; r + 1 < height - margin; r += 2) {
+            uint8_t* top = &buffer[(size_t)r * width + first_block_col];
+            uint8_t* bottom = top + width;
+            m_kernel(top, bottom, top, bottom, num_blocks, lookup);
+        }
+        even = !even;
+    }
+    ChangeDelta delta;
+    for (uint32_t r = start_row; r < end_row; r++) {
+        const uint8_t* src = &buffer[(size_t)(r - start_row + border) * width + border];
+        size_t index = index_for_rc(r, start_col);
+        if (is_counting_changes()) {
+            // Each tile only writes its own part of `m_changes`.
+            record_row_changes(index, src, tile_width, delta);
+        }
+        std::copy(src, src + tile_width, &m_grid[index]);
+    }
+    if (is_counting_changes()) {
+        add_change_delta(delta);
+    }
+}
+
+void MargolusCA::advance(uint64_t num_frames) {
+    // Sparse grids are faster to update one frame at a time, skipping the empty tiles.
+    if (num_cells() < TEMPORAL_MIN_CELLS || (is_skipping_empty_tiles() && is_mostly_empty())) {
+        MargolusEngine::advance(num_frames);
+        return;
+    }
+    m_tile_occupancy_valid = false;
+    // Every tile is updated.
+    m_num_active_tiles = num_tiles();
+    uint32_t tile_rows = (num_rows() + TEMPORAL_TILE_ROWS - 1) / TEMPORAL_TILE_ROWS;
+    uint32_t tile_cols = (num_cols() + TEMPORAL_TILE_COLS - 1) / TEMPORAL_TILE_COLS;
+    uint32_t nthreads = std::max(num_threads(), 1U);
+    if (nthreads > 1) {
+        start_pool(nthreads);
+    }
+    m_tile_buffers.resize(nthreads);
+    while (num_frames > 0) {
+        uint32_t frames = std::min<uint64_t>(num_frames, TEMPORAL_MAX_FRAMES);
+        auto advance_one_tile = [this, tile_cols, frames](uint32_t tile, uint32_t thread_index) {
+            advance_tile(tile / tile_cols, tile % tile_cols, frames, m_tile_buffers[thread_index]);
+        };
+        auto start = std::chrono::steady_clock::now();
+        capture_halos(nthreads > 1, frames + (frames % 2));
+        run_tasks(nthreads > 1, tile_rows * tile_cols, advance_one_tile);
+        m_frame_number += (is_reversed()) ? -(int64_t)frames : frames;
+        num_frames -= frames;
+        if (m_stats) {
+            std::chrono::duration<double, std::nano> elapsed =
+                std::chrono::steady_clock::now() - start;
+            m_stats->record_active_tiles(frames, num_tiles(), num_tiles());
+            m_stats->record_frames(m_frame_number, frames, num_cells(), nthreads, elapsed.count());
+        }
+    }
 }
 
 }  // namespace
@@ -1,13 +1,47 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
+#include <functional>
 #include <memory>
 #include <vector>
 
+#include "block_kernels.h"
+#include "huge_page_allocator.h"
+#include "run_stats.h"
+#include "torus_hash.h"
+#include "worker_pool.h"
+
 namespace Critters {
 
 using StateArray = std::array<uint32_t, 16>;
 
+// Mappings of the built-in rules for `TransitionTable`, described there. They're constants so
+// that engines can generate code for them at compile time.
+constexpr StateArray CRITTERS_EVEN_STATES {
+    0b0000, 0b0001, 0b0010, 0b1100, 0b0100, 0b1010, 0b1001, 0b1110,
+    0b1000, 0b0110, 0b0101, 0b1101, 0b0011, 0b1011, 0b0111, 0b1111,
+};
+constexpr StateArray CRITTERS_ODD_STATES {
+    0b0000, 0b1000, 0b0100, 0b1100, 0b0010, 0b1010, 0b1001, 0b0111,
+    0b0001, 0b0110, 0b0101, 0b1011, 0b0011, 0b1101, 0b1110, 0b1111,
+};
+constexpr StateArray TRON_STATES {0, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 15};
+constexpr StateArray HIGHLANDER_STATES {
+    0b0000, 0b0100, 0b0001, 0b1100, 0b1000, 0b1010, 0b1001, 0b1011,
+    0b0010, 0b0110, 0b0101, 0b1110, 0b0011, 0b0111, 0b1101, 0b1111,
+};
+constexpr StateArray BILLIARD_BALL_STATES {
+    0b0000, 0b1000, 0b0100, 0b0011, 0b0010, 0b0101, 0b1001, 0b0111,
+    0b0001, 0b0110, 0b1010, 0b1011, 0b1100, 0b1101, 0b1110, 0b1111,
+};
+constexpr StateArray SCHAEFFER_STATES {
+    0b0000, 0b1000, 0b0100, 0b1100, 0b0010, 0b1010, 0b0110, 0b0111,
+    0b0001, 0b1001, 0b0101, 0b1011, 0b0011, 0b1101, 0b1110, 0b1111,
+};
+constexpr StateArray SINGLE_ROTATION_STATES {0, 2, 8, 3, 1, 5, 6, 7, 4, 9, 10, 11, 12, 13, 14, 15};
+
 /**
  * Transition table for a 2x2 block of a cellular automaton using the Margolus neighborhood.
  * On every tick, the grid is divided into 2x2 blocks. On odd ticks, the blocks are shifted
@@ -34,6 +68,16 @@ public:
         bool use_even_grid, bool is_forward,
         bool top_left, bool top_right, bool bottom_left, bool bottom_right) const;
 
+    /**
+     * Returns the full mapping used by `next_block_state` for the given phase and direction,
+     * for engines that evaluate many blocks at once rather than calling it per block.
+     */
+    const StateArray& states(bool use_even_grid, bool is_forward) const {
+        return use_even_grid ?
+            (is_forward ? m_even_forward : m_even_backward) :
+            (is_forward ? m_odd_forward : m_odd_backward);
+    }
+
     /**
      * Creates a transition table from a hex string of 16 or 32 characters, describing one or two
      * mappings from input to output blocks. A mapping should contain every hex digit from 0 to F
@@ -41,21 +85,26 @@ public:
      */
     static std::unique_ptr<TransitionTable> fromHex(const std::string& hex);
 
+    /**
+     * Creates the transition table for a rule given by name ("critters", "tron", "highlander",
+     * "billiardball", "schaeffer", or "singlerotation"), or as hex digits for `fromHex`. An
+     * empty name is Critters. Throws std::invalid_argument for anything else.
+     */
+    static std::unique_ptr<TransitionTable> fromName(const std::string& name);
+
+    /**
+     * Returns a 32 character hex string of the even and odd forward mappings, which `fromHex`
+     * turns back into an identical table.
+     */
+    std::string toHex() const;
+
     // https://en.wikipedia.org/wiki/Critters_(block_cellular_automaton)
     // We use the variation that has different transitions for even and odd frames.
     // This preserves the number of active cells.
     static std::unique_ptr<TransitionTable> CRITTERS() {
         // If two cells are active, invert the block. Rotate a half turn if three cells are active
         // on an even frame, or if one cell is active on an odd frame.
-        return std::make_unique<TransitionTable>(
-                StateArray {
-                    0b0000, 0b0001, 0b0010, 0b1100, 0b0100, 0b1010, 0b1001, 0b1110,
-                    0b1000, 0b0110, 0b0101, 0b1101, 0b0011, 0b1011, 0b0111, 0b1111,
-                },
-                StateArray {
-                    0b0000, 0b1000, 0b0100, 0b1100, 0b0010, 0b1010, 0b1001, 0b0111,
-                    0b0001, 0b0110, 0b0101, 0b1011, 0b0011, 0b1101, 0b1110, 0b1111,
-                });
+        return std::make_unique<TransitionTable>(CRITTERS_EVEN_STATES, CRITTERS_ODD_STATES);
     }
 
     // https://en.wikipedia.org/wiki/Reversible_cellular_automaton#Synchronization
@@ -65,19 +114,14 @@ public:
     // entire grid, so the overall behavior is the same.
     static std::unique_ptr<TransitionTable> TRON(){
         // 0000 and 1111 are unchanged, everything else inverts (i => 15-i).
-        return std::make_unique<TransitionTable>(
-                StateArray {0, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 15});
+        return std::make_unique<TransitionTable>(TRON_STATES);
     }
 
     // https://www.mitpressjournals.org/doi/abs/10.1162/978-0-262-32621-6-ch084
     static std::unique_ptr<TransitionTable> HIGHLANDER() {
         // Invert if two cells are active, rotate a quarter turn counterclockwise if one cell is
         // active, rotate a quarter turn clockwise if three cells are active.
-        return std::make_unique<TransitionTable>(
-                StateArray {
-                    0b0000, 0b0100, 0b0001, 0b1100, 0b1000, 0b1010, 0b1001, 0b1011,
-                    0b0010, 0b0110, 0b0101, 0b1110, 0b0011, 0b0111, 0b1101, 0b1111,
-                });
+        return std::make_unique<TransitionTable>(HIGHLANDER_STATES);
     }
 
     // https://en.wikipedia.org/wiki/Reversible_cellular_automaton#Billiard_ball_computation_and_low-power_computing
@@ -85,29 +129,20 @@ public:
     static std::unique_ptr<TransitionTable> BILLIARD_BALL() {
         // Rotate a half turn if one cell is active. Invert if two cells are active and
         // diagonally opposite.
-        return std::make_unique<TransitionTable>(
-                StateArray {
-                    0b0000, 0b1000, 0b0100, 0b0011, 0b0010, 0b0101, 0b1001, 0b0111,
-                    0b0001, 0b0110, 0b1010, 0b1011, 0b1100, 0b1101, 0b1110, 0b1111,
-                });
+        return std::make_unique<TransitionTable>(BILLIARD_BALL_STATES);
     }
 
     // https://web.mit.edu/lrs/www/physCA/
     static std::unique_ptr<TransitionTable> SCHAEFFER() {
         // Rotate a half turn if one or two cells are active. (This is a no-op if two active cells
         // are diagonally opposite).
-        return std::make_unique<TransitionTable>(
-                StateArray {
-                    0b0000, 0b1000, 0b0100, 0b1100, 0b0010, 0b1010, 0b0110, 0b0111,
-                    0b0001, 0b1001, 0b0101, 0b1011, 0b0011, 0b1101, 0b1110, 0b1111,
-                });
+        return std::make_unique<TransitionTable>(SCHAEFFER_STATES);
     }
 
     // https://dmishin.blogspot.com/2013/11/the-single-rotation-rule-remarkably.html
     static std::unique_ptr<TransitionTable> SINGLE_ROTATION() {
         // Rotate 90 degrees if one cell is active.
-        return std::make_unique<TransitionTable>(
-                StateArray {0, 2, 8, 3, 1, 5, 6, 7, 4, 9, 10, 11, 12, 13, 14, 15});
+        return std::make_unique<TransitionTable>(SINGLE_ROTATION_STATES);
     }
 
 private:
@@ -117,15 +152,38 @@ private:
     StateArray m_odd_backward;
 };
 
-class MargolusCA {
+/**
+ * Smallest rectangle containing every active cell of a grid, with inclusive bounds, or all -1
+ * if there are none. Patterns that wrap around an edge give a box spanning the whole grid.
+ */
+struct CellBounds {
+    int64_t min_row = -1;
+    int64_t min_col = -1;
+    int64_t max_row = -1;
+    int64_t max_col = -1;
+
+    bool is_empty() const {return min_row < 0;}
+};
+
+/**
+ * Receives cells from an engine `num_cells` at a time, as row/column pairs in `coords`.
+ */
+using CellVisitor = std::function<void(const uint32_t* coords, size_t num_cells)>;
+
+/**
+ * Common interface for engines that simulate a block cellular automaton on a torus. Engines
+ * differ in how they store and update the grid, but they all use the same frame numbering and
+ * even/odd block alignment, so the same input produces identical output from any of them.
+ */
+class MargolusEngine {
 public:
-    MargolusCA(
-        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transitionTable);
-    virtual ~MargolusCA() = default;
+    MargolusEngine(
+        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transition_table);
+    virtual ~MargolusEngine() = default;
 
     inline uint32_t num_rows() const {return m_num_rows;}
     inline uint32_t num_cols() const {return m_num_cols;}
-    inline uint32_t num_cells() const {return m_num_rows * m_num_cols;}
+    inline uint64_t num_cells() const {return (uint64_t)m_num_rows * m_num_cols;}
 
     inline uint32_t num_threads() const {return m_num_threads;}
     inline void set_num_threads(uint32_t nt) {m_num_threads = nt;}
@@ -136,32 +194,356 @@ public:
     bool is_reversed() const {return m_reversed;}
     void set_reversed(bool r) {m_reversed = r;}
 
-    bool at(uint32_t row, uint32_t col) const;
+    const TransitionTable& transition_table() const {return *m_transition_table;}
+
+    /**
+     * Whether the next tick updates the blocks whose top left cells are at even rows and
+     * columns, as opposed to odd ones.
+     */
+    bool use_even_grid() const;
+
+    virtual bool at(uint32_t row, uint32_t col) const = 0;
 
+    /**
+     * Sets or clears `num_cells` cells, given as row/column pairs in `coords`.
+     */
+    virtual void set_cells(const uint32_t* coords, size_t num_cells, bool active = true) = 0;
     void set_cells(const std::vector<std::vector<uint32_t>>& cells, bool active = true);
+
+    /**
+     * Calls `visit` with the active cells in row major order, in batches, so that listing a
+     * large pattern doesn't allocate anything per cell. The default implementation scans the
+     * words from `get_row_bits`.
+     */
+    virtual void visit_active_cells(const CellVisitor& visit) const;
+
+    /**
+     * Writes the active cells to `out` as row/column pairs, in the same order as
+     * `visit_active_cells`, and returns the end of the output.
+     */
+    template <typename OutputIt>
+    OutputIt copy_active_cells(OutputIt out) const {
+        visit_active_cells([&out](const uint32_t* coords, size_t num_cells) {
+            out = std::copy(coords, coords + 2 * num_cells, out);
+        });
+        return out;
+    }
+
     std::vector<std::vector<uint32_t>> get_active_cells() const;
 
-    void reset();
+    /**
+     * Number of 64-bit words used by `get_row_bits` and `set_row_bits` for a row.
+     */
+    inline uint32_t num_row_words() const {return (m_num_cols + 63) / 64;}
 
-    void tick();
+    /**
+     * Copies a row into `words`, with column `c` in bit `c % 64` of `words[c / 64]`. Bits past
+     * the last column are zero. The default implementation calls `at` for every cell.
+     */
+    virtual void get_row_bits(uint32_t row, uint64_t* words) const;
 
-private:
+    /**
+     * Replaces a row with `words`, in the same format as `get_row_bits`. Bits past the last
+     * column are ignored.
+     */
+    virtual void set_row_bits(uint32_t row, const uint64_t* words);
+
+    /**
+     * Copies rows `first_row` up to `end_row` out of or into `cells`, which has one byte per
+     * cell in row major order. Copied in cells must be 0 or 1. Throws std::out_of_range if the
+     * rows aren't within the grid. The default implementations go through `get_row_bits` and
+     * `set_row_bits`.
+     */
+    virtual void get_rows(uint32_t first_row, uint32_t end_row, uint8_t* cells) const;
+    virtual void set_rows(uint32_t first_row, uint32_t end_row, const uint8_t* cells);
+
+    /**
+     * Statistics about the current frame, which don't need the list of active cells. The
+     * default implementations count the bits from `get_row_bits`.
+     */
+    virtual uint64_t population() const;
+    /**
+     * Number of active cells in rows `top` up to `bottom` and columns `left` up to `right`,
+     * excluding `bottom` and `right`. Throws std::out_of_range if the region isn't within the
+     * grid.
+     */
+    virtual uint64_t region_population(
+        uint32_t top, uint32_t left, uint32_t bottom, uint32_t right) const;
+    virtual CellBounds bounding_box() const;
+    /**
+     * Number of blocks in each state (indexed as for `TransitionTable`, with the top left cell
+     * in bit 3) when the grid is divided into blocks at even or odd rows and columns.
+     */
+    virtual std::array<uint64_t, 16> block_histogram(bool even_grid) const;
+
+    /**
+     * Enables or disables recording which cells change. While enabled,
+     * `take_changed_cells` returns the cells whose state differs from when it was last called
+     * (or when tracking was enabled). The default implementation keeps a copy of the grid and
+     * compares it when `take_changed_cells` is called; engines can instead record changes as
+     * they update the grid.
+     */
+    virtual void set_tracking_changes(bool track);
+    bool is_tracking_changes() const {return m_tracking_changes;}
+
+    /**
+     * Calls `visit` with the cells that changed since the last call, in the same order as
+     * `visit_active_cells`, and starts recording again from the current state.
+     */
+    virtual void take_changed_cells(const CellVisitor& visit);
+    std::vector<std::vector<uint32_t>> take_changed_cells();
+
+    /**
+     * Returns hashes of the current state that change predictably when it's translated; see
+     * `TorusHash`. The default implementation computes them from the whole grid on every call.
+     * After `set_hashing(true)`, engines can instead keep them up to date as cells change.
+     */
+    virtual TorusHash::Value translation_hash();
+    virtual void set_hashing(bool hashing) {m_hashing = hashing;}
+    bool is_hashing() const {return m_hashing;}
+
+    /**
+     * The keys used by `translation_hash`, created on first use.
+     */
+    const TorusHash& torus_hash();
+
+    virtual void reset() = 0;
+
+    virtual void tick() = 0;
+
+    /**
+     * Advances the given number of frames in the current direction. This has the same result as
+     * calling `tick` that many times, but engines can override it to process several frames in
+     * one pass over the grid.
+     */
+    virtual void advance(uint64_t num_frames);
+
+protected:
     uint32_t m_num_rows;
     uint32_t m_num_cols;
-    int64_t m_frame_number;
-    bool m_reversed;
+    int64_t m_frame_number = 0;
+    bool m_reversed = false;
     uint32_t m_num_threads = 1;
-    std::vector<uint8_t> m_grid;
-    std::vector<uint8_t> m_scratch_grid;
     std::shared_ptr<TransitionTable> m_transition_table;
+    bool m_tracking_changes = false;
+    // Rows as of the last `take_changed_cells`, for the default implementation.
+    std::vector<uint64_t> m_previous_row_bits;
+    bool m_hashing = false;
+    std::unique_ptr<TorusHash> m_torus_hash;
+};
 
-    bool use_even_grid() const;
+/**
+ * The reference engine, which stores one byte per cell and updates each 2x2 block with a
+ * table lookup. Cells are indexed with 64 bits, so grids can have more than 4G cells, and the
+ * grid is the only full-size buffer; see `advance`.
+ */
+class MargolusCA : public MargolusEngine {
+public:
+    MargolusCA(
+        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transitionTable);
+
+    bool at(uint32_t row, uint32_t col) const override;
+
+    using MargolusEngine::set_cells;
+    void set_cells(const uint32_t* coords, size_t num_cells, bool active = true) override;
+    void visit_active_cells(const CellVisitor& visit) const override;
+
+    void get_row_bits(uint32_t row, uint64_t* words) const override;
+    void set_row_bits(uint32_t row, const uint64_t* words) override;
+    /**
+     * These copy whole rows of the grid at once.
+     */
+    void get_rows(uint32_t first_row, uint32_t end_row, uint8_t* cells) const override;
+    void set_rows(uint32_t first_row, uint32_t end_row, const uint8_t* cells) override;
 
-    inline uint32_t index_for_rc(uint32_t row, uint32_t col) const {return row * num_cols() + col;}
+    /**
+     * These scan the grid 8 cells at a time, counting with popcount since each cell is 0 or 1.
+     */
+    uint64_t population() const override;
+    uint64_t region_population(
+        uint32_t top, uint32_t left, uint32_t bottom, uint32_t right) const override;
+    CellBounds bounding_box() const override;
+    std::array<uint64_t, 16> block_histogram(bool even_grid) const override;
+
+    /**
+     * Changes are recorded during updates, in `m_changes`, so taking them only has to scan
+     * that for nonzero words rather than compare two copies of the grid.
+     */
+    void set_tracking_changes(bool track) override;
+    using MargolusEngine::take_changed_cells;
+    void take_changed_cells(const CellVisitor& visit) override;
+
+    /**
+     * The hash is updated along with `m_changes` as cells change, which costs a few modular
+     * additions for each cell that changes. When more cells change between calls to
+     * `translation_hash` than are active, it's recomputed on the next call instead.
+     */
+    void set_hashing(bool hashing) override;
+    TorusHash::Value translation_hash() override;
+
+    /**
+     * Starts recording into `stats`, or stops if it's null. Attaching it counts the population,
+     * which is then kept up to date by counting the cells that change (comparing each row
+     * before and after the update, 8 cells at a time), and every tick records its duration and
+     * how much of it each thread spent updating the grid.
+     * `stats` must outlive the grid or be detached first.
+     */
+    void set_stats(RunStats* stats);
+
+    void reset() override;
+
+    void tick() override;
+
+    /**
+     * Uses temporal blocking for large grids: the grid is split into tiles, and each tile plus
+     * a border of neighboring cells is copied into a small buffer and advanced several frames
+     * while it stays in cache. A cell only depends on cells at most one row or column away in
+     * the previous frame, so after k frames the cells more than k cells from the edge of the
+     * buffer are still correct, and those are copied back.
+     *
+     * Tiles are written back in place, so a tile can't read its border from the grid once
+     * the neighboring tiles have been written. Instead, the cells near every tile boundary are
+     * copied out before each pass, and tiles read their borders from those copies. With the
+     * default tile size that's about a sixth of the grid, rather than a second grid.
+     */
+    void advance(uint64_t num_frames) override;
+
+    /**
+     * Selects the implementation of the inner update loop. The default, KernelType::AUTO,
+     * uses the fastest vectorized kernel that the CPU supports. All kernels produce
+     * identical results.
+     */
+    void set_kernel(KernelType type) {m_kernel = block_row_kernel(type);}
+
+    /**
+     * Enables or disables skipping empty regions of the grid, which is on by default. The grid
+     * is divided into tiles, and a tile is only updated if it or a neighboring tile that shares
+     * blocks with it has active cells. This is only possible if the transition table maps an
+     * empty block to an empty block for both phases and directions, which every built-in rule
+     * does; with a custom table that doesn't, every tick updates the whole grid. It also
+     * switches itself off while most of the grid is active, and periodically checks whether
+     * that's changed.
+     */
+    void set_skip_empty_tiles(bool skip);
+    bool is_skipping_empty_tiles() const {
+        return m_skip_empty_tiles && m_empty_blocks_stay_empty;
+    }
+
+    /**
+     * Enables or disables NUMA-aware placement, which is off by default. When enabled, worker
+     * threads are pinned to CPUs spread over the NUMA nodes (see `NumaTopology`), and each
+     * thread always updates the same band of rows, whose memory was first written by (and so is
+     * on the node of) that thread. Otherwise the grid is first written by whichever thread fills
+     * it, so it's all on one node, and threads update different rows on every tick. The
+     * grid's pages are moved into place when the worker threads start, which happens again if
+     * the number of threads changes. Each thread moves its own band a page at a time, so this
+     * doesn't need a second copy of the grid.
+     */
+    void set_numa_placement(bool numa);
+    bool is_numa_placement() const {return m_numa_placement;}
+
+    inline uint32_t num_tiles() const {return m_num_tile_rows * m_num_tile_cols;}
+
+    /**
+     * Returns the number of tiles that were updated by the last call to `tick` or `advance`.
+     * This is `num_tiles()` if empty tiles weren't skipped. Attached stats report the fraction
+     * of tiles updated per frame.
+     */
+    inline uint32_t num_active_tiles() const {return m_num_active_tiles;}
+
+private:
+    // The current state. `tick` updates it in place, which is possible because blocks don't
+    // overlap within a frame.
+    GridBytes m_grid;
+    // While tracking changes, 1 for each cell that has changed an odd number of times since
+    // the last call to `take_changed_cells`.
+    GridBytes m_changes;
+    // While hashing, the value of `translation_hash` if `m_incremental_hash` is true, and
+    // otherwise the value as of the last call. Tasks accumulate their changes separately and add
+    // them with `m_hash_mutex` held, along with the number of cells that changed since the last
+    // call and the population.
+    TorusHash::Value m_hash {};
+    bool m_incremental_hash = true;
+    uint64_t m_num_changes_since_hash = 0;
+    uint64_t m_hash_population = 0;
+    std::mutex m_hash_mutex;
+    RunStats* m_stats = nullptr;
+    // Indexed by [use_even_grid][is_forward].
+    std::array<std::array<BlockLookup, 2>, 2> m_lookups;
+    BlockRowKernel m_kernel;
+    std::unique_ptr<WorkerPool> m_pool;
+    bool m_numa_placement = false;
+    PoolCrossover m_pool_crossover;
+
+    // Per-thread buffers for `advance`.
+    std::vector<std::vector<uint8_t>> m_tile_buffers;
+    // Cells within the border size of each tile boundary at the start of an `advance` pass.
+    // `m_row_halos` has 2 * border full rows centered on each boundary between tile rows, and
+    // `m_col_halos` has 2 * border cells of every row centered on each boundary between tile
+    // columns.
+    GridBytes m_row_halos;
+    GridBytes m_col_halos;
+
+    // Active tile tracking, see `set_skip_empty_tiles`. `m_tile_occupied` is true for tiles that
+    // may have active cells; it can have false positives but no false negatives.
+    bool m_skip_empty_tiles = true;
+    bool m_empty_blocks_stay_empty;
+    uint32_t m_num_tile_rows;
+    uint32_t m_num_tile_cols;
+    std::vector<uint8_t> m_tile_occupied;
+    bool m_tile_occupancy_valid = true;
+    uint32_t m_ticks_until_occupancy_check = 0;
+    std::vector<uint32_t> m_active_tiles;
+    std::vector<uint8_t> m_tile_touched;
+    std::vector<uint32_t> m_touched_tiles;
+    uint32_t m_num_active_tiles = 0;
+
+    void start_pool(uint32_t nthreads);
+    void allocate_zeroed(GridBytes& cells);
+    void place_on_nodes(GridBytes& cells);
+    bool should_use_pool();
+    void run_tasks(bool parallel,
+        uint32_t num_tasks, const std::function<void(uint32_t, uint32_t)>& task);
+    void update_tile(uint32_t tile);
+    bool tile_has_active_cells(uint32_t tile) const;
+    bool find_active_tiles();
+    void update_tile_occupancy(bool parallel);
+    bool is_mostly_empty();
+    void capture_halos(bool parallel, uint32_t border);
+    void advance_tile(uint32_t tile_row, uint32_t tile_col, uint32_t num_frames,
+        std::vector<uint8_t>& buffer);
+
+    inline size_t index_for_rc(uint32_t row, uint32_t col) const {
+        return (size_t)row * num_cols() + col;
+    }
 
     void update_grid(uint32_t start_row, uint32_t start_col, uint32_t end_row, uint32_t end_col);
-    void update_2x2_block(bool is_even,
-        uint32_t top_left, uint32_t top_right, uint32_t bottom_left, uint32_t bottom_right);
+
+    // Changes made by one task, which are added to the totals when it's done.
+    struct ChangeDelta {
+        TorusHash::Value hash {};
+        uint64_t num_activated = 0;
+        uint64_t num_deactivated = 0;
+    };
+
+    void update_blocks_recording_changes(size_t top, size_t bottom, uint32_t num_blocks,
+        const BlockLookup& lookup, ChangeDelta& delta);
+    void update_blocks_counting_changes(size_t top, size_t bottom, uint32_t num_blocks,
+        const BlockLookup& lookup, ChangeDelta& delta);
+    void update_2x2_block(const StateArray& states,
+        size_t top_left, size_t top_right, size_t bottom_left, size_t bottom_right,
+        ChangeDelta& delta);
+
+    // Changes need to be recorded cell by cell, for `take_changed_cells` or the hash.
+    bool is_recording_changes() const {return m_tracking_changes || m_hashing;}
+    // Changes need to at least be counted, which is all the stats need.
+    bool is_counting_changes() const {return is_recording_changes() || m_stats;}
+    void record_change(size_t index, uint8_t value, ChangeDelta& delta);
+    void count_changes(const uint8_t* old_cells, const uint8_t* new_cells, uint32_t num_cells,
+        ChangeDelta& delta) const;
+    void record_row_changes(
+        size_t index, const uint8_t* new_cells, uint32_t num_cells, ChangeDelta& delta);
+    void add_change_delta(const ChangeDelta& delta);
 };
 
 }  // namespace
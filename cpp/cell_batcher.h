@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace Critters {
+
+/**
+ * Collects cells and passes them to a function in batches of up to `BATCH_SIZE`, as row/column
+ * pairs, so that code producing many cells doesn't need to build a list of them. `flush` must be
+ * called after the last cell is added.
+ */
+template <typename T>
+class CellBatcher {
+public:
+    static const size_t BATCH_SIZE = 4096;
+
+    using BatchFn = std::function<void(const T* coords, size_t num_cells)>;
+
+    explicit CellBatcher(const BatchFn& fn) : m_fn(fn) {}
+
+    void add(T row, T col) {
+        m_coords[2 * m_num_cells] = row;
+        m_coords[2 * m_num_cells + 1] = col;
+        if (++m_num_cells == BATCH_SIZE) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (m_num_cells > 0) {
+            m_fn(m_coords.data(), m_num_cells);
+            m_num_cells = 0;
+        }
+    }
+
+private:
+    const BatchFn& m_fn;
+    std::array<T, 2 * BATCH_SIZE> m_coords;
+    size_t m_num_cells = 0;
+};
+
+}  // namespace
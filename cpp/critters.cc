@@ -1,16 +1,41 @@
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <unistd.h>
+
 #include "ca.h"
+#include "cycle_detector.h"
+#include "distributed_ca.h"
+#include "ensemble.h"
+#include "frame_writer.h"
+#include "grid_server.h"
+#include "halo_transport.h"
+#include "hashlife_ca.h"
+#include "keyframe_seeker.h"
+#include "nibble_ca.h"
+#include "packed_ca.h"
+#include "pattern_input.h"
+#include "run_stats.h"
+#include "snapshot.h"
+#include "sparse_ca.h"
 
 /**
  * To build:
- *     g++ -std=c++14 -O2 critters.cc ca.cc
+ *     g++ -std=c++14 -O2 critters.cc ca.cc block_kernels.cc hashlife_ca.cc packed_ca.cc \
+ *         cycle_detector.cc distributed_ca.cc ensemble.cc frame_writer.cc grid_server.cc \
+ *         halo_transport.cc keyframe_seeker.cc nibble_ca.cc numa_topology.cc pattern_input.cc \
+ *         run_stats.cc snapshot.cc sparse_ca.cc torus_hash.cc worker_pool.cc
  */
 
 using namespace Critters;
@@ -18,18 +43,65 @@ using namespace Critters;
 namespace {
     struct Options {
         std::string ca_type;
+        std::string grid_type;
+        std::string kernel_type;
+        bool numa = false;
         uint32_t num_rows = 0;
         uint32_t num_cols = 0;
         int64_t start_frame = 0;
+        bool has_start_frame = false;
         int64_t end_frame = 0;
         uint64_t checkpoint_frames = 0;
         uint32_t num_threads = 0;
+        uint64_t hashlife_memory_mb = HashLifeCA::DEFAULT_MAX_MEMORY_BYTES >> 20;
+        std::string snapshot_path;
+        std::string resume_path;
+        // With --seek, prints only this frame, starting from the closest record in the
+        // --resume file.
+        int64_t seek_frame = 0;
+        bool has_seek_frame = false;
+        // If nonzero, every this many outputs is a full frame and the others are deltas.
+        uint64_t delta_keyframes = 0;
+        // If nonzero, output is printed by a background thread, with up to this many frames
+        // waiting to be printed.
+        uint64_t output_queue_frames = 0;
+        // Read from stdin if empty.
+        std::string input_path;
+        PatternFormat input_format = PatternFormat::AUTO;
+        // If positive, fill the grid randomly instead of reading a pattern.
+        double random_density = 0;
+        uint64_t random_seed = 0;
+        std::string ensemble_path;
+        bool detect_cycles = false;
+        // Summaries go to stderr if the path is "-".
+        std::string stats_path;
+        double stats_interval_seconds = 10;
+        // If not empty, this process is rank `rank` of a grid split across processes with
+        // these addresses.
+        std::vector<std::string> peers;
+        uint32_t rank = 0;
+        uint32_t halo_frames = 1;
+        // Print statistics instead of cells, including the populations of these regions, each
+        // given as {top, left, bottom, right} with the bottom and right excluded.
+        bool summary = false;
+        std::vector<std::array<uint32_t, 4>> regions;
+        // Run commands from stdin, or from connections to `serve_address` if it's not empty.
+        bool serve = false;
+        std::string serve_address;
     };
 }
 
 void usage_error() {
     std::cerr << "Arguments: --rows=R --cols=C (--start=N) (--end=N) (--checkpoint=N) "
-              << "(--threads=N) "
+              << "(--threads=N) (--grid=[bytes|packed|nibble|hashlife|sparse]) "
+              << "(--hashlife-memory=MB) (--snapshot=FILE) (--resume=FILE) (--seek=N) "
+              << "(--delta=K) (--input=FILE) (--format=[auto|coords|rle|plaintext]) "
+              << "(--random=DENSITY) (--seed=N) (--ensemble=FILE) (--detect-cycles) "
+              << "(--stats(=FILE)) (--stats-interval=SECONDS) "
+              << "(--peers=ADDRESS,ADDRESS,...) (--rank=N) (--halo=FRAMES) "
+              << "(--summary) (--region=TOP,LEFT,BOTTOM,RIGHT)... "
+              << "(--kernel=[auto|scalar|ssse3|avx2]) (--numa) (--output-queue=FRAMES) "
+              << "(--serve(=unix:PATH)) "
               << "(--ca=[critters|tron|highlander|billiardball|schaeffer|singlerotation|(16 or 32 hex chars)])\n";
     std::exit(1);
 }
@@ -68,6 +140,7 @@ Options parse_options(int argc, char** argv) {
             }
             else if (starts_with(s, "--start=")) {
                 opts.start_frame = int_after_equal_sign(s);
+                opts.has_start_frame = true;
             }
             else if (starts_with(s, "--end=")) {
                 opts.end_frame = int_after_equal_sign(s);
@@ -81,6 +154,95 @@ Options parse_options(int argc, char** argv) {
             else if (starts_with(s, "--ca=")) {
                 opts.ca_type = string_after_equal_sign(s);
             }
+            else if (starts_with(s, "--grid=")) {
+                opts.grid_type = string_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--hashlife-memory=")) {
+                opts.hashlife_memory_mb = int_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--snapshot=")) {
+                opts.snapshot_path = string_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--resume=")) {
+                opts.resume_path = string_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--seek=")) {
+                opts.seek_frame = int_after_equal_sign(s);
+                opts.has_seek_frame = true;
+            }
+            else if (starts_with(s, "--delta=")) {
+                opts.delta_keyframes = int_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--output-queue=")) {
+                opts.output_queue_frames = int_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--input=")) {
+                opts.input_path = string_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--format=")) {
+                opts.input_format = pattern_format_for_name(string_after_equal_sign(s));
+            }
+            else if (starts_with(s, "--random=")) {
+                opts.random_density = std::stod(string_after_equal_sign(s));
+            }
+            else if (starts_with(s, "--seed=")) {
+                opts.random_seed = int_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--ensemble=")) {
+                opts.ensemble_path = string_after_equal_sign(s);
+            }
+            else if (s == "--detect-cycles") {
+                opts.detect_cycles = true;
+            }
+            else if (s == "--stats") {
+                opts.stats_path = "-";
+            }
+            else if (starts_with(s, "--stats=")) {
+                opts.stats_path = string_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--stats-interval=")) {
+                opts.stats_interval_seconds = std::stod(string_after_equal_sign(s));
+            }
+            else if (starts_with(s, "--peers=")) {
+                std::istringstream peers(string_after_equal_sign(s));
+                std::string address;
+                while (std::getline(peers, address, ',')) {
+                    opts.peers.push_back(address);
+                }
+            }
+            else if (starts_with(s, "--rank=")) {
+                opts.rank = int_after_equal_sign(s);
+            }
+            else if (starts_with(s, "--halo=")) {
+                opts.halo_frames = int_after_equal_sign(s);
+            }
+            else if (s == "--summary") {
+                opts.summary = true;
+            }
+            else if (starts_with(s, "--region=")) {
+                std::istringstream bounds(string_after_equal_sign(s));
+                std::array<uint32_t, 4> region;
+                char comma;
+                if (!(bounds >> region[0] >> comma >> region[1] >> comma >> region[2] >>
+                        comma >> region[3])) {
+                    std::cerr << "Bad region: " << s << "\n";
+                    usage_error();
+                }
+                opts.regions.push_back(region);
+            }
+            else if (starts_with(s, "--kernel=")) {
+                opts.kernel_type = string_after_equal_sign(s);
+            }
+            else if (s == "--serve") {
+                opts.serve = true;
+            }
+            else if (starts_with(s, "--serve=")) {
+                opts.serve = true;
+                opts.serve_address = string_after_equal_sign(s);
+            }
+            else if (s == "--numa") {
+                opts.numa = true;
+            }
             else {
                 std::cerr << "Unrecognized argument: " << s << "\n";
                 usage_error();
@@ -93,114 +255,765 @@ Options parse_options(int argc, char** argv) {
     return opts;
 }
 
-// Returns a vector of all (nonnegative) ints from the input stream.
-// Separators are any non-digit characters. In particular, this will
-// read ints from a serialized JSON array.
-std::vector<uint32_t> uints_from_stream(std::istream& input) {
-    std::vector<uint32_t> result;
-    std::string line;
-    while (true) {
-        std::getline(input, line);
-        std::string current_num;
-        for (const char ch : line) {
-            if (ch >= '0' && ch <= '9') {
-                current_num += ch;
+// Writes a JSON array of [row, col] pairs, from cells that are added in batches as row/column
+// pairs. Numbers are formatted directly into a buffer rather than through the stream, since
+// that's most of the time spent printing a large pattern.
+class JsonCellWriter {
+public:
+    explicit JsonCellWriter(std::ostream& out) : m_out(out) {
+        m_buffer.reserve(2 * FLUSH_SIZE);
+        m_buffer += '[';
+    }
+
+    template <typename T>
+    void add(const T* coords, size_t num_cells) {
+        for (size_t i = 0; i < num_cells; i++) {
+            if (!m_first) {
+                m_buffer += ", ";
             }
-            else {
-                if (!current_num.empty()) {
-                    result.push_back(std::stoi(current_num));
-                    current_num.clear();
-                }
+            m_buffer += '[';
+            append_number(coords[2 * i]);
+            m_buffer += ", ";
+            append_number(coords[2 * i + 1]);
+            m_buffer += ']';
+            m_first = false;
+        }
+        if (m_buffer.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+
+    void finish() {
+        m_buffer += ']';
+        flush();
+    }
+
+private:
+    static const size_t FLUSH_SIZE = 1 << 16;
+
+    std::ostream& m_out;
+    std::string m_buffer;
+    bool m_first = true;
+
+    void append_number(int64_t n) {
+        char digits[20];
+        int num_digits = 0;
+        uint64_t magnitude = (n < 0) ? 0 - (uint64_t)n : n;
+        do {
+            digits[num_digits++] = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (n < 0) {
+            m_buffer += '-';
+        }
+        while (num_digits > 0) {
+            m_buffer += digits[--num_digits];
+        }
+    }
+
+    void flush() {
+        m_out.write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+    }
+};
+
+std::unique_ptr<MargolusEngine> engine_for_options(
+        const Options& opts, std::shared_ptr<TransitionTable> table) {
+    if (opts.grid_type.empty() || opts.grid_type == "bytes") {
+        auto ca = std::make_unique<MargolusCA>(opts.num_rows, opts.num_cols, table);
+        if (!opts.kernel_type.empty()) {
+            try {
+                ca->set_kernel(kernel_type_for_name(opts.kernel_type));
+            }
+            catch (std::invalid_argument& ex) {
+                std::cerr << ex.what() << "\n";
+                usage_error();
+            }
+        }
+        ca->set_numa_placement(opts.numa);
+        return ca;
+    }
+    if (opts.grid_type == "packed") {
+        return std::make_unique<PackedMargolusCA>(opts.num_rows, opts.num_cols, table);
+    }
+    if (opts.grid_type == "nibble") {
+        return std::make_unique<NibbleMargolusCA>(opts.num_rows, opts.num_cols, table);
+    }
+    if (opts.grid_type == "hashlife") {
+        try {
+            return std::make_unique<HashLifeCA>(
+                opts.num_rows, opts.num_cols, table, opts.hashlife_memory_mb << 20);
+        }
+        catch (std::invalid_argument& ex) {
+            std::cerr << ex.what() << "\n";
+            usage_error();
+        }
+    }
+    std::cerr << "Unknown grid type: " << opts.grid_type << "\n";
+    usage_error();
+    return nullptr;
+}
+
+template <typename Engine>
+void print_frame(Engine& grid, const Options& opts) {
+    if (opts.checkpoint_frames > 0) {
+        std::cout << "Frame " << grid.frame_number() << "\n";
+    }
+    JsonCellWriter writer(std::cout);
+    grid.visit_active_cells([&writer](const auto* coords, size_t num_cells) {
+        writer.add(coords, num_cells);
+    });
+    writer.finish();
+    std::cout << "\n";
+    std::cout.flush();
+}
+
+// With --delta=K, the first output and every Kth one after it are printed as usual, preceded by
+// "Frame N". The others are preceded by "Delta N", and list only the cells that changed since
+// the previous output.
+void print_delta_frame(MargolusEngine& grid, const Options& opts, uint64_t output_index) {
+    JsonCellWriter writer(std::cout);
+    auto write_cells = [&writer](const uint32_t* coords, size_t num_cells) {
+        writer.add(coords, num_cells);
+    };
+    if (output_index % opts.delta_keyframes == 0) {
+        // Changes are still taken so that the next delta is relative to this frame.
+        grid.take_changed_cells([](const uint32_t*, size_t) {});
+        std::cout << "Frame " << grid.frame_number() << "\n";
+        grid.visit_active_cells(write_cells);
+    }
+    else {
+        std::cout << "Delta " << grid.frame_number() << "\n";
+        grid.take_changed_cells(write_cells);
+    }
+    writer.finish();
+    std::cout << "\n";
+    std::cout.flush();
+}
+
+// With --output-queue, prints a frame captured by `AsyncFrameWriter`, in the same format as
+// `print_frame`, or `print_delta_frame` with --delta. Deltas are found by comparing the frame
+// with the previous output, rather than by tracking changes in the grid.
+void print_grid_frame(
+        const GridFrame& frame, const GridFrame* previous, const Options& opts,
+        uint64_t output_index) {
+    bool is_delta = opts.delta_keyframes > 0 && output_index % opts.delta_keyframes != 0;
+    if (is_delta) {
+        std::cout << "Delta " << frame.frame_number << "\n";
+    }
+    else if (opts.checkpoint_frames > 0 || opts.delta_keyframes > 0) {
+        std::cout << "Frame " << frame.frame_number << "\n";
+    }
+    JsonCellWriter writer(std::cout);
+    auto write_cells = [&writer](const uint32_t* coords, size_t num_cells) {
+        writer.add(coords, num_cells);
+    };
+    if (is_delta) {
+        frame.visit_changed_cells(*previous, write_cells);
+    }
+    else {
+        frame.visit_active_cells(write_cells);
+    }
+    writer.finish();
+    std::cout << "\n";
+    std::cout.flush();
+}
+
+// With --summary, each output is a line of JSON with the frame number, the population, the
+// bounding box of the active cells ([min_row, min_col, max_row, max_col], or null if there
+// aren't any), the number of blocks in each state for the next tick's alignment, and the
+// population of each --region. The grid is only scanned, so there's no list of cells to build.
+void print_summary(const MargolusEngine& grid, const Options& opts) {
+    std::ostringstream ss;
+    ss << "{\"frame\": " << grid.frame_number() << ", \"population\": " << grid.population()
+        << ", \"bbox\": ";
+    CellBounds bounds = grid.bounding_box();
+    if (bounds.is_empty()) {
+        ss << "null";
+    }
+    else {
+        ss << "[" << bounds.min_row << ", " << bounds.min_col << ", "
+            << bounds.max_row << ", " << bounds.max_col << "]";
+    }
+    ss << ", \"blocks\": [";
+    auto histogram = grid.block_histogram(grid.use_even_grid());
+    for (size_t i = 0; i < histogram.size(); i++) {
+        ss << (i > 0 ? ", " : "") << histogram[i];
+    }
+    ss << "], \"regions\": [";
+    for (size_t i = 0; i < opts.regions.size(); i++) {
+        auto& region = opts.regions[i];
+        ss << (i > 0 ? ", " : "")
+            << grid.region_population(region[0], region[1], region[2], region[3]);
+    }
+    ss << "]}\n";
+    std::cout << ss.str();
+    std::cout.flush();
+}
+
+// Calls `output`, and records how long it takes in `stats` if given.
+template <typename Engine>
+void timed_output(
+        Engine& grid, const std::function<void(Engine&)>& output, RunStats* stats) {
+    if (!stats) {
+        output(grid);
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    output(grid);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    stats->record_output(elapsed.count());
+}
+
+// Calls `output` at every checkpoint frame and at the end frame. `Engine` is either a
+// MargolusEngine or a SparseMargolusCA.
+template <typename Engine>
+void run_frames(Engine& grid, const Options& opts, const std::function<void(Engine&)>& output,
+        RunStats* stats = nullptr) {
+    while (grid.frame_number() != opts.end_frame) {
+        int64_t next_frame = next_multiple_towards(
+            grid.frame_number(), opts.end_frame, opts.checkpoint_frames);
+        grid.advance(std::abs(next_frame - grid.frame_number()));
+        timed_output(grid, output, stats);
+    }
+}
+
+// Runs one frame at a time, checking for cycles, and otherwise produces the same output as
+// `run_frames`. If the state repeats, prints the current frame and then a line of JSON with the
+// period and the translation, and stops.
+void run_frames_detecting_cycles(MargolusEngine& grid, const Options& opts, RunStats* stats) {
+    std::function<void(MargolusEngine&)> output = [&opts](MargolusEngine& g) {
+        if (opts.summary) {
+            print_summary(g, opts);
+        }
+        else {
+            print_frame(g, opts);
+        }
+    };
+    CycleDetector detector(grid);
+    int64_t next_frame = next_multiple_towards(
+        grid.frame_number(), opts.end_frame, opts.checkpoint_frames);
+    while (grid.frame_number() != opts.end_frame) {
+        grid.tick();
+        if (detector.check()) {
+            timed_output(grid, output, stats);
+            std::cout << "{\"period\": " << detector.period()
+                << ", \"first_frame\": " << detector.first_frame()
+                << ", \"offset\": [" << detector.row_offset() << ", "
+                << detector.col_offset() << "]}\n";
+            std::cout.flush();
+            return;
+        }
+        if (grid.frame_number() == next_frame) {
+            timed_output(grid, output, stats);
+            next_frame = next_multiple_towards(
+                grid.frame_number(), opts.end_frame, opts.checkpoint_frames);
+        }
+    }
+}
+
+int64_t wrap(int64_t n, uint32_t size) {
+    int64_t m = n % size;
+    return (m < 0) ? m + size : m;
+}
+
+// Reads the cells of a torus with the given size from `input`, wrapping coordinates outside
+// it, and calls `set_row` with the bits of each row from `first_row` up to `end_row`. Cells are
+// collected in a bitmap so that each row is set at once.
+void read_torus_rows(const PatternInput& input, PatternFormat format,
+        uint32_t num_rows, uint32_t num_cols, uint32_t first_row, uint32_t end_row,
+        const std::function<void(uint32_t, const uint64_t*)>& set_row) {
+    uint32_t row_words = (num_cols + 63) / 64;
+    std::vector<uint64_t> bits((size_t)(end_row - first_row) * row_words);
+    input.read_cells(format, [&](const int64_t* coords, size_t num_cells) {
+        for (size_t i = 0; i < num_cells; i++) {
+            int64_t r = coords[2 * i];
+            int64_t c = coords[2 * i + 1];
+            if ((uint64_t)r >= num_rows) {
+                r = wrap(r, num_rows);
+            }
+            if (r < first_row || r >= end_row) {
+                continue;
             }
+            if ((uint64_t)c >= num_cols) {
+                c = wrap(c, num_cols);
+            }
+            bits[(r - first_row) * row_words + c / 64] |= 1ULL << (c % 64);
+        }
+    });
+    for (uint32_t r = first_row; r < end_row; r++) {
+        set_row(r, &bits[(size_t)(r - first_row) * row_words]);
+    }
+}
+
+// Sets the cells of `grid` from `input`.
+void load_torus_pattern(const PatternInput& input, PatternFormat format, MargolusEngine& grid) {
+    read_torus_rows(input, format, grid.num_rows(), grid.num_cols(), 0, grid.num_rows(),
+        [&grid](uint32_t r, const uint64_t* words) {grid.set_row_bits(r, words);});
+}
+
+// Reads the runs for --ensemble. Each line has a rule (a name or hex digits, as for --ca), a
+// seed or an inclusive range of seeds "FIRST-LAST", and a density. Empty lines and lines
+// starting with "#" are ignored.
+std::vector<EnsembleRun> read_ensemble_runs(const std::string& path) {
+    std::ifstream input(path);
+    if (!input) {
+        throw std::runtime_error("Can't read ensemble file " + path);
+    }
+    std::vector<EnsembleRun> runs;
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream fields(line);
+        std::string rule;
+        std::string seeds;
+        double density;
+        if (!(fields >> rule) || rule[0] == '#') {
+            continue;
+        }
+        if (!(fields >> seeds >> density)) {
+            throw std::runtime_error("Bad ensemble line: " + line);
         }
-        if (!current_num.empty()) {
-            result.push_back(std::stoi(current_num));
-            current_num.clear();
+        std::shared_ptr<TransitionTable> table;
+        try {
+            table = TransitionTable::fromName(rule);
         }
-        if (input.eof()) {
-            break;
+        catch (std::exception& ex) {
+            throw std::runtime_error("Bad rule in ensemble line: " + line);
+        }
+        size_t dash = seeds.find('-');
+        uint64_t first_seed = std::stoull(seeds.substr(0, dash));
+        uint64_t last_seed = (dash == std::string::npos) ?
+            first_seed : std::stoull(seeds.substr(dash + 1));
+        for (uint64_t seed = first_seed; seed <= last_seed; seed++) {
+            runs.push_back({rule, table, seed, density});
+            if (seed == UINT64_MAX) {
+                break;
+            }
         }
     }
-    return result;
+    return runs;
 }
 
-std::string json_for_cells(const std::vector<std::vector<uint32_t>>& cells) {
+// Prints one line of JSON for each ensemble run.
+void print_ensemble_summary(const EnsembleRun& run, const EnsembleSummary& summary) {
     std::ostringstream ss;
-    bool first = true;
-    ss << "[";
-    for (auto& c : cells) {
-        if (!first) {
-            ss << ", ";
+    ss << "{\"rule\": \"" << run.rule << "\", \"seed\": " << run.seed
+        << ", \"density\": " << run.density << ", \"population\": [";
+    for (size_t i = 0; i < summary.populations.size(); i++) {
+        ss << (i > 0 ? ", " : "") << summary.populations[i];
+    }
+    ss << "], \"bbox\": ";
+    if (summary.min_row < 0) {
+        ss << "null";
+    }
+    else {
+        ss << "[" << summary.min_row << ", " << summary.min_col << ", "
+            << summary.max_row << ", " << summary.max_col << "]";
+    }
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)summary.hash);
+    ss << ", \"hash\": \"" << hash << "\"}\n";
+    std::cout << ss.str();
+}
+
+// Runs --ensemble, from frame 0 to the end frame.
+int run_ensemble(const Options& opts) {
+    if (opts.has_start_frame || opts.end_frame <= 0) {
+        std::cerr << "Ensembles run from frame 0 to a positive --end\n";
+        usage_error();
+    }
+    if (!(opts.num_rows > 0 && opts.num_rows % 2 == 0 &&
+            opts.num_cols > 0 && opts.num_cols % 2 == 0)) {
+        std::cerr << "Bad grid size: " << opts.num_rows << "x" << opts.num_cols << "\n";
+        usage_error();
+    }
+    std::vector<EnsembleRun> runs;
+    try {
+        runs = read_ensemble_runs(opts.ensemble_path);
+    }
+    catch (std::exception& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    if (runs.empty()) {
+        return 0;
+    }
+    // Reports an unsupported grid size for the engine type here rather than from a worker.
+    engine_for_options(opts, runs[0].transition_table);
+
+    uint32_t num_threads = (opts.num_threads > 0) ?
+        opts.num_threads : std::max(std::thread::hardware_concurrency(), 1U);
+    Ensemble ensemble(opts.num_rows, opts.num_cols,
+        [&opts](std::shared_ptr<TransitionTable> table) {
+            return engine_for_options(opts, table);
+        },
+        num_threads);
+    auto summaries = ensemble.run(runs, opts.end_frame, opts.checkpoint_frames);
+    for (size_t i = 0; i < runs.size(); i++) {
+        print_ensemble_summary(runs[i], summaries[i]);
+    }
+    std::cout.flush();
+    return 0;
+}
+
+// Runs --serve: keeps grids in memory and runs commands on them (see `GridServer`) until the
+// input ends, or with an address, forever.
+int run_server(const Options& opts) {
+    GridServer server(opts.num_threads);
+    try {
+        if (opts.serve_address.empty()) {
+            server.serve(STDIN_FILENO, STDOUT_FILENO);
+        }
+        else {
+            server.serve_unix_socket(opts.serve_address);
         }
-        ss << "[" << c[0] << ", " << c[1] << "]";
-        first = false;
     }
-    ss << "]";
-    return ss.str();
+    catch (std::runtime_error& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
 }
 
-std::shared_ptr<TransitionTable> transition_table_for_type(std::string& ca_type) {
-    if (ca_type.empty() || ca_type == "critters") {
-        return TransitionTable::CRITTERS();
+// Runs this process's band of a grid that's split across the processes in --peers. Each
+// process prints the active cells in its own band (in torus coordinates), and with --snapshot
+// writes its band to its own file, FILE.RANK, so checkpoints are written in parallel.
+int run_distributed(const Options& opts, std::shared_ptr<TransitionTable> table,
+        PatternInput* input) {
+    std::unique_ptr<DistributedMargolusCA> grid;
+    try {
+        grid = std::make_unique<DistributedMargolusCA>(opts.num_rows, opts.num_cols,
+            opts.rank, opts.peers.size(), opts.halo_frames,
+            [&opts]() {return connect_halo_transport(opts.rank, opts.peers);},
+            [&opts, table](uint32_t num_rows, uint32_t num_cols) {
+                Options band_opts = opts;
+                band_opts.num_rows = num_rows;
+                band_opts.num_cols = num_cols;
+                return engine_for_options(band_opts, table);
+            });
     }
-    if (ca_type == "tron") {
-        return TransitionTable::TRON();
+    catch (std::invalid_argument& ex) {
+        std::cerr << ex.what() << "\n";
+        usage_error();
     }
-    if (ca_type == "highlander") {
-        return TransitionTable::HIGHLANDER();
+    catch (std::runtime_error& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
     }
-    if (ca_type == "billiardball") {
-        return TransitionTable::BILLIARD_BALL();
+    grid->set_num_threads(opts.num_threads);
+    uint32_t end_row = grid->first_row() + grid->num_band_rows();
+    if (opts.random_density > 0) {
+        std::vector<uint64_t> words(grid->local_grid().num_row_words());
+        for (uint32_t r = grid->first_row(); r < end_row; r++) {
+            random_row_bits(opts.random_seed, r, opts.random_density, opts.num_cols, words.data());
+            grid->set_row_bits(r, words.data());
+        }
     }
-    if (ca_type == "schaeffer") {
-        return TransitionTable::SCHAEFFER();
+    else {
+        try {
+            read_torus_rows(*input, opts.input_format, opts.num_rows, opts.num_cols,
+                grid->first_row(), end_row,
+                [&grid](uint32_t r, const uint64_t* words) {grid->set_row_bits(r, words);});
+        }
+        catch (std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            return 1;
+        }
     }
-    if (ca_type == "singlerotation") {
-        return TransitionTable::SINGLE_ROTATION();
+    grid->set_frame_number(opts.start_frame);
+    grid->set_reversed(opts.end_frame < opts.start_frame);
+
+    try {
+        if (!opts.snapshot_path.empty()) {
+            SnapshotWriter snapshot(opts.snapshot_path + "." + std::to_string(opts.rank),
+                grid->num_band_rows(), grid->num_cols(), *table);
+            auto write_shard = [&snapshot](DistributedMargolusCA& g) {
+                snapshot.write_rows(g.local_grid(), g.halo_rows());
+            };
+            write_shard(*grid);
+            run_frames<DistributedMargolusCA>(*grid, opts, write_shard);
+            snapshot.close();
+        }
+        else {
+            run_frames<DistributedMargolusCA>(*grid, opts,
+                [&opts](DistributedMargolusCA& g) {print_frame(g, opts);});
+        }
     }
-    if (ca_type.size() == 16 || ca_type.size() == 32) {
-        return TransitionTable::fromHex(ca_type);
+    catch (std::runtime_error& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
     }
-    throw std::logic_error("Unknown CA type");
+    return 0;
 }
 
 int main(int argc, char** argv) {
     Options opts = parse_options(argc, argv);
-    if (!(opts.num_rows > 0 && opts.num_rows % 2 == 0 &&
+    if (opts.serve) {
+        // Grids are created by commands, so the only other option used is --threads.
+        return run_server(opts);
+    }
+    if (!opts.stats_path.empty() && (!opts.ensemble_path.empty() ||
+            !(opts.grid_type.empty() || opts.grid_type == "bytes"))) {
+        std::cerr << "--stats is only supported for --grid=bytes, and not with --ensemble\n";
+        usage_error();
+    }
+    if (opts.numa && (!opts.ensemble_path.empty() ||
+            !(opts.grid_type.empty() || opts.grid_type == "bytes"))) {
+        std::cerr << "--numa is only supported for --grid=bytes, and not with --ensemble\n";
+        usage_error();
+    }
+    bool is_sparse = (opts.grid_type == "sparse");
+    if (opts.output_queue_frames > 0 && (!opts.ensemble_path.empty() || is_sparse ||
+            !opts.snapshot_path.empty() || opts.summary || opts.detect_cycles ||
+            !opts.peers.empty())) {
+        std::cerr << "--output-queue can't be used with --ensemble, sparse grids, snapshots, "
+                  << "--summary, --detect-cycles, or --peers\n";
+        usage_error();
+    }
+    if (!opts.peers.empty() && (!opts.ensemble_path.empty() || is_sparse ||
+            opts.grid_type == "hashlife" || !opts.resume_path.empty() || opts.detect_cycles ||
+            opts.delta_keyframes > 0 || !opts.stats_path.empty())) {
+        std::cerr << "--peers can't be used with --ensemble, sparse or hashlife grids, "
+                  << "--resume, --detect-cycles, --delta, or --stats\n";
+        usage_error();
+    }
+    if (opts.summary && (!opts.ensemble_path.empty() || is_sparse ||
+            !opts.snapshot_path.empty() || opts.delta_keyframes > 0 || !opts.peers.empty())) {
+        std::cerr << "--summary can't be used with --ensemble, sparse grids, snapshots, "
+                  << "--delta, or --peers\n";
+        usage_error();
+    }
+    if (!opts.regions.empty() && !opts.summary) {
+        std::cerr << "--region requires --summary\n";
+        usage_error();
+    }
+    if (!opts.ensemble_path.empty()) {
+        return run_ensemble(opts);
+    }
+    if (is_sparse && (!opts.snapshot_path.empty() || !opts.resume_path.empty())) {
+        std::cerr << "Snapshots aren't supported for sparse grids\n";
+        usage_error();
+    }
+    if (opts.random_density > 0 && is_sparse) {
+        std::cerr << "Random fills aren't supported for sparse grids\n";
+        usage_error();
+    }
+    if (opts.detect_cycles && (is_sparse || !opts.snapshot_path.empty() ||
+            opts.delta_keyframes > 0)) {
+        std::cerr << "--detect-cycles can't be used with sparse grids, snapshots, or --delta\n";
+        usage_error();
+    }
+    if (opts.delta_keyframes > 0 && (is_sparse || !opts.snapshot_path.empty())) {
+        std::cerr << "--delta can't be used with sparse grids or snapshots\n";
+        usage_error();
+    }
+    if (opts.has_seek_frame && (opts.resume_path.empty() || opts.has_start_frame ||
+            opts.checkpoint_frames > 0 || opts.delta_keyframes > 0)) {
+        std::cerr << "--seek requires --resume, and can't be used with --start, --checkpoint, "
+                  << "or --delta\n";
+        usage_error();
+    }
+    // When resuming, the dimensions and rule come from the snapshot, and the start frame
+    // selects a record (by default the last one). With --seek, the record is the one closest to
+    // the frame, which is reached by ticking forward or backward from it.
+    std::unique_ptr<SnapshotReader> resume;
+    size_t resume_record = 0;
+    if (!opts.resume_path.empty()) {
+        try {
+            resume = std::make_unique<SnapshotReader>(opts.resume_path);
+            if (resume->num_records() == 0) {
+                throw std::runtime_error("No frames in snapshot file " + opts.resume_path);
+            }
+            if (opts.has_seek_frame) {
+                resume_record = resume->nearest_record(opts.seek_frame);
+                opts.end_frame = opts.seek_frame;
+            }
+            else {
+                resume_record = opts.has_start_frame ?
+                    resume->find_frame(opts.start_frame) : resume->num_records() - 1;
+            }
+        }
+        catch (std::exception& ex) {
+            std::cerr << ex.what() << "\n";
+            usage_error();
+        }
+        if ((opts.num_rows != 0 && opts.num_rows != resume->num_rows()) ||
+                (opts.num_cols != 0 && opts.num_cols != resume->num_cols())) {
+            std::cerr << "Grid size doesn't match snapshot: " <<
+                resume->num_rows() << "x" << resume->num_cols() << "\n";
+            usage_error();
+        }
+        opts.num_rows = resume->num_rows();
+        opts.num_cols = resume->num_cols();
+        opts.start_frame = resume->frame_number(resume_record);
+        if (!opts.ca_type.empty()) {
+            std::cerr << "The rule of a resumed snapshot can't be changed\n";
+            usage_error();
+        }
+        opts.ca_type = resume->rule_hex();
+    }
+    if (!is_sparse && !(opts.num_rows > 0 && opts.num_rows % 2 == 0 &&
             opts.num_cols > 0 && opts.num_cols % 2 == 0)) {
         std::cerr << "Bad grid size: " << opts.num_rows << "x" << opts.num_cols << "\n";
         usage_error();
     }
-    if (opts.start_frame == opts.end_frame) {
+    for (auto& region : opts.regions) {
+        if (region[0] > region[2] || region[1] > region[3] ||
+                region[2] > opts.num_rows || region[3] > opts.num_cols) {
+            std::cerr << "Region is outside the grid: " << region[0] << "," << region[1] << ","
+                << region[2] << "," << region[3] << "\n";
+            usage_error();
+        }
+    }
+    if (opts.start_frame == opts.end_frame && !opts.has_seek_frame) {
         std::cerr << "Start and end frames are equal (" << opts.start_frame << ")\n";
         usage_error();
     }
-    auto nums = uints_from_stream(std::cin);
-    uint32_t npairs = nums.size() / 2;
-    std::vector<std::vector<uint32_t>> coords;
-    for (uint32_t i = 0; i < npairs; i++) {
-        coords.push_back({nums[2 * i], nums[2 * i + 1]});
+    std::unique_ptr<PatternInput> input;
+    if (!resume && opts.random_density <= 0) {
+        try {
+            input = opts.input_path.empty() ?
+                PatternInput::from_stdin() : PatternInput::from_file(opts.input_path);
+        }
+        catch (std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            return 1;
+        }
+    }
+    std::shared_ptr<TransitionTable> table = TransitionTable::fromName(opts.ca_type);
+
+    if (!opts.peers.empty()) {
+        return run_distributed(opts, table, input.get());
+    }
+    if (is_sparse) {
+        std::unique_ptr<SparseMargolusCA> grid;
+        try {
+            grid = std::make_unique<SparseMargolusCA>(table);
+        }
+        catch (std::invalid_argument& ex) {
+            std::cerr << ex.what() << "\n";
+            usage_error();
+        }
+        grid->set_num_threads(opts.num_threads);
+        try {
+            input->read_cells(opts.input_format, [&grid](const int64_t* coords, size_t num_cells) {
+                grid->set_cells(coords, num_cells);
+            });
+        }
+        catch (std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            return 1;
+        }
+        grid->set_frame_number(opts.start_frame);
+        grid->set_reversed(opts.end_frame < opts.start_frame);
+        run_frames<SparseMargolusCA>(*grid, opts,
+            [&opts](SparseMargolusCA& g) {print_frame(g, opts);});
+        return 0;
     }
 
-    MargolusCA grid(opts.num_rows, opts.num_cols, transition_table_for_type(opts.ca_type));
+    auto engine = engine_for_options(opts, table);
+    MargolusEngine& grid = *engine;
     grid.set_num_threads(opts.num_threads);
-    grid.set_cells(coords);
+    if (resume) {
+        resume->load(resume_record, grid);
+        // The snapshot may be the file being written.
+        resume.reset();
+    }
+    else if (opts.random_density > 0) {
+        std::unique_ptr<WorkerPool> pool;
+        if (opts.num_threads > 1) {
+            pool = std::make_unique<WorkerPool>(opts.num_threads);
+        }
+        fill_random(grid, opts.random_seed, opts.random_density, pool.get());
+    }
+    else {
+        try {
+            load_torus_pattern(*input, opts.input_format, grid);
+        }
+        catch (std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            return 1;
+        }
+        input.reset();
+    }
     grid.set_frame_number(opts.start_frame);
     grid.set_reversed(opts.end_frame < opts.start_frame);
+    if (grid.frame_number() == opts.end_frame) {
+        // Seeking to a frame that's in the snapshot, so there's nothing to run.
+        if (opts.summary) {
+            print_summary(grid, opts);
+        }
+        else {
+            print_frame(grid, opts);
+        }
+        return 0;
+    }
 
-    while (grid.frame_number() != opts.end_frame) {
-        grid.tick();
-        if (grid.frame_number() == opts.end_frame || (
-                opts.checkpoint_frames > 0 &&
-                grid.frame_number() % ((int64_t)opts.checkpoint_frames) == 0)) {
-
-            if (opts.checkpoint_frames > 0) {
-                std::cout << "Frame " << grid.frame_number() << "\n";
+    // Attached after loading the pattern, so that only frames are timed. The last summary is
+    // written when `stats` is destroyed, before the file it writes to.
+    std::unique_ptr<std::ofstream> stats_file;
+    std::unique_ptr<RunStats> stats;
+    if (!opts.stats_path.empty()) {
+        std::ostream* stats_output = &std::cerr;
+        if (opts.stats_path != "-") {
+            stats_file = std::make_unique<std::ofstream>(opts.stats_path);
+            if (!*stats_file) {
+                std::cerr << "Can't write stats file " << opts.stats_path << "\n";
+                return 1;
             }
-            std::cout << json_for_cells(grid.get_active_cells()) << "\n";
-            std::cout.flush();
+            stats_output = stats_file.get();
         }
+        stats = std::make_unique<RunStats>(stats_output, opts.stats_interval_seconds);
+        static_cast<MargolusCA&>(grid).set_stats(stats.get());
     }
 
+    std::unique_ptr<SnapshotWriter> snapshot;
+    if (!opts.snapshot_path.empty()) {
+        try {
+            snapshot = std::make_unique<SnapshotWriter>(
+                opts.snapshot_path, grid.num_rows(), grid.num_cols(), *table);
+            snapshot->write(grid);
+            run_frames<MargolusEngine>(grid, opts,
+                [&snapshot](MargolusEngine& g) {snapshot->write(g);}, stats.get());
+            snapshot->close();
+        }
+        catch (std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (opts.detect_cycles) {
+        run_frames_detecting_cycles(grid, opts, stats.get());
+        return 0;
+    }
+    if (opts.output_queue_frames > 0) {
+        // Only used by the writer thread. Time that `write` spends waiting for the writer is
+        // counted as output time in the stats.
+        uint64_t output_index = 0;
+        AsyncFrameWriter writer(opts.output_queue_frames,
+            [&opts, &output_index](const GridFrame& frame, const GridFrame* previous) {
+                print_grid_frame(frame, previous, opts, output_index++);
+            });
+        run_frames<MargolusEngine>(grid, opts,
+            [&writer](MargolusEngine& g) {writer.write(g);}, stats.get());
+        writer.finish();
+        return 0;
+    }
+    if (opts.delta_keyframes > 0) {
+        grid.set_tracking_changes(true);
+        uint64_t output_index = 0;
+        run_frames<MargolusEngine>(grid, opts, [&opts, &output_index](MargolusEngine& g) {
+            print_delta_frame(g, opts, output_index++);
+        }, stats.get());
+        return 0;
+    }
+    if (opts.summary) {
+        run_frames<MargolusEngine>(grid, opts,
+            [&opts](MargolusEngine& g) {print_summary(g, opts);}, stats.get());
+        return 0;
+    }
+    run_frames<MargolusEngine>(grid, opts, [&opts](MargolusEngine& g) {print_frame(g, opts);},
+        stats.get());
     return 0;
-}
\ No newline at end of file
+}
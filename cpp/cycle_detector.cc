@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "cycle_detector.h"
+
+namespace Critters {
+
+// Turns on hashing in `grid`, so engines that support it keep the hash up to date instead of
+// recomputing it on every check.
+CycleDetector::CycleDetector(MargolusEngine& grid, size_t history_size) :
+        m_grid(grid), m_torus_hash(grid.torus_hash()), m_start_frame(grid.frame_number()),
+        m_history_size(std::max<size_t>(history_size, 1)) {
+    m_grid.set_hashing(true);
+    TorusHash::Value hash = m_grid.translation_hash();
+    m_saved = {m_start_frame, hash, m_torus_hash.translation_invariant(hash)};
+    m_history.reserve(m_history_size);
+    m_history.push_back(m_saved);
+    m_next_history_index = 1 % m_history_size;
+}
+
+bool CycleDetector::check() {
+    if ((m_grid.frame_number() - m_start_frame) % 2 != 0) {
+        return false;
+    }
+    TorusHash::Value hash = m_grid.translation_hash();
+    Entry current = {m_grid.frame_number(), hash, m_torus_hash.translation_invariant(hash)};
+    // Newest first, so that the shortest period is found.
+    for (size_t i = 0; i < m_history.size(); i++) {
+        size_t index = (m_next_history_index + m_history.size() - 1 - i) % m_history.size();
+        if (matches(m_history[index], current)) {
+            return true;
+        }
+    }
+    if (matches(m_saved, current)) {
+        return true;
+    }
+
+    if (m_history.size() < m_history_size) {
+        m_history.push_back(current);
+    }
+    else {
+        m_history[m_next_history_index] = current;
+    }
+    m_next_history_index = (m_next_history_index + 1) % m_history_size;
+
+    m_steps_since_saved++;
+    if (m_steps_since_saved == m_steps_until_save) {
+        m_saved = current;
+        m_steps_since_saved = 0;
+        m_steps_until_save *= 2;
+    }
+    return false;
+}
+
+bool CycleDetector::matches(const Entry& earlier, const Entry& current) {
+    if (earlier.invariant_hash != current.invariant_hash) {
+        return false;
+    }
+    // An odd translation changes which cells share blocks, so the state wouldn't evolve the
+    // same way.
+    uint32_t dr;
+    uint32_t dc;
+    if (!m_torus_hash.find_even_translation(earlier.hash, current.hash, dr, dc)) {
+        return false;
+    }
+    m_period = std::abs(current.frame - earlier.frame);
+    m_first_frame = earlier.frame;
+    m_row_offset = (dr > m_grid.num_rows() / 2) ? (int64_t)dr - m_grid.num_rows() : dr;
+    m_col_offset = (dc > m_grid.num_cols() / 2) ? (int64_t)dc - m_grid.num_cols() : dc;
+    return true;
+}
+
+}  // namespace
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "ca.h"
+
+namespace Critters {
+
+/**
+ * Detects when the state of a grid repeats, possibly translated, using
+ * `MargolusEngine::translation_hash`. Only frames with the same parity as the first one are
+ * compared, since blocks are aligned differently on the others. A state that's translated by
+ * an even number of rows and columns evolves exactly like the original, so once a state
+ * repeats the grid is periodic from then on: an oscillator if the translation is zero and a
+ * spaceship (or a collection of them moving the same way) otherwise.
+ *
+ * Memory use is constant. The hashes of the last `history_size` compared frames are kept, so
+ * periods up to twice that many frames are found as soon as the state repeats. Longer periods
+ * are found with Brent's algorithm: one saved hash is compared with every frame, and replaced
+ * whenever the number of frames since it was saved reaches a power of two, so a cycle is
+ * found within a few times its period after the grid enters it.
+ */
+class CycleDetector {
+public:
+    explicit CycleDetector(MargolusEngine& grid, size_t history_size = 64);
+
+    /**
+     * Call after every frame. Returns true if the current state is a translation of an earlier
+     * one, in which case `period` etc. describe the cycle.
+     */
+    bool check();
+
+    // Number of frames between the two matching states.
+    uint64_t period() const {return m_period;}
+    // Frame number of the earlier state.
+    int64_t first_frame() const {return m_first_frame;}
+    // Translation from the earlier state to the current one, from -num_rows/2 + 1 to num_rows/2
+    // (and the same for columns).
+    int64_t row_offset() const {return m_row_offset;}
+    int64_t col_offset() const {return m_col_offset;}
+
+private:
+    struct Entry {
+        int64_t frame;
+        TorusHash::Value hash;
+        uint64_t invariant_hash;
+    };
+
+    MargolusEngine& m_grid;
+    const TorusHash& m_torus_hash;
+    int64_t m_start_frame;
+    // Ring buffer of recent entries.
+    std::vector<Entry> m_history;
+    size_t m_history_size;
+    size_t m_next_history_index = 0;
+    // Brent's algorithm.
+    Entry m_saved;
+    uint64_t m_steps_since_saved = 0;
+    uint64_t m_steps_until_save = 1;
+
+    uint64_t m_period = 0;
+    int64_t m_first_frame = 0;
+    int64_t m_row_offset = 0;
+    int64_t m_col_offset = 0;
+
+    bool matches(const Entry& earlier, const Entry& current);
+};
+
+}  // namespace
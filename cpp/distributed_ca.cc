@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "cell_batcher.h"
+#include "distributed_ca.h"
+
+namespace Critters {
+
+DistributedMargolusCA::DistributedMargolusCA(uint32_t num_rows, uint32_t num_cols,
+        uint32_t rank, uint32_t num_ranks, uint32_t frames_per_exchange,
+        const TransportFactory& transport_factory, const EngineFactory& engine_factory) :
+        m_num_rows(num_rows), m_num_cols(num_cols), m_rank(rank), m_num_ranks(num_ranks),
+        m_frames_per_exchange(std::max(frames_per_exchange, 1U)) {
+    if (num_rows % 2 != 0 || num_cols % 2 != 0 || rank >= num_ranks) {
+        throw std::invalid_argument("Bad grid size or rank for distributed grid");
+    }
+    // Halos start at even rows, so that blocks line up with the torus.
+    m_halo_rows = m_frames_per_exchange + (m_frames_per_exchange % 2);
+    // The smallest band is the first one.
+    if (band_start(num_rows, 1, num_ranks) < m_halo_rows) {
+        throw std::invalid_argument("Bands of " + std::to_string(num_rows) + " rows split " +
+            std::to_string(num_ranks) + " ways are smaller than the halos (" +
+            std::to_string(m_halo_rows) + " rows)");
+    }
+    m_first_row = band_start(num_rows, rank, num_ranks);
+    m_num_band_rows = band_start(num_rows, rank + 1, num_ranks) - m_first_row;
+    m_grid = engine_factory(m_num_band_rows + 2 * m_halo_rows, num_cols);
+    m_transport = transport_factory();
+}
+
+uint32_t DistributedMargolusCA::band_start(
+        uint32_t num_rows, uint32_t rank, uint32_t num_ranks) {
+    return 2 * (uint32_t)((uint64_t)(num_rows / 2) * rank / num_ranks);
+}
+
+void DistributedMargolusCA::get_row_bits(uint32_t row, uint64_t* words) const {
+    m_grid->get_row_bits(row - m_first_row + m_halo_rows, words);
+}
+
+void DistributedMargolusCA::set_row_bits(uint32_t row, const uint64_t* words) {
+    m_grid->set_row_bits(row - m_first_row + m_halo_rows, words);
+}
+
+void DistributedMargolusCA::visit_active_cells(const CellVisitor& visit) const {
+    CellBatcher<uint32_t> batcher(visit);
+    uint32_t band_end = m_halo_rows + m_num_band_rows;
+    m_grid->visit_active_cells([&](const uint32_t* coords, size_t num_cells) {
+        for (size_t i = 0; i < num_cells; i++) {
+            uint32_t row = coords[2 * i];
+            if (row >= m_halo_rows && row < band_end) {
+                batcher.add(row - m_halo_rows + m_first_row, coords[2 * i + 1]);
+            }
+        }
+    });
+    batcher.flush();
+}
+
+// Sends the rows at the edges of the band that the neighbors need for the next `num_frames`
+// frames, and receives theirs into the halos. Rows further out in the halos are left as they
+// are; they can't affect the band in time.
+void DistributedMargolusCA::exchange_halos(uint32_t num_frames) {
+    bool last_frame_even = (use_even_grid() == (num_frames % 2 == 1));
+    uint32_t num_halo_rows = num_frames - (last_frame_even ? 1 : 0);
+    if (num_halo_rows == 0) {
+        return;
+    }
+    uint32_t row_words = m_grid->num_row_words();
+    size_t num_words = (size_t)num_halo_rows * row_words;
+    m_to_above.resize(num_words);
+    m_to_below.resize(num_words);
+    m_from_above.resize(num_words);
+    m_from_below.resize(num_words);
+    uint32_t band_end = m_halo_rows + m_num_band_rows;
+    for (uint32_t i = 0; i < num_halo_rows; i++) {
+        m_grid->get_row_bits(m_halo_rows + i, &m_to_above[(size_t)i * row_words]);
+        m_grid->get_row_bits(
+            band_end - num_halo_rows + i, &m_to_below[(size_t)i * row_words]);
+    }
+    m_transport->exchange(
+        reinterpret_cast<const uint8_t*>(m_to_above.data()),
+        reinterpret_cast<const uint8_t*>(m_to_below.data()),
+        reinterpret_cast<uint8_t*>(m_from_above.data()),
+        reinterpret_cast<uint8_t*>(m_from_below.data()),
+        num_words * sizeof(uint64_t));
+    for (uint32_t i = 0; i < num_halo_rows; i++) {
+        m_grid->set_row_bits(
+            m_halo_rows - num_halo_rows + i, &m_from_above[(size_t)i * row_words]);
+        m_grid->set_row_bits(band_end + i, &m_from_below[(size_t)i * row_words]);
+    }
+}
+
+void DistributedMargolusCA::advance(uint64_t num_frames) {
+    while (num_frames > 0) {
+        uint32_t frames = std::min<uint64_t>(num_frames, m_frames_per_exchange);
+        exchange_halos(frames);
+        m_grid->advance(frames);
+        num_frames -= frames;
+    }
+}
+
+}  // namespace
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "ca.h"
+#include "halo_transport.h"
+
+namespace Critters {
+
+/**
+ * One rank's part of a torus that's split into horizontal bands across several processes, for
+ * grids that don't fit in one machine's memory or that one process can't update fast enough.
+ * Each rank owns a band of rows, with an even height so that blocks on even frames never cross
+ * a band boundary, and runs it in an ordinary engine that also has `halo_rows` rows above and
+ * below for copies of its neighbors' edges.
+ *
+ * Every `frames_per_exchange` frames, ranks swap the rows next to their band boundaries and then
+ * advance that many frames without communicating. The engine's own grid wraps around at the
+ * outer edges of the halos rather than the band, which gives wrong results there, but those
+ * spread by one row per frame and never reach the band before the next exchange. The phase of
+ * the frames decides how many rows have to be exchanged: a band's cells after k frames depend on
+ * k rows beyond its edges if the last frame is odd, but only k-1 if it's even, because then the
+ * last frame's blocks are entirely within the band. So with one frame per exchange, only odd
+ * frames exchange anything.
+ *
+ * Every rank has to make the same calls (apart from setting cells) in the same order, since
+ * advancing exchanges halos with the neighboring ranks.
+ */
+class DistributedMargolusCA {
+public:
+    // Returns an engine with the given dimensions for a rank's band and halos.
+    using EngineFactory =
+        std::function<std::unique_ptr<MargolusEngine>(uint32_t num_rows, uint32_t num_cols)>;
+    // Returns a transport connected to the neighboring ranks.
+    using TransportFactory = std::function<std::unique_ptr<HaloTransport>()>;
+
+    /**
+     * Creates rank `rank` of `num_ranks` for a torus of `num_rows` by `num_cols` cells, which
+     * must both be even. Throws std::invalid_argument if any band would have fewer rows than the
+     * halos, in which case `transport_factory` isn't called.
+     */
+    DistributedMargolusCA(uint32_t num_rows, uint32_t num_cols, uint32_t rank,
+        uint32_t num_ranks, uint32_t frames_per_exchange,
+        const TransportFactory& transport_factory, const EngineFactory& engine_factory);
+
+    /**
+     * Returns the first row of `rank`'s band. Bands are as equal as possible, and the band of
+     * rank `num_ranks` would start at `num_rows`.
+     */
+    static uint32_t band_start(uint32_t num_rows, uint32_t rank, uint32_t num_ranks);
+
+    uint32_t num_rows() const {return m_num_rows;}
+    uint32_t num_cols() const {return m_num_cols;}
+    uint32_t rank() const {return m_rank;}
+    uint32_t num_ranks() const {return m_num_ranks;}
+    uint32_t first_row() const {return m_first_row;}
+    uint32_t num_band_rows() const {return m_num_band_rows;}
+
+    int64_t frame_number() const {return m_grid->frame_number();}
+    void set_frame_number(int64_t fnum) {m_grid->set_frame_number(fnum);}
+    bool is_reversed() const {return m_grid->is_reversed();}
+    void set_reversed(bool r) {m_grid->set_reversed(r);}
+    void set_num_threads(uint32_t nt) {m_grid->set_num_threads(nt);}
+
+    /**
+     * The engine for this rank. Its rows `halo_rows()` through `halo_rows() + num_band_rows()`
+     * are the band.
+     */
+    const MargolusEngine& local_grid() const {return *m_grid;}
+    uint32_t halo_rows() const {return m_halo_rows;}
+
+    /**
+     * Rows are numbered as in the whole torus, and must be in this rank's band.
+     */
+    void get_row_bits(uint32_t row, uint64_t* words) const;
+    void set_row_bits(uint32_t row, const uint64_t* words);
+
+    /**
+     * Calls `visit` with the active cells in this rank's band, in torus coordinates, as for
+     * `MargolusEngine::visit_active_cells`.
+     */
+    void visit_active_cells(const CellVisitor& visit) const;
+
+    void tick() {advance(1);}
+    void advance(uint64_t num_frames);
+
+private:
+    uint32_t m_num_rows;
+    uint32_t m_num_cols;
+    uint32_t m_rank;
+    uint32_t m_num_ranks;
+    uint32_t m_first_row;
+    uint32_t m_num_band_rows;
+    uint32_t m_frames_per_exchange;
+    uint32_t m_halo_rows;
+    std::unique_ptr<HaloTransport> m_transport;
+    std::unique_ptr<MargolusEngine> m_grid;
+    // Rows being sent and received, in the format of `MargolusEngine::get_row_bits`.
+    std::vector<uint64_t> m_to_above;
+    std::vector<uint64_t> m_to_below;
+    std::vector<uint64_t> m_from_above;
+    std::vector<uint64_t> m_from_below;
+
+    bool use_even_grid() const {return (frame_number() % 2 == 0) != is_reversed();}
+    void exchange_halos(uint32_t num_frames);
+};
+
+}  // namespace
@@ -0,0 +1,124 @@
+#include <algorithm>
+
+#include "ensemble.h"
+
+namespace Critters {
+
+uint64_t splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+namespace {
+    // Fills `words` with the bits for one row of `fill_random`. Each random number gives two
+    // cells, which are active if its 32-bit halves are below `threshold`.
+    void random_row_bits(uint64_t seed, uint32_t row, uint64_t threshold,
+            uint32_t num_cols, uint64_t* words) {
+        uint64_t state = seed ^ (0xD1B54A32D192ED03ULL * (row + 1ULL));
+        uint32_t num_words = (num_cols + 63) / 64;
+        for (uint32_t i = 0; i < num_words; i++) {
+            uint64_t word = 0;
+            for (uint32_t b = 0; b < 64; b += 2) {
+                uint64_t r = splitmix64(state);
+                word |= (uint64_t)((r & 0xFFFFFFFF) < threshold) << b;
+                word |= (uint64_t)((r >> 32) < threshold) << (b + 1);
+            }
+            words[i] = word;
+        }
+        if (num_cols % 64 != 0) {
+            words[num_words - 1] &= (1ULL << (num_cols % 64)) - 1;
+        }
+    }
+
+    // Cells are active if a 32-bit random number is below this.
+    uint64_t random_threshold(double density) {
+        return (density >= 1.0) ? (1ULL << 32) :
+            (density <= 0.0) ? 0 : (uint64_t)(density * 4294967296.0);
+    }
+}
+
+void fill_random(MargolusEngine& grid, uint64_t seed, double density, WorkerPool* pool) {
+    uint64_t threshold = random_threshold(density);
+    uint32_t num_words = grid.num_row_words();
+    if (!pool) {
+        std::vector<uint64_t> row(num_words);
+        for (uint32_t r = 0; r < grid.num_rows(); r++) {
+            random_row_bits(seed, r, threshold, grid.num_cols(), row.data());
+            grid.set_row_bits(r, row.data());
+        }
+        return;
+    }
+    // Engines don't support setting rows concurrently, so only generating them is parallel.
+    std::vector<uint64_t> bits((size_t)grid.num_rows() * num_words);
+    pool->run(grid.num_rows(), [&](uint32_t r, uint32_t) {
+        random_row_bits(seed, r, threshold, grid.num_cols(), &bits[(size_t)r * num_words]);
+    });
+    for (uint32_t r = 0; r < grid.num_rows(); r++) {
+        grid.set_row_bits(r, &bits[(size_t)r * num_words]);
+    }
+}
+
+void random_row_bits(
+        uint64_t seed, uint32_t row, double density, uint32_t num_cols, uint64_t* words) {
+    random_row_bits(seed, row, random_threshold(density), num_cols, words);
+}
+
+uint64_t grid_hash(const MargolusEngine& grid) {
+    std::vector<uint64_t> row(grid.num_row_words());
+    uint64_t hash = 0xCBF29CE484222325ULL ^ ((uint64_t)grid.num_rows() << 32) ^ grid.num_cols();
+    for (uint32_t r = 0; r < grid.num_rows(); r++) {
+        grid.get_row_bits(r, row.data());
+        for (uint64_t word : row) {
+            uint64_t state = hash ^ word;
+            hash = splitmix64(state);
+        }
+    }
+    return hash;
+}
+
+Ensemble::Ensemble(uint32_t num_rows, uint32_t num_cols, EngineFactory factory,
+        uint32_t num_threads) :
+    m_num_rows(num_rows), m_num_cols(num_cols), m_factory(std::move(factory)),
+    m_pool(std::max(num_threads, 1U)) {
+}
+
+std::vector<EnsembleSummary> Ensemble::run(
+        const std::vector<EnsembleRun>& runs, uint64_t num_frames, uint64_t sample_frames) {
+    std::vector<EnsembleSummary> summaries(runs.size());
+    m_pool.run(runs.size(), [&](uint32_t i, uint32_t) {
+        summaries[i] = run_one(runs[i], num_frames, sample_frames);
+    });
+    return summaries;
+}
+
+EnsembleSummary Ensemble::run_one(
+        const EnsembleRun& run, uint64_t num_frames, uint64_t sample_frames) {
+    auto grid = m_factory(run.transition_table);
+    // Each grid runs on one thread of the ensemble's pool.
+    grid->set_num_threads(1);
+    fill_random(*grid, run.seed, run.density);
+
+    EnsembleSummary summary;
+    summary.populations.push_back(grid->population());
+    uint64_t frame = 0;
+    while (frame < num_frames) {
+        uint64_t step = (sample_frames > 0) ?
+            std::min(sample_frames - frame % sample_frames, num_frames - frame) :
+            num_frames - frame;
+        grid->advance(step);
+        frame += step;
+        summary.populations.push_back(grid->population());
+    }
+
+    CellBounds bounds = grid->bounding_box();
+    summary.min_row = bounds.min_row;
+    summary.min_col = bounds.min_col;
+    summary.max_row = bounds.max_row;
+    summary.max_col = bounds.max_col;
+    summary.hash = grid_hash(*grid);
+    return summary;
+}
+
+}  // namespace
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ca.h"
+#include "worker_pool.h"
+
+namespace Critters {
+
+/**
+ * Advances `state` and returns the next number of the SplitMix64 generator, which the functions
+ * below use for random grids.
+ */
+uint64_t splitmix64(uint64_t& state);
+
+/**
+ * Sets every cell of `grid` to active with probability `density`. The result depends only on
+ * the seed and the grid dimensions: each row has its own random stream, derived from the seed
+ * and row number, so rows can be generated in any order. If `pool` is given the rows are
+ * generated in parallel on it.
+ */
+void fill_random(MargolusEngine& grid, uint64_t seed, double density, WorkerPool* pool = nullptr);
+
+/**
+ * Fills `words` with row `row` of a grid with `num_cols` columns filled by `fill_random`, in the
+ * format of `MargolusEngine::get_row_bits`.
+ */
+void random_row_bits(
+    uint64_t seed, uint32_t row, double density, uint32_t num_cols, uint64_t* words);
+
+/**
+ * Returns a hash of the cells of `grid`, which doesn't depend on the engine type.
+ */
+uint64_t grid_hash(const MargolusEngine& grid);
+
+struct EnsembleRun {
+    // The rule as given, for the summary.
+    std::string rule;
+    std::shared_ptr<TransitionTable> transition_table;
+    uint64_t seed;
+    double density;
+};
+
+struct EnsembleSummary {
+    // Population at frame 0 and then every `sample_frames`, and at the last frame.
+    std::vector<uint64_t> populations;
+    // Smallest and largest row and column with an active cell at the last frame. All -1 if
+    // there are no active cells.
+    int64_t min_row = -1;
+    int64_t min_col = -1;
+    int64_t max_row = -1;
+    int64_t max_col = -1;
+    uint64_t hash = 0;
+};
+
+/**
+ * Simulates many independent grids with the same dimensions, such as for searching through
+ * rules. Each grid is filled by `fill_random` and run from frame 0 to `num_frames` as a single
+ * task on a shared worker pool, so small grids that can't use more than one thread each still
+ * use every thread between them.
+ */
+class Ensemble {
+public:
+    // Called concurrently from the pool's threads.
+    using EngineFactory =
+        std::function<std::unique_ptr<MargolusEngine>(std::shared_ptr<TransitionTable>)>;
+
+    Ensemble(uint32_t num_rows, uint32_t num_cols, EngineFactory factory, uint32_t num_threads);
+
+    /**
+     * Runs every grid in `runs` and returns their summaries in the same order.
+     * `sample_frames` is how often to record the population, or 0 for only the first and last
+     * frames.
+     */
+    std::vector<EnsembleSummary> run(
+        const std::vector<EnsembleRun>& runs, uint64_t num_frames, uint64_t sample_frames);
+
+private:
+    uint32_t m_num_rows;
+    uint32_t m_num_cols;
+    EngineFactory m_factory;
+    WorkerPool m_pool;
+
+    EnsembleSummary run_one(const EnsembleRun& run, uint64_t num_frames, uint64_t sample_frames);
+};
+
+}  // namespace
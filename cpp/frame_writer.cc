@@ -0,0 +1,135 @@
+#include <algorithm>
+
+#include "cell_batcher.h"
+#include "frame_writer.h"
+
+namespace Critters {
+
+void GridFrame::capture(const MargolusEngine& grid) {
+    frame_number = grid.frame_number();
+    num_rows = grid.num_rows();
+    num_cols = grid.num_cols();
+    row_words = grid.num_row_words();
+    bits.resize((size_t)num_rows * row_words);
+    for (uint32_t r = 0; r < num_rows; r++) {
+        grid.get_row_bits(r, &bits[(size_t)r * row_words]);
+    }
+}
+
+void GridFrame::visit_active_cells(const CellVisitor& visit) const {
+    CellBatcher<uint32_t> batcher(visit);
+    for (uint32_t r = 0; r < num_rows; r++) {
+        const uint64_t* words = row(r);
+        for (uint32_t i = 0; i < row_words; i++) {
+            for (uint64_t word = words[i]; word != 0; word &= word - 1) {
+                batcher.add(r, 64 * i + __builtin_ctzll(word));
+            }
+        }
+    }
+    batcher.flush();
+}
+
+void GridFrame::visit_changed_cells(const GridFrame& previous, const CellVisitor& visit) const {
+    CellBatcher<uint32_t> batcher(visit);
+    for (uint32_t r = 0; r < num_rows; r++) {
+        const uint64_t* words = row(r);
+        const uint64_t* previous_words = previous.row(r);
+        for (uint32_t i = 0; i < row_words; i++) {
+            for (uint64_t word = words[i] ^ previous_words[i]; word != 0; word &= word - 1) {
+                batcher.add(r, 64 * i + __builtin_ctzll(word));
+            }
+        }
+    }
+    batcher.flush();
+}
+
+AsyncFrameWriter::AsyncFrameWriter(size_t max_pending_frames, const FormatFn& format) :
+        m_max_pending_frames(std::max<size_t>(max_pending_frames, 1)), m_format(format) {
+    m_thread = std::thread([this] {writer_loop();});
+}
+
+AsyncFrameWriter::~AsyncFrameWriter() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+}
+
+void AsyncFrameWriter::write(const MargolusEngine& grid) {
+    std::unique_ptr<GridFrame> frame;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto can_queue = [this] {
+            return m_error || (m_pending.size() < m_max_pending_frames &&
+                (!m_free.empty() || m_num_buffers < m_max_pending_frames + 2));
+        };
+        m_changed.wait(lock, can_queue);
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+        if (!m_free.empty()) {
+            frame = std::move(m_free.back());
+            m_free.pop_back();
+        }
+        else {
+            frame = std::make_unique<GridFrame>();
+            m_num_buffers++;
+        }
+    }
+    // Copied without the lock, so the writer can keep going.
+    frame->capture(grid);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(std::move(frame));
+    }
+    m_changed.notify_all();
+}
+
+void AsyncFrameWriter::finish() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this] {return m_error || (m_pending.empty() && !m_formatting);});
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+}
+
+void AsyncFrameWriter::writer_loop() {
+    std::unique_ptr<GridFrame> previous;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_changed.wait(lock, [this] {return m_stopping || !m_pending.empty();});
+        if (m_stopping) {
+            return;
+        }
+        std::unique_ptr<GridFrame> frame = std::move(m_pending.front());
+        m_pending.pop_front();
+        m_formatting = true;
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            m_format(*frame, previous.get());
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+        m_formatting = false;
+        if (error) {
+            // Nothing more is formatted, and the pending frames are dropped.
+            m_error = error;
+            while (!m_pending.empty()) {
+                m_free.push_back(std::move(m_pending.front()));
+                m_pending.pop_front();
+            }
+        }
+        if (previous) {
+            m_free.push_back(std::move(previous));
+        }
+        previous = std::move(frame);
+        m_changed.notify_all();
+    }
+}
+
+}  // namespace
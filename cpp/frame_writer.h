@@ -0,0 +1,109 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ca.h"
+
+namespace Critters {
+
+/**
+ * A copy of a grid's cells at one frame, with each row in the format of
+ * `MargolusEngine::get_row_bits`. That's an eighth of the size of a `MargolusCA` grid, and
+ * quick to take.
+ */
+struct GridFrame {
+    int64_t frame_number = 0;
+    uint32_t num_rows = 0;
+    uint32_t num_cols = 0;
+    uint32_t row_words = 0;
+    std::vector<uint64_t> bits;
+
+    /**
+     * Replaces the contents with the current state of `grid`, reusing the memory if the size
+     * is the same.
+     */
+    void capture(const MargolusEngine& grid);
+
+    const uint64_t* row(uint32_t r) const {return &bits[(size_t)r * row_words];}
+
+    /**
+     * Calls `visit` with the active cells in row major order, in batches, as for
+     * `MargolusEngine::visit_active_cells`.
+     */
+    void visit_active_cells(const CellVisitor& visit) const;
+
+    /**
+     * Calls `visit` with the cells that differ from `previous`, which must be the same size.
+     */
+    void visit_changed_cells(const GridFrame& previous, const CellVisitor& visit) const;
+};
+
+/**
+ * Writes checkpoints of a grid on a background thread, so that the simulation doesn't wait
+ * while they're formatted and written to a slow consumer. `write` only copies the grid into a
+ * `GridFrame` and queues it; a writer thread passes the queued frames, in order, to a function
+ * that formats them.
+ *
+ * At most `max_pending_frames` frames wait in the queue. Beyond that `write` blocks until the
+ * writer catches up, so a consumer that can't keep up slows the simulation down rather than
+ * making memory grow. Frame buffers are reused, and there are never more than
+ * `max_pending_frames + 2` of them: the queued ones, the one being formatted, and the one
+ * before it, which is passed along for formats that only list what changed.
+ */
+class AsyncFrameWriter {
+public:
+    /**
+     * Called on the writer thread with each frame, and the frame queued before it (or null for
+     * the first).
+     */
+    using FormatFn = std::function<void(const GridFrame& frame, const GridFrame* previous)>;
+
+    AsyncFrameWriter(size_t max_pending_frames, const FormatFn& format);
+
+    /**
+     * Stops the writer thread after the frame it's formatting. Call `finish` first to write
+     * everything.
+     */
+    ~AsyncFrameWriter();
+
+    AsyncFrameWriter(const AsyncFrameWriter&) = delete;
+    AsyncFrameWriter& operator=(const AsyncFrameWriter&) = delete;
+
+    /**
+     * Queues the current state of `grid`. If formatting an earlier frame threw an exception,
+     * no more frames are formatted, and this rethrows it.
+     */
+    void write(const MargolusEngine& grid);
+
+    /**
+     * Waits until every queued frame has been formatted, and rethrows the exception if
+     * formatting one of them failed.
+     */
+    void finish();
+
+private:
+    size_t m_max_pending_frames;
+    FormatFn m_format;
+    std::mutex m_mutex;
+    // Signaled when a frame is queued, and when the writer frees a buffer or runs out of work.
+    std::condition_variable m_changed;
+    std::deque<std::unique_ptr<GridFrame>> m_pending;
+    std::vector<std::unique_ptr<GridFrame>> m_free;
+    size_t m_num_buffers = 0;
+    bool m_formatting = false;
+    bool m_stopping = false;
+    std::exception_ptr m_error;
+    std::thread m_thread;
+
+    void writer_loop();
+};
+
+}  // namespace
@@ -0,0 +1,772 @@
+#include <algorithm>
+#include <cerrno>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "grid_server.h"
+#include "pattern_input.h"
+#include "snapshot.h"
+
+namespace Critters {
+
+namespace {
+    void append_json_string(std::string& out, const std::string& s) {
+        out += '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            }
+            else if ((unsigned char)c < 0x20) {
+                const char* hex = "0123456789abcdef";
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xF];
+            }
+            else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    // Reads a line of JSON in place, without building a tree of values, so that long lists of
+    // cells are parsed straight into coordinates. The caller asks for the type of value it
+    // expects, and anything else is an error.
+    class JsonReader {
+    public:
+        explicit JsonReader(const std::string& text) :
+                m_p(text.data()), m_end(text.data() + text.size()) {}
+
+        // Calls `field` with each key of an object, which must read the key's value.
+        void read_object(const std::function<void(const std::string&)>& field) {
+            expect('{');
+            if (peek() == '}') {
+                m_p++;
+                return;
+            }
+            while (true) {
+                std::string key = read_string();
+                expect(':');
+                field(key);
+                char c = next();
+                if (c == '}') {
+                    return;
+                }
+                if (c != ',') {
+                    error("expected ',' or '}'");
+                }
+            }
+        }
+
+        // Calls `element` for each element of an array, which must read the element.
+        void read_array(const std::function<void()>& element) {
+            expect('[');
+            if (peek() == ']') {
+                m_p++;
+                return;
+            }
+            while (true) {
+                element();
+                char c = next();
+                if (c == ']') {
+                    return;
+                }
+                if (c != ',') {
+                    error("expected ',' or ']'");
+                }
+            }
+        }
+
+        std::string read_string() {
+            expect('"');
+            std::string s;
+            while (true) {
+                if (m_p == m_end) {
+                    error("unterminated string");
+                }
+                char c = *m_p++;
+                if (c == '"') {
+                    return s;
+                }
+                if (c != '\\') {
+                    s += c;
+                    continue;
+                }
+                if (m_p == m_end) {
+                    error("unterminated string");
+                }
+                char escaped = *m_p++;
+                switch (escaped) {
+                    case 'b': s += '\b'; break;
+                    case 'f': s += '\f'; break;
+                    case 'n': s += '\n'; break;
+                    case 'r': s += '\r'; break;
+                    case 't': s += '\t'; break;
+                    case 'u': append_utf8(s, read_hex_digits()); break;
+                    default: s += escaped; break;
+                }
+            }
+        }
+
+        int64_t read_int() {
+            skip_space();
+            bool negative = (m_p < m_end && *m_p == '-');
+            if (negative) {
+                m_p++;
+            }
+            if (m_p == m_end || !std::isdigit((unsigned char)*m_p)) {
+                error("expected an integer");
+            }
+            uint64_t magnitude = 0;
+            while (m_p < m_end && std::isdigit((unsigned char)*m_p)) {
+                if (magnitude > (UINT64_MAX - 9) / 10) {
+                    error("integer out of range");
+                }
+                magnitude = 10 * magnitude + (*m_p++ - '0');
+            }
+            if (m_p < m_end && (*m_p == '.' || *m_p == 'e' || *m_p == 'E')) {
+                error("expected an integer");
+            }
+            if (magnitude > (uint64_t)INT64_MAX + negative) {
+                error("integer out of range");
+            }
+            return negative ? 0 - magnitude : magnitude;
+        }
+
+        bool read_bool() {
+            skip_space();
+            if (match("true")) {
+                return true;
+            }
+            if (match("false")) {
+                return false;
+            }
+            error("expected true or false");
+            return false;
+        }
+
+        // Reads an array of [row, col] pairs, appending them to `coords`.
+        void read_cells(std::vector<int64_t>& coords) {
+            read_array([this, &coords] {
+                expect('[');
+                coords.push_back(read_int());
+                expect(',');
+                coords.push_back(read_int());
+                expect(']');
+            });
+        }
+
+        // Reads a string, number, or null, and returns it as JSON. Strings are escaped again, so
+        // that the result is valid JSON even if the input used escapes that JSON doesn't have.
+        std::string read_scalar() {
+            char c = peek();
+            if (c == '"') {
+                std::string json;
+                append_json_string(json, read_string());
+                return json;
+            }
+            const char* start = m_p;
+            if (c == '-' || std::isdigit((unsigned char)c)) {
+                skip_number();
+            }
+            else if (!match("null")) {
+                error("expected a string, number, or null");
+            }
+            return std::string(start, m_p);
+        }
+
+        // Skips any value.
+        void skip_value() {
+            char c = peek();
+            if (c == '"') {
+                read_string();
+            }
+            else if (c == '{') {
+                read_object([this](const std::string&) {skip_value();});
+            }
+            else if (c == '[') {
+                read_array([this] {skip_value();});
+            }
+            else if (!match("true") && !match("false") && !match("null")) {
+                skip_number();
+            }
+        }
+
+        void expect_end() {
+            skip_space();
+            if (m_p != m_end) {
+                error("unexpected text after the command");
+            }
+        }
+
+    private:
+        const char* m_p;
+        const char* m_end;
+
+        [[noreturn]] void error(const std::string& message) {
+            throw std::invalid_argument("Invalid command JSON: " + message);
+        }
+
+        void skip_space() {
+            while (m_p < m_end && std::isspace((unsigned char)*m_p)) {
+                m_p++;
+            }
+        }
+
+        char peek() {
+            skip_space();
+            return (m_p < m_end) ? *m_p : '\0';
+        }
+
+        char next() {
+            char c = peek();
+            if (m_p == m_end) {
+                error("unexpected end of line");
+            }
+            m_p++;
+            return c;
+        }
+
+        void expect(char c) {
+            if (next() != c) {
+                error(std::string("expected '") + c + "'");
+            }
+        }
+
+        // Skips a number: an optional minus sign, an integer part without leading zeros, an
+        // optional fraction, and an optional exponent.
+        void skip_number() {
+            const char* start = m_p;
+            if (m_p < m_end && *m_p == '-') {
+                m_p++;
+            }
+            if (m_p < m_end && *m_p == '0') {
+                m_p++;
+            }
+            else if (skip_digits() == 0) {
+                m_p = start;
+                error("expected a value");
+            }
+            if (m_p < m_end && *m_p == '.') {
+                m_p++;
+                if (skip_digits() == 0) {
+                    error("expected digits after '.'");
+                }
+            }
+            if (m_p < m_end && (*m_p == 'e' || *m_p == 'E')) {
+                m_p++;
+                if (m_p < m_end && (*m_p == '+' || *m_p == '-')) {
+                    m_p++;
+                }
+                if (skip_digits() == 0) {
+                    error("expected digits in the exponent");
+                }
+            }
+            if (m_p < m_end && std::isalnum((unsigned char)*m_p)) {
+                error("expected a value");
+            }
+        }
+
+        size_t skip_digits() {
+            const char* start = m_p;
+            while (m_p < m_end && std::isdigit((unsigned char)*m_p)) {
+                m_p++;
+            }
+            return m_p - start;
+        }
+
+        bool match(const char* literal) {
+            size_t n = std::strlen(literal);
+            if ((size_t)(m_end - m_p) < n || std::memcmp(m_p, literal, n) != 0) {
+                return false;
+            }
+            m_p += n;
+            return true;
+        }
+
+        uint32_t read_hex_digits() {
+            if (m_end - m_p < 4) {
+                error("bad \\u escape");
+            }
+            uint32_t code = 0;
+            for (int i = 0; i < 4; i++) {
+                char c = *m_p++;
+                if (!std::isxdigit((unsigned char)c)) {
+                    error("bad \\u escape");
+                }
+                code = 16 * code + (std::isdigit((unsigned char)c) ? c - '0' :
+                    std::tolower((unsigned char)c) - 'a' + 10);
+            }
+            return code;
+        }
+
+        // Surrogate pairs aren't combined; names and paths are expected to be plain text.
+        static void append_utf8(std::string& s, uint32_t code) {
+            if (code < 0x80) {
+                s += (char)code;
+            }
+            else if (code < 0x800) {
+                s += (char)(0xC0 | (code >> 6));
+                s += (char)(0x80 | (code & 0x3F));
+            }
+            else {
+                s += (char)(0xE0 | (code >> 12));
+                s += (char)(0x80 | ((code >> 6) & 0x3F));
+                s += (char)(0x80 | (code & 0x3F));
+            }
+        }
+    };
+
+    void append_int(std::string& out, int64_t n) {
+        char digits[20];
+        int num_digits = 0;
+        uint64_t magnitude = (n < 0) ? 0 - (uint64_t)n : n;
+        do {
+            digits[num_digits++] = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (n < 0) {
+            out += '-';
+        }
+        while (num_digits > 0) {
+            out += digits[--num_digits];
+        }
+    }
+
+    int64_t wrap(int64_t n, uint32_t size) {
+        int64_t m = n % size;
+        return (m < 0) ? m + size : m;
+    }
+
+    // Sets cells given as pairs of coordinates, which may be outside the torus.
+    void set_wrapped_cells(MargolusCA& grid, const int64_t* coords, size_t num_cells, bool active) {
+        std::vector<uint32_t> wrapped(2 * num_cells);
+        for (size_t i = 0; i < num_cells; i++) {
+            wrapped[2 * i] = wrap(coords[2 * i], grid.num_rows());
+            wrapped[2 * i + 1] = wrap(coords[2 * i + 1], grid.num_cols());
+        }
+        grid.set_cells(wrapped.data(), num_cells, active);
+    }
+
+    // The 64 cells of a row starting at column `col`, in the format of `get_row_bits`, with
+    // zeros past the end of the row.
+    uint64_t bits_from(const std::vector<uint64_t>& words, uint32_t col) {
+        uint32_t i = col / 64;
+        uint32_t shift = col % 64;
+        uint64_t bits = words[i] >> shift;
+        if (shift > 0 && i + 1 < words.size()) {
+            bits |= words[i + 1] << (64 - shift);
+        }
+        return bits;
+    }
+
+    ssize_t write_some(int fd, const char* data, size_t size) {
+        // Sockets are written without SIGPIPE, so that a client disconnecting only ends its
+        // connection.
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) {
+            n = write(fd, data, size);
+        }
+        return n;
+    }
+
+    bool write_all(int fd, const std::string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t n = write_some(fd, data.data() + offset, data.size() - offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            offset += n;
+        }
+        return true;
+    }
+}
+
+struct GridServer::Command {
+    std::string id;
+    std::string cmd;
+    std::string grid = "default";
+    std::string ca;
+    std::string format = "json";
+    std::string path;
+    std::string pattern;
+    std::string snapshot;
+    int64_t rows = 0;
+    int64_t cols = 0;
+    int64_t n = 1;
+    int64_t frame = 0;
+    bool has_frame = false;
+    bool active = true;
+    std::vector<int64_t> cells;
+    std::vector<int64_t> region;
+};
+
+void GridServer::handle(const std::string& line, std::string& reply) {
+    Command command;
+    try {
+        JsonReader reader(line);
+        reader.read_object([&reader, &command](const std::string& key) {
+            if (key == "id") {
+                command.id = reader.read_scalar();
+            }
+            else if (key == "cmd") {
+                command.cmd = reader.read_string();
+            }
+            else if (key == "grid") {
+                command.grid = reader.read_string();
+            }
+            else if (key == "ca") {
+                command.ca = reader.read_string();
+            }
+            else if (key == "format") {
+                command.format = reader.read_string();
+            }
+            else if (key == "path") {
+                command.path = reader.read_string();
+            }
+            else if (key == "pattern") {
+                command.pattern = reader.read_string();
+            }
+            else if (key == "snapshot") {
+                command.snapshot = reader.read_string();
+            }
+            else if (key == "rows") {
+                command.rows = reader.read_int();
+            }
+            else if (key == "cols") {
+                command.cols = reader.read_int();
+            }
+            else if (key == "n") {
+                command.n = reader.read_int();
+            }
+            else if (key == "frame") {
+                command.frame = reader.read_int();
+                command.has_frame = true;
+            }
+            else if (key == "active") {
+                command.active = reader.read_bool();
+            }
+            else if (key == "cells") {
+                reader.read_cells(command.cells);
+            }
+            else if (key == "region") {
+                reader.read_array([&reader, &command] {
+                    command.region.push_back(reader.read_int());
+                });
+            }
+            else {
+                reader.skip_value();
+            }
+        });
+        reader.expect_end();
+        // Built separately, so that a command that fails partway doesn't leave part of a reply.
+        std::string ok_reply;
+        run_command(command, ok_reply);
+        reply += ok_reply;
+    }
+    catch (std::exception& ex) {
+        reply += "{";
+        if (!command.id.empty()) {
+            reply += "\"id\": " + command.id + ", ";
+        }
+        reply += "\"ok\": false, \"error\": ";
+        append_json_string(reply, ex.what());
+        reply += "}\n";
+    }
+}
+
+MargolusCA& GridServer::find_grid(const std::string& name) {
+    auto it = m_grids.find(name);
+    if (it == m_grids.end()) {
+        throw std::invalid_argument("No grid named " + name);
+    }
+    return *it->second;
+}
+
+void GridServer::run_command(const Command& command, std::string& reply) {
+    reply += "{";
+    if (!command.id.empty()) {
+        reply += "\"id\": " + command.id + ", ";
+    }
+    reply += "\"ok\": true";
+    if (command.cmd == "load") {
+        load(command, reply);
+    }
+    else if (command.cmd == "set_cells") {
+        MargolusCA& grid = find_grid(command.grid);
+        m_seekers.erase(command.grid);
+        set_wrapped_cells(grid, command.cells.data(), command.cells.size() / 2, command.active);
+    }
+    else if (command.cmd == "tick") {
+        MargolusCA& grid = find_grid(command.grid);
+        if (command.n < 0) {
+            throw std::invalid_argument("Can't tick a negative number of frames");
+        }
+        auto seeker = m_seekers.find(command.grid);
+        if (seeker != m_seekers.end()) {
+            seeker->second->advance(command.n);
+        }
+        else {
+            grid.advance(command.n);
+        }
+        reply += ", \"frame\": ";
+        append_int(reply, grid.frame_number());
+    }
+    else if (command.cmd == "reverse") {
+        MargolusCA& grid = find_grid(command.grid);
+        m_seekers.erase(command.grid);
+        grid.set_reversed(!grid.is_reversed());
+        reply += ", \"frame\": ";
+        append_int(reply, grid.frame_number());
+        reply += grid.is_reversed() ? ", \"reversed\": true" : ", \"reversed\": false";
+    }
+    else if (command.cmd == "seek") {
+        MargolusCA& grid = find_grid(command.grid);
+        if (!command.has_frame) {
+            throw std::invalid_argument("Seeking needs a frame");
+        }
+        std::unique_ptr<KeyframeSeeker>& seeker = m_seekers[command.grid];
+        if (!seeker) {
+            seeker = std::make_unique<KeyframeSeeker>(grid);
+        }
+        seeker->seek(command.frame);
+        reply += ", \"frame\": ";
+        append_int(reply, grid.frame_number());
+    }
+    else if (command.cmd == "query") {
+        query(command, find_grid(command.grid), reply);
+        return;
+    }
+    else if (command.cmd == "snapshot") {
+        MargolusCA& grid = find_grid(command.grid);
+        if (command.path.empty()) {
+            throw std::invalid_argument("Snapshots need a path");
+        }
+        SnapshotWriter writer(
+            command.path, grid.num_rows(), grid.num_cols(), grid.transition_table());
+        writer.write(grid);
+        writer.close();
+        reply += ", \"frame\": ";
+        append_int(reply, grid.frame_number());
+    }
+    else if (command.cmd == "drop") {
+        find_grid(command.grid);
+        m_seekers.erase(command.grid);
+        m_grids.erase(command.grid);
+    }
+    else {
+        throw std::invalid_argument("Unknown command: " + command.cmd);
+    }
+    reply += "}\n";
+}
+
+void GridServer::load(const Command& command, std::string& reply) {
+    std::unique_ptr<MargolusCA> grid;
+    if (!command.snapshot.empty()) {
+        SnapshotReader reader(command.snapshot);
+        if (reader.num_records() == 0) {
+            throw std::runtime_error("No frames in snapshot file " + command.snapshot);
+        }
+        size_t record = command.has_frame ?
+            reader.find_frame(command.frame) : reader.num_records() - 1;
+        grid = std::make_unique<MargolusCA>(reader.num_rows(), reader.num_cols(),
+            TransitionTable::fromHex(reader.rule_hex()));
+        grid->set_num_threads(m_num_threads);
+        reader.load(record, *grid);
+    }
+    else {
+        if (command.rows <= 0 || command.rows % 2 != 0 || command.rows > UINT32_MAX ||
+                command.cols <= 0 || command.cols % 2 != 0 || command.cols > UINT32_MAX) {
+            throw std::invalid_argument("Rows and columns must be positive and even");
+        }
+        grid = std::make_unique<MargolusCA>(
+            command.rows, command.cols, TransitionTable::fromName(command.ca));
+        grid->set_num_threads(m_num_threads);
+        set_wrapped_cells(*grid, command.cells.data(), command.cells.size() / 2, true);
+        if (!command.pattern.empty()) {
+            auto input = PatternInput::from_file(command.pattern);
+            input->read_cells(input->detect_format(),
+                [&grid](const int64_t* coords, size_t num_cells) {
+                    set_wrapped_cells(*grid, coords, num_cells, true);
+                });
+        }
+        grid->set_frame_number(command.frame);
+    }
+    reply += ", \"frame\": ";
+    append_int(reply, grid->frame_number());
+    reply += ", \"rows\": ";
+    append_int(reply, grid->num_rows());
+    reply += ", \"cols\": ";
+    append_int(reply, grid->num_cols());
+    m_seekers.erase(command.grid);
+    m_grids[command.grid] = std::move(grid);
+}
+
+void GridServer::query(const Command& command, MargolusCA& grid, std::string& reply) {
+    int64_t top = 0;
+    int64_t left = 0;
+    int64_t bottom = grid.num_rows();
+    int64_t right = grid.num_cols();
+    if (!command.region.empty()) {
+        if (command.region.size() != 4) {
+            throw std::invalid_argument("A region is [top, left, bottom, right]");
+        }
+        top = command.region[0];
+        left = command.region[1];
+        bottom = command.region[2];
+        right = command.region[3];
+        if (top < 0 || left < 0 || top > bottom || left > right ||
+                bottom > grid.num_rows() || right > grid.num_cols()) {
+            throw std::out_of_range("Region is outside the grid");
+        }
+    }
+    bool binary = (command.format == "binary");
+    if (!binary && command.format != "json") {
+        throw std::invalid_argument("Unknown format: " + command.format);
+    }
+    uint32_t width = right - left;
+    reply += ", \"frame\": ";
+    append_int(reply, grid.frame_number());
+    reply += ", \"population\": ";
+    append_int(reply, grid.region_population(top, left, bottom, right));
+
+    std::vector<uint64_t> row(grid.num_row_words());
+    if (binary) {
+        size_t row_bytes = (width + 7) / 8;
+        reply += ", \"rows\": ";
+        append_int(reply, bottom - top);
+        reply += ", \"cols\": ";
+        append_int(reply, width);
+        reply += ", \"bytes\": ";
+        append_int(reply, row_bytes * (bottom - top));
+        reply += "}\n";
+        for (int64_t r = top; r < bottom; r++) {
+            grid.get_row_bits(r, row.data());
+            for (uint32_t offset = 0; offset < width; offset += 64) {
+                uint64_t bits = bits_from(row, left + offset);
+                for (uint32_t i = 0; i < 8 && offset + 8 * i < width; i++) {
+                    uint32_t num_cols = std::min<uint32_t>(width - offset - 8 * i, 8);
+                    reply += (char)((bits >> (8 * i)) & ((1U << num_cols) - 1));
+                }
+            }
+        }
+        return;
+    }
+    reply += ", \"cells\": [";
+    bool first = true;
+    for (int64_t r = top; r < bottom; r++) {
+        grid.get_row_bits(r, row.data());
+        for (uint32_t offset = 0; offset < width; offset += 64) {
+            uint64_t bits = bits_from(row, left + offset);
+            if (width - offset < 64) {
+                bits &= (1ULL << (width - offset)) - 1;
+            }
+            for (; bits != 0; bits &= bits - 1) {
+                reply += first ? "[" : ", [";
+                append_int(reply, r);
+                reply += ", ";
+                append_int(reply, left + offset + __builtin_ctzll(bits));
+                reply += ']';
+                first = false;
+            }
+        }
+    }
+    reply += "]}\n";
+}
+
+void GridServer::serve(int input_fd, int output_fd) {
+    std::vector<char> buffer(1 << 16);
+    std::string pending;
+    std::string replies;
+    while (true) {
+        ssize_t n = read(input_fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error(std::string("Error reading commands: ") +
+                std::strerror(errno));
+        }
+        if (n == 0) {
+            return;
+        }
+        pending.append(buffer.data(), n);
+        size_t line_start = 0;
+        size_t newline;
+        while ((newline = pending.find('\n', line_start)) != std::string::npos) {
+            size_t line_end = newline;
+            if (line_end > line_start && pending[line_end - 1] == '\r') {
+                line_end--;
+            }
+            if (line_end > line_start) {
+                handle(pending.substr(line_start, line_end - line_start), replies);
+            }
+            line_start = newline + 1;
+        }
+        pending.erase(0, line_start);
+        if (!replies.empty()) {
+            if (!write_all(output_fd, replies)) {
+                return;
+            }
+            replies.clear();
+        }
+    }
+}
+
+void GridServer::serve_unix_socket(const std::string& address) {
+    if (address.compare(0, 5, "unix:") != 0) {
+        throw std::runtime_error("Server addresses must be unix:PATH: " + address);
+    }
+    std::string path = address.substr(5);
+    sockaddr_un un {};
+    if (path.empty() || path.size() >= sizeof(un.sun_path)) {
+        throw std::runtime_error("Bad Unix socket path: " + address);
+    }
+    un.sun_family = AF_UNIX;
+    std::memcpy(un.sun_path, path.c_str(), path.size() + 1);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        throw std::runtime_error(std::string("Can't create socket: ") + std::strerror(errno));
+    }
+    unlink(path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&un), sizeof(un)) != 0 ||
+            listen(listen_fd, 16) != 0) {
+        std::string error = std::strerror(errno);
+        close(listen_fd);
+        throw std::runtime_error("Can't listen on " + address + ": " + error);
+    }
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::string error = std::strerror(errno);
+            close(listen_fd);
+            unlink(path.c_str());
+            throw std::runtime_error("Error accepting connection: " + error);
+        }
+        try {
+            serve(fd, fd);
+        }
+        catch (std::runtime_error& ex) {
+            // Only this connection failed.
+        }
+        close(fd);
+    }
+}
+
+}  // namespace
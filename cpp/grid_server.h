@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "ca.h"
+#include "keyframe_seeker.h"
+
+namespace Critters {
+
+/**
+ * Keeps named grids in memory and runs commands on them, so that a front end can drive a
+ * simulation interactively without starting a process (and parsing a pattern and allocating a
+ * grid) for every step.
+ *
+ * Each command is one line of JSON, an object with a "cmd" field and usually a "grid" field
+ * naming the grid (by default "default"). An "id" field, if present, must be a string, number,
+ * or null, and is copied into the reply. Each reply is one line of JSON with "ok": true, or
+ * "ok": false and an "error" message. Coordinates are wrapped onto the torus, and regions are
+ * [top, left, bottom, right] with the bottom and right excluded. The commands are:
+ *
+ * - "load": creates or replaces a grid. Either "snapshot" is the path of a snapshot file,
+ *   loading its record for "frame" (by default the last one), or "rows" and "cols" give the size,
+ *   "ca" the rule (as for --ca), "frame" the frame number, and the active cells are in "cells"
+ *   as [row, col] pairs, or in a pattern file at "pattern". Replies with "frame", "rows", and
+ *   "cols".
+ * - "set_cells": sets the [row, col] pairs in "cells" to "active" (by default true).
+ * - "tick": advances "n" frames (by default 1) in the current direction. Replies with "frame".
+ * - "reverse": changes the direction. Replies with "frame" and "reversed".
+ * - "seek": moves to "frame", forwards or backwards, using a `KeyframeSeeker`. Keyframes are
+ *   recorded from the first seek, on later seeks and ticks, until the cells are changed by
+ *   "set_cells" or the direction by "reverse". Replies with "frame".
+ * - "query": replies with "frame" and the "population" of "region" (by default the whole
+ *   grid). With "format": "json" (the default), the active cells in the region are in "cells".
+ *   With "format": "binary", the reply has the region's "rows", "cols", and "bytes", and is
+ *   followed by that many bytes: the region's rows, each padded to a whole number of bytes, with
+ *   a bit per cell starting from the lowest bit of the first byte.
+ * - "snapshot": writes the current frame to a new snapshot file at "path". Replies with "frame".
+ * - "drop": deletes the grid.
+ */
+class GridServer {
+public:
+    /**
+     * Grids use `num_threads` threads to advance, as for `MargolusEngine::set_num_threads`.
+     */
+    explicit GridServer(uint32_t num_threads = 0) : m_num_threads(num_threads) {}
+
+    /**
+     * Runs one command and appends the reply to `reply`. Errors in the command are reported in
+     * the reply rather than thrown.
+     */
+    void handle(const std::string& line, std::string& reply);
+
+    /**
+     * Reads commands from `input_fd` and writes replies to `output_fd` (which can be the same
+     * socket) until the input ends. Replies to commands that arrive together are written
+     * together. Throws std::runtime_error if reading fails.
+     */
+    void serve(int input_fd, int output_fd);
+
+    /**
+     * Listens on `address`, which must be "unix:PATH", and serves one connection at a time,
+     * forever. Grids are kept between connections. Throws std::runtime_error if the socket
+     * can't be created.
+     */
+    void serve_unix_socket(const std::string& address);
+
+private:
+    struct Command;
+
+    uint32_t m_num_threads;
+    std::map<std::string, std::unique_ptr<MargolusCA>> m_grids;
+    // Created by the first seek on a grid, and dropped when its keyframes no longer apply.
+    std::map<std::string, std::unique_ptr<KeyframeSeeker>> m_seekers;
+
+    MargolusCA& find_grid(const std::string& name);
+    void run_command(const Command& command, std::string& reply);
+    void load(const Command& command, std::string& reply);
+    void query(const Command& command, MargolusCA& grid, std::string& reply);
+};
+
+}  // namespace
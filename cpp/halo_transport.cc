@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "halo_transport.h"
+
+namespace Critters {
+
+namespace {
+    std::runtime_error socket_error(const std::string& message) {
+        return std::runtime_error(message + ": " + std::strerror(errno));
+    }
+
+    // A parsed "unix:PATH" or "tcp:HOST:PORT" address, which can be used for one socket.
+    class SocketAddress {
+    public:
+        explicit SocketAddress(const std::string& address) : m_address(address) {
+            if (address.compare(0, 5, "unix:") == 0) {
+                std::string path = address.substr(5);
+                sockaddr_un& un = *reinterpret_cast<sockaddr_un*>(&m_storage);
+                if (path.empty() || path.size() >= sizeof(un.sun_path)) {
+                    throw std::runtime_error("Bad Unix socket path: " + address);
+                }
+                un.sun_family = AF_UNIX;
+                std::memcpy(un.sun_path, path.c_str(), path.size() + 1);
+                m_length = sizeof(sockaddr_un);
+                m_unix_path = path;
+                return;
+            }
+            size_t colon = address.rfind(':');
+            if (address.compare(0, 4, "tcp:") != 0 || colon <= 4) {
+                throw std::runtime_error("Bad address (expected unix:PATH or tcp:HOST:PORT): " +
+                    address);
+            }
+            std::string host = address.substr(4, colon - 4);
+            std::string port = address.substr(colon + 1);
+            addrinfo hints {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* info = nullptr;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0 || !info) {
+                throw std::runtime_error("Can't resolve address " + address);
+            }
+            std::memcpy(&m_storage, info->ai_addr, info->ai_addrlen);
+            m_length = info->ai_addrlen;
+            freeaddrinfo(info);
+        }
+
+        const std::string& address() const {return m_address;}
+        bool is_unix() const {return !m_unix_path.empty();}
+        const std::string& unix_path() const {return m_unix_path;}
+        const sockaddr* sockaddr_ptr() const {
+            return reinterpret_cast<const sockaddr*>(&m_storage);
+        }
+        socklen_t length() const {return m_length;}
+        int family() const {return m_storage.ss_family;}
+
+    private:
+        std::string m_address;
+        std::string m_unix_path;
+        sockaddr_storage m_storage {};
+        socklen_t m_length = 0;
+    };
+
+    void set_no_delay(int fd, const SocketAddress& address) {
+        if (!address.is_unix()) {
+            // Halos are sent all at once, so there's nothing to gain from coalescing writes.
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+
+    void write_fully(int fd, const uint8_t* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw socket_error("Error sending to neighbor");
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    void read_fully(int fd, uint8_t* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = recv(fd, data, size, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                throw std::runtime_error("Neighbor closed its connection");
+            }
+            if (n < 0) {
+                throw socket_error("Error receiving from neighbor");
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    // One direction of an `exchange`, which proceeds as the socket allows.
+    struct Transfer {
+        uint8_t* data;
+        size_t remaining;
+    };
+
+    // Sends or receives as much of `transfer` as possible without blocking.
+    void continue_transfer(int fd, Transfer& transfer, bool sending) {
+        ssize_t n = sending ?
+            send(fd, transfer.data, transfer.remaining, MSG_DONTWAIT | MSG_NOSIGNAL) :
+            recv(fd, transfer.data, transfer.remaining, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            throw socket_error(sending ? "Error sending to neighbor" :
+                "Error receiving from neighbor");
+        }
+        if (n == 0 && !sending) {
+            throw std::runtime_error("Neighbor closed its connection");
+        }
+        transfer.data += n;
+        transfer.remaining -= n;
+    }
+}
+
+void LoopbackTransport::exchange(const uint8_t* to_above, const uint8_t* to_below,
+        uint8_t* from_above, uint8_t* from_below, size_t num_bytes) {
+    // What the rank above sends down is what this rank sends down, and likewise for up.
+    std::memcpy(from_above, to_below, num_bytes);
+    std::memcpy(from_below, to_above, num_bytes);
+}
+
+SocketTransport::SocketTransport(uint32_t rank, const std::vector<std::string>& addresses,
+        double timeout_seconds) {
+    uint32_t num_ranks = addresses.size();
+    if (rank >= num_ranks) {
+        throw std::runtime_error("Rank " + std::to_string(rank) + " has no address");
+    }
+    uint32_t above = (rank + num_ranks - 1) % num_ranks;
+    uint32_t below = (rank + 1) % num_ranks;
+    SocketAddress own_address(addresses[rank]);
+    SocketAddress below_address(addresses[below]);
+
+    // Listen before connecting, so that neighbors that are already waiting can connect.
+    int listen_fd = socket(own_address.family(), SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        throw socket_error("Can't create socket");
+    }
+    if (own_address.is_unix()) {
+        unlink(own_address.unix_path().c_str());
+    }
+    else {
+        int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(listen_fd, own_address.sockaddr_ptr(), own_address.length()) != 0 ||
+            listen(listen_fd, 1) != 0) {
+        std::runtime_error error = socket_error("Can't listen on " + own_address.address());
+        close(listen_fd);
+        throw error;
+    }
+
+    try {
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::duration<double>(timeout_seconds);
+        while (true) {
+            m_below_fd = socket(below_address.family(), SOCK_STREAM, 0);
+            if (m_below_fd < 0) {
+                throw socket_error("Can't create socket");
+            }
+            if (connect(m_below_fd, below_address.sockaddr_ptr(), below_address.length()) == 0) {
+                break;
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                throw socket_error("Can't connect to " + below_address.address());
+            }
+            close(m_below_fd);
+            m_below_fd = -1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        set_no_delay(m_below_fd, below_address);
+        uint8_t rank_bytes[4];
+        for (int i = 0; i < 4; i++) {
+            rank_bytes[i] = (rank >> (8 * i)) & 0xFF;
+        }
+        write_fully(m_below_fd, rank_bytes, 4);
+
+        pollfd pfd {listen_fd, POLLIN, 0};
+        int timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (poll(&pfd, 1, std::max(timeout_ms, 0)) <= 0) {
+            throw std::runtime_error("No connection from rank " + std::to_string(above));
+        }
+        m_above_fd = accept(listen_fd, nullptr, nullptr);
+        if (m_above_fd < 0) {
+            throw socket_error("Can't accept connection");
+        }
+        set_no_delay(m_above_fd, own_address);
+        read_fully(m_above_fd, rank_bytes, 4);
+        uint32_t connected_rank = rank_bytes[0] | (rank_bytes[1] << 8) |
+            (rank_bytes[2] << 16) | ((uint32_t)rank_bytes[3] << 24);
+        if (connected_rank != above) {
+            throw std::runtime_error("Expected a connection from rank " +
+                std::to_string(above) + " but got rank " + std::to_string(connected_rank));
+        }
+    }
+    catch (...) {
+        close(listen_fd);
+        if (own_address.is_unix()) {
+            unlink(own_address.unix_path().c_str());
+        }
+        if (m_below_fd >= 0) {
+            close(m_below_fd);
+        }
+        if (m_above_fd >= 0) {
+            close(m_above_fd);
+        }
+        throw;
+    }
+    // No more connections are expected.
+    close(listen_fd);
+    if (own_address.is_unix()) {
+        unlink(own_address.unix_path().c_str());
+    }
+}
+
+SocketTransport::~SocketTransport() {
+    close(m_above_fd);
+    close(m_below_fd);
+}
+
+// Sends and receives on both sockets at once. Doing them one at a time could deadlock, with
+// every rank blocked sending a halo that's bigger than the socket buffers.
+void SocketTransport::exchange(const uint8_t* to_above, const uint8_t* to_below,
+        uint8_t* from_above, uint8_t* from_below, size_t num_bytes) {
+    // Indexed by [above, below][send, receive].
+    Transfer transfers[2][2] = {
+        {{const_cast<uint8_t*>(to_above), num_bytes}, {from_above, num_bytes}},
+        {{const_cast<uint8_t*>(to_below), num_bytes}, {from_below, num_bytes}},
+    };
+    int fds[2] = {m_above_fd, m_below_fd};
+    while (true) {
+        pollfd pfds[2];
+        bool done = true;
+        for (int i = 0; i < 2; i++) {
+            pfds[i].fd = fds[i];
+            pfds[i].events = (transfers[i][0].remaining > 0 ? POLLOUT : 0) |
+                (transfers[i][1].remaining > 0 ? POLLIN : 0);
+            pfds[i].revents = 0;
+            done = done && (pfds[i].events == 0);
+        }
+        if (done) {
+            return;
+        }
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw socket_error("Error waiting for neighbors");
+        }
+        for (int i = 0; i < 2; i++) {
+            if (pfds[i].revents & (POLLERR | POLLNVAL)) {
+                throw std::runtime_error("Connection to neighbor failed");
+            }
+            if ((pfds[i].revents & POLLOUT) && transfers[i][0].remaining > 0) {
+                continue_transfer(fds[i], transfers[i][0], true);
+            }
+            if ((pfds[i].revents & (POLLIN | POLLHUP)) && transfers[i][1].remaining > 0) {
+                continue_transfer(fds[i], transfers[i][1], false);
+            }
+        }
+    }
+}
+
+std::unique_ptr<HaloTransport> connect_halo_transport(
+        uint32_t rank, const std::vector<std::string>& addresses) {
+    if (addresses.size() == 1) {
+        return std::make_unique<LoopbackTransport>();
+    }
+    return std::make_unique<SocketTransport>(rank, addresses);
+}
+
+}  // namespace
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Critters {
+
+/**
+ * Connections from one rank of a distributed grid (see `DistributedMargolusCA`) to the ranks
+ * that own the bands above and below it. Ranks are arranged in a ring, so the rank above rank 0
+ * is the last one.
+ */
+class HaloTransport {
+public:
+    virtual ~HaloTransport() {}
+
+    /**
+     * Sends `num_bytes` bytes from `to_above` to the rank above and from `to_below` to the rank
+     * below, and receives the bytes that they send the other way into `from_above` and
+     * `from_below`. Every rank has to call this with the same size, and it returns once all
+     * four transfers are done. Throws std::runtime_error if a connection fails.
+     */
+    virtual void exchange(const uint8_t* to_above, const uint8_t* to_below,
+        uint8_t* from_above, uint8_t* from_below, size_t num_bytes) = 0;
+};
+
+/**
+ * Transport for a single rank, which is above and below itself.
+ */
+class LoopbackTransport : public HaloTransport {
+public:
+    void exchange(const uint8_t* to_above, const uint8_t* to_below,
+        uint8_t* from_above, uint8_t* from_below, size_t num_bytes) override;
+};
+
+/**
+ * Transport over stream sockets. Each rank listens on its own address for a connection from the
+ * rank above, and connects to the address of the rank below. An address is either
+ * "unix:PATH", for a Unix domain socket (so that several ranks can run on one host), or
+ * "tcp:HOST:PORT".
+ */
+class SocketTransport : public HaloTransport {
+public:
+    /**
+     * Connects `rank` to its neighbors, given the addresses of all the ranks. Other ranks can be
+     * started in any order; connecting is retried for up to `timeout_seconds`. Throws
+     * std::runtime_error if an address is invalid or the neighbors can't be reached.
+     */
+    SocketTransport(uint32_t rank, const std::vector<std::string>& addresses,
+        double timeout_seconds = 60);
+    ~SocketTransport();
+
+    SocketTransport(const SocketTransport&) = delete;
+    SocketTransport& operator=(const SocketTransport&) = delete;
+
+    void exchange(const uint8_t* to_above, const uint8_t* to_below,
+        uint8_t* from_above, uint8_t* from_below, size_t num_bytes) override;
+
+private:
+    int m_above_fd = -1;
+    int m_below_fd = -1;
+};
+
+/**
+ * Returns a `LoopbackTransport` if there's only one address, and otherwise a `SocketTransport`.
+ */
+std::unique_ptr<HaloTransport> connect_halo_transport(
+    uint32_t rank, const std::vector<std::string>& addresses);
+
+}  // namespace
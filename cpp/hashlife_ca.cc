@@ -0,0 +1,373 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "cell_batcher.h"
+#include "hashlife_ca.h"
+
+namespace Critters {
+
+constexpr size_t HashLifeCA::DEFAULT_MAX_MEMORY_BYTES;
+
+namespace {
+    // Approximate overhead of a hash table entry, in addition to the key and value.
+    const size_t HASH_ENTRY_OVERHEAD_BYTES = 32;
+
+    const uint32_t UNVISITED = std::numeric_limits<uint32_t>::max();
+    // Returned by `advance_node` when it gives up because memory use went over the limit.
+    const uint32_t ABANDONED = std::numeric_limits<uint32_t>::max();
+
+    bool is_power_of_two(uint32_t n) {
+        return n > 0 && (n & (n - 1)) == 0;
+    }
+
+    uint32_t floor_log2(uint64_t n) {
+        return 63 - __builtin_clzll(n);
+    }
+
+    // Populations of nodes made of many copies of the grid can exceed 64 bits.
+    uint64_t saturating_add(uint64_t a, uint64_t b) {
+        return (a > std::numeric_limits<uint64_t>::max() - b) ?
+            std::numeric_limits<uint64_t>::max() : a + b;
+    }
+}
+
+HashLifeCA::HashLifeCA(uint32_t num_rows, uint32_t num_cols,
+        std::shared_ptr<TransitionTable> transition_table, size_t max_memory_bytes) :
+        MargolusEngine(num_rows, num_cols, transition_table) {
+    if (!is_power_of_two(num_rows) || !is_power_of_two(num_cols) || num_rows < 2 || num_cols < 2) {
+        throw std::invalid_argument("HashLifeCA dimensions must be powers of two");
+    }
+    m_root_level = floor_log2(std::max(num_rows, num_cols));
+    m_max_memory_bytes = max_memory_bytes;
+    reset();
+}
+
+size_t HashLifeCA::memory_usage() const {
+    return m_nodes.size() * (sizeof(Node) + sizeof(NodeKey) + sizeof(NodeId) +
+            HASH_ENTRY_OVERHEAD_BYTES) +
+        m_results.size() * (sizeof(uint64_t) + sizeof(NodeId) + HASH_ENTRY_OVERHEAD_BYTES);
+}
+
+void HashLifeCA::reset() {
+    m_reversed = false;
+    m_frame_number = 0;
+    m_nodes.clear();
+    m_node_ids.clear();
+    m_results.clear();
+    m_empty_nodes.clear();
+    m_nodes.push_back(Node {0, 0, 0, 0, 0, 0});
+    m_nodes.push_back(Node {0, 0, 0, 0, 0, 1});
+    m_root = empty_node(m_root_level);
+}
+
+HashLifeCA::NodeId HashLifeCA::make_node(NodeId nw, NodeId ne, NodeId sw, NodeId se) {
+    NodeKey key {nw, ne, sw, se};
+    auto it = m_node_ids.find(key);
+    if (it != m_node_ids.end()) {
+        return it->second;
+    }
+    uint64_t population = saturating_add(
+        saturating_add(m_nodes[nw].population, m_nodes[ne].population),
+        saturating_add(m_nodes[sw].population, m_nodes[se].population));
+    NodeId id = m_nodes.size();
+    m_nodes.push_back(Node {nw, ne, sw, se, m_nodes[nw].level + 1, population});
+    m_node_ids[key] = id;
+    return id;
+}
+
+HashLifeCA::NodeId HashLifeCA::empty_node(uint32_t level) {
+    if (m_empty_nodes.empty()) {
+        m_empty_nodes.push_back(0);
+    }
+    while (m_empty_nodes.size() <= level) {
+        NodeId e = m_empty_nodes.back();
+        m_empty_nodes.push_back(make_node(e, e, e, e));
+    }
+    return m_empty_nodes[level];
+}
+
+// Returns the node one level down covering the center of the given node.
+HashLifeCA::NodeId HashLifeCA::center(NodeId id) {
+    Node n = m_nodes[id];
+    return make_node(
+        m_nodes[n.nw].se, m_nodes[n.ne].sw, m_nodes[n.sw].ne, m_nodes[n.se].nw);
+}
+
+bool HashLifeCA::at(uint32_t row, uint32_t col) const {
+    NodeId id = m_root;
+    for (uint32_t level = m_root_level; level > 0; level--) {
+        const Node& n = m_nodes[id];
+        uint32_t half = 1U << (level - 1);
+        bool bottom = row >= half;
+        bool right = col >= half;
+        id = bottom ? (right ? n.se : n.sw) : (right ? n.ne : n.nw);
+        row -= bottom ? half : 0;
+        col -= right ? half : 0;
+    }
+    return id == 1;
+}
+
+HashLifeCA::NodeId HashLifeCA::set_cell(NodeId id, uint32_t row, uint32_t col, bool active) {
+    Node n = m_nodes[id];
+    if (n.level == 0) {
+        return active ? 1 : 0;
+    }
+    uint32_t half = 1U << (n.level - 1);
+    if (row < half) {
+        if (col < half) {
+            return make_node(set_cell(n.nw, row, col, active), n.ne, n.sw, n.se);
+        }
+        return make_node(n.nw, set_cell(n.ne, row, col - half, active), n.sw, n.se);
+    }
+    if (col < half) {
+        return make_node(n.nw, n.ne, set_cell(n.sw, row - half, col, active), n.se);
+    }
+    return make_node(n.nw, n.ne, n.sw, set_cell(n.se, row - half, col - half, active));
+}
+
+void HashLifeCA::set_cells(const uint32_t* coords, size_t num_cells, bool active) {
+    // The root is square, so a grid that isn't square appears in it more than once.
+    uint32_t size = 1U << m_root_level;
+    for (size_t i = 0; i < num_cells; i++) {
+        for (uint32_t r = coords[2 * i]; r < size; r += num_rows()) {
+            for (uint32_t c = coords[2 * i + 1]; c < size; c += num_cols()) {
+                m_root = set_cell(m_root, r, c, active);
+            }
+        }
+    }
+    if (memory_usage() > m_max_memory_bytes) {
+        collect_garbage();
+    }
+}
+
+// Adds the active cells under a node to `cells`, with the row in the high 32 bits so that
+// sorting puts them in row major order.
+void HashLifeCA::add_active_cells(NodeId id, uint32_t row, uint32_t col,
+        std::vector<uint64_t>& cells) const {
+    const Node& n = m_nodes[id];
+    if (n.population == 0 || row >= num_rows() || col >= num_cols()) {
+        return;
+    }
+    if (n.level == 0) {
+        cells.push_back(((uint64_t)row << 32) | col);
+        return;
+    }
+    uint32_t half = 1U << (n.level - 1);
+    add_active_cells(n.nw, row, col, cells);
+    add_active_cells(n.ne, row, col + half, cells);
+    add_active_cells(n.sw, row + half, col, cells);
+    add_active_cells(n.se, row + half, col + half, cells);
+}
+
+void HashLifeCA::visit_active_cells(const CellVisitor& visit) const {
+    std::vector<uint64_t> cells;
+    add_active_cells(m_root, 0, 0, cells);
+    std::sort(cells.begin(), cells.end());
+    CellBatcher<uint32_t> batcher(visit);
+    for (uint64_t cell : cells) {
+        batcher.add(cell >> 32, (uint32_t)cell);
+    }
+    batcher.flush();
+}
+
+// Advances a 4x4 node by one frame, returning the center 2x2 node. `odd_origin` is true if the
+// node's top left cell is at an odd row and column.
+HashLifeCA::NodeId HashLifeCA::advance_level2(
+        NodeId id, bool odd_origin, bool use_even_grid, bool is_forward) {
+    const Node& n = m_nodes[id];
+    uint32_t cells[4][4];
+    NodeId quadrants[2][2] = {{n.nw, n.ne}, {n.sw, n.se}};
+    for (uint32_t qr = 0; qr < 2; qr++) {
+        for (uint32_t qc = 0; qc < 2; qc++) {
+            const Node& q = m_nodes[quadrants[qr][qc]];
+            cells[2 * qr][2 * qc] = q.nw;
+            cells[2 * qr][2 * qc + 1] = q.ne;
+            cells[2 * qr + 1][2 * qc] = q.sw;
+            cells[2 * qr + 1][2 * qc + 1] = q.se;
+        }
+    }
+    auto block_state = [&cells](uint32_t r, uint32_t c) {
+        return (cells[r][c] << 3) | (cells[r][c + 1] << 2) |
+            (cells[r + 1][c] << 1) | cells[r + 1][c + 1];
+    };
+    const StateArray& states = transition_table().states(use_even_grid, is_forward);
+    NodeId tl, tr, bl, br;
+    if (use_even_grid != odd_origin) {
+        // Each center cell is the inner corner of one of the four blocks.
+        tl = states[block_state(0, 0)] & 1;
+        tr = (states[block_state(0, 2)] >> 1) & 1;
+        bl = (states[block_state(2, 0)] >> 2) & 1;
+        br = (states[block_state(2, 2)] >> 3) & 1;
+    }
+    else {
+        // The center is a single block.
+        uint32_t s = states[block_state(1, 1)];
+        tl = (s >> 3) & 1;
+        tr = (s >> 2) & 1;
+        bl = (s >> 1) & 1;
+        br = s & 1;
+    }
+    return make_node(tl, tr, bl, br);
+}
+
+// Returns the center of the given node advanced 2^log_frames frames, where log_frames is at
+// most the node's level minus 2. `use_even_grid` applies to the first frame. `odd_origin` can
+// only be true for level 2 nodes; see below.
+HashLifeCA::NodeId HashLifeCA::advance_node(NodeId id, uint32_t log_frames,
+        bool use_even_grid, bool is_forward, bool odd_origin) {
+    uint64_t key = ((uint64_t)id << 9) | (odd_origin << 8) | (log_frames << 2) |
+        (use_even_grid << 1) | is_forward;
+    auto it = m_results.find(key);
+    if (it != m_results.end()) {
+        return it->second;
+    }
+    if (m_abandon_over_limit && memory_usage() > m_max_memory_bytes) {
+        return ABANDONED;
+    }
+    Node n = m_nodes[id];
+    NodeId result;
+    if (n.level == 2) {
+        result = advance_level2(id, odd_origin, use_even_grid, is_forward);
+    }
+    else {
+        Node nw = m_nodes[n.nw];
+        Node ne = m_nodes[n.ne];
+        Node sw = m_nodes[n.sw];
+        Node se = m_nodes[n.se];
+        // Nine overlapping nodes one level down, at offsets of a quarter of this node's size.
+        NodeId sub[3][3] = {
+            {n.nw, make_node(nw.ne, ne.nw, nw.se, ne.sw), n.ne},
+            {make_node(nw.sw, nw.se, sw.nw, sw.ne), make_node(nw.se, ne.sw, sw.ne, se.nw),
+                make_node(ne.sw, ne.se, se.nw, se.ne)},
+            {n.sw, make_node(sw.ne, se.nw, sw.se, se.sw), n.se},
+        };
+        uint32_t second_log_frames = log_frames;
+        bool second_use_even_grid = use_even_grid;
+        if (log_frames == n.level - 2) {
+            // Full speed: advance half of the frames here and half in the second step.
+            for (auto& row : sub) {
+                for (NodeId& s : row) {
+                    s = advance_node(s, log_frames - 1, use_even_grid, is_forward);
+                    if (s == ABANDONED) {
+                        return ABANDONED;
+                    }
+                }
+            }
+            second_log_frames = log_frames - 1;
+            // The phase only changes if the first step was a single frame.
+            second_use_even_grid = (log_frames == 1) ? !use_even_grid : use_even_grid;
+        }
+        else {
+            for (auto& row : sub) {
+                for (NodeId& s : row) {
+                    s = center(s);
+                }
+            }
+        }
+        NodeId quadrants[4] = {
+            make_node(sub[0][0], sub[0][1], sub[1][0], sub[1][1]),
+            make_node(sub[0][1], sub[0][2], sub[1][1], sub[1][2]),
+            make_node(sub[1][0], sub[1][1], sub[2][0], sub[2][1]),
+            make_node(sub[1][1], sub[1][2], sub[2][1], sub[2][2]),
+        };
+        // The second step's nodes are offset by a quarter of this node's size from it, which
+        // is odd when this is a level 3 node.
+        for (NodeId& q : quadrants) {
+            q = advance_node(
+                q, second_log_frames, second_use_even_grid, is_forward, n.level == 3);
+            if (q == ABANDONED) {
+                return ABANDONED;
+            }
+        }
+        result = make_node(quadrants[0], quadrants[1], quadrants[2], quadrants[3]);
+    }
+    m_results[key] = result;
+    return result;
+}
+
+void HashLifeCA::tick() {
+    advance(1);
+}
+
+// Advances by the largest power of two that fits in the remaining frames at a time. A node made
+// of copies of the root covers the torus repeated in both directions, so its result is also a
+// copy of the torus, offset by a quarter of the node's size.
+//
+// A single step can create far more nodes than the memory limit allows, so steps of more than
+// one frame are abandoned when memory use goes over it, and retried as smaller steps after
+// collecting garbage. Steps grow again once they fit comfortably.
+void HashLifeCA::advance(uint64_t num_frames) {
+    while (num_frames > 0) {
+        uint32_t log_frames = std::min(floor_log2(num_frames), m_max_log_frames);
+        uint32_t level = std::max(m_root_level + 1, log_frames + 2);
+        NodeId node = m_root;
+        for (uint32_t l = m_root_level; l < level; l++) {
+            node = make_node(node, node, node, node);
+        }
+        m_abandon_over_limit = log_frames > 0;
+        NodeId result = advance_node(node, log_frames, use_even_grid(), !is_reversed());
+        m_abandon_over_limit = false;
+        if (result == ABANDONED) {
+            collect_garbage();
+            m_max_log_frames = log_frames - 1;
+            continue;
+        }
+        if (level == m_root_level + 1) {
+            // The result is offset by half of the torus in each direction.
+            Node r = m_nodes[result];
+            m_root = make_node(r.se, r.sw, r.ne, r.nw);
+        }
+        else {
+            // The offset is a multiple of the torus size.
+            for (uint32_t l = level - 1; l > m_root_level; l--) {
+                result = m_nodes[result].nw;
+            }
+            m_root = result;
+        }
+        int64_t frames = 1LL << log_frames;
+        m_frame_number += is_reversed() ? -frames : frames;
+        num_frames -= frames;
+        if (memory_usage() > m_max_memory_bytes) {
+            collect_garbage();
+        }
+        else if (memory_usage() < m_max_memory_bytes / 2 && log_frames == m_max_log_frames) {
+            m_max_log_frames++;
+        }
+    }
+}
+
+HashLifeCA::NodeId HashLifeCA::copy_reachable(
+        NodeId id, std::vector<Node>& nodes, std::vector<NodeId>& new_ids) const {
+    if (new_ids[id] != UNVISITED) {
+        return new_ids[id];
+    }
+    Node n = m_nodes[id];
+    n.nw = copy_reachable(n.nw, nodes, new_ids);
+    n.ne = copy_reachable(n.ne, nodes, new_ids);
+    n.sw = copy_reachable(n.sw, nodes, new_ids);
+    n.se = copy_reachable(n.se, nodes, new_ids);
+    new_ids[id] = nodes.size();
+    nodes.push_back(n);
+    return new_ids[id];
+}
+
+// Keeps only the nodes in the current grid, and forgets all memoized results.
+void HashLifeCA::collect_garbage() {
+    std::vector<Node> nodes = {m_nodes[0], m_nodes[1]};
+    std::vector<NodeId> new_ids(m_nodes.size(), UNVISITED);
+    new_ids[0] = 0;
+    new_ids[1] = 1;
+    m_root = copy_reachable(m_root, nodes, new_ids);
+    m_nodes.swap(nodes);
+    m_node_ids.clear();
+    m_node_ids.reserve(m_nodes.size());
+    for (NodeId id = 2; id < m_nodes.size(); id++) {
+        const Node& n = m_nodes[id];
+        m_node_ids[NodeKey {n.nw, n.ne, n.sw, n.se}] = id;
+    }
+    m_results.clear();
+    m_empty_nodes.clear();
+}
+
+}  // namespace
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "ca.h"
+
+namespace Critters {
+
+/**
+ * An engine that stores the grid as a quadtree of hash-consed nodes, so that identical regions
+ * share a single node, and memoizes the future of each node (HashLife). Once the patterns in a
+ * grid have been seen, advancing takes time roughly logarithmic in the number of frames, so
+ * periodic patterns like guns and billiard ball circuits can be run for billions of frames.
+ *
+ * A node at level k covers a square of 2^k by 2^k cells. Its result for 2^j frames (with
+ * j <= k-2) is the center 2^(k-1) square after that many frames, which only depends on the
+ * node itself and on how the blocks line up with it. Results are memoized per step size, phase
+ * (which of the even and odd tables is used first), and direction. Nodes above level 2 are
+ * always at even positions, so the phase also determines the block alignment.
+ *
+ * Both dimensions must be powers of two. The torus is represented by a square of the larger
+ * dimension, which repeats the grid if it isn't square; a square torus of side 2^n advances by
+ * computing the result of a node made of copies of itself.
+ */
+class HashLifeCA : public MargolusEngine {
+public:
+    /**
+     * `max_memory_bytes` is a soft limit on the memory used by nodes and memoized results.
+     * When it's exceeded, all nodes that aren't part of the current grid are discarded, along
+     * with all memoized results, and `advance` retries the step it was taking in smaller steps.
+     * The limit can still be exceeded by the current grid plus what it takes to advance it by
+     * a single frame, which for a grid full of distinct patterns is several times the grid.
+     */
+    HashLifeCA(uint32_t num_rows, uint32_t num_cols,
+        std::shared_ptr<TransitionTable> transition_table,
+        size_t max_memory_bytes = DEFAULT_MAX_MEMORY_BYTES);
+
+    bool at(uint32_t row, uint32_t col) const override;
+
+    using MargolusEngine::set_cells;
+    void set_cells(const uint32_t* coords, size_t num_cells, bool active = true) override;
+    void visit_active_cells(const CellVisitor& visit) const override;
+
+    void reset() override;
+
+    void tick() override;
+
+    void advance(uint64_t num_frames) override;
+
+    size_t num_nodes() const {return m_nodes.size();}
+    size_t num_memoized_results() const {return m_results.size();}
+    /**
+     * Estimated memory used by nodes and memoized results.
+     */
+    size_t memory_usage() const;
+
+    void collect_garbage();
+
+    static constexpr size_t DEFAULT_MAX_MEMORY_BYTES = 1ULL << 30;
+
+private:
+    using NodeId = uint32_t;
+
+    // Level 0 nodes are single cells, with ids 0 (inactive) and 1 (active).
+    struct Node {
+        NodeId nw;
+        NodeId ne;
+        NodeId sw;
+        NodeId se;
+        uint32_t level;
+        uint64_t population;
+    };
+
+    struct NodeKey {
+        NodeId nw;
+        NodeId ne;
+        NodeId sw;
+        NodeId se;
+        bool operator==(const NodeKey& other) const {
+            return nw == other.nw && ne == other.ne && sw == other.sw && se == other.se;
+        }
+    };
+
+    struct NodeKeyHash {
+        size_t operator()(const NodeKey& k) const {
+            uint64_t h = k.nw;
+            h = h * 0x9E3779B97F4A7C15ULL + k.ne;
+            h = h * 0x9E3779B97F4A7C15ULL + k.sw;
+            h = h * 0x9E3779B97F4A7C15ULL + k.se;
+            return h ^ (h >> 29);
+        }
+    };
+
+    uint32_t m_root_level;
+    NodeId m_root;
+    size_t m_max_memory_bytes;
+    std::vector<Node> m_nodes;
+    std::unordered_map<NodeKey, NodeId, NodeKeyHash> m_node_ids;
+    // Keyed by node id, whether a level 2 node is at an odd position, log2 of the number of
+    // frames, phase, and direction.
+    std::unordered_map<uint64_t, NodeId> m_results;
+    // Empty node for each level, built as needed.
+    std::vector<NodeId> m_empty_nodes;
+    // Log2 of the largest step `advance` takes, which shrinks when steps use too much memory.
+    uint32_t m_max_log_frames = 63;
+    // Whether `advance_node` gives up when memory use goes over the limit.
+    bool m_abandon_over_limit = false;
+
+    NodeId make_node(NodeId nw, NodeId ne, NodeId sw, NodeId se);
+    NodeId empty_node(uint32_t level);
+    NodeId center(NodeId id);
+    NodeId set_cell(NodeId id, uint32_t row, uint32_t col, bool active);
+    NodeId advance_level2(NodeId id, bool odd_origin, bool use_even_grid, bool is_forward);
+    NodeId advance_node(NodeId id, uint32_t log_frames, bool use_even_grid, bool is_forward,
+        bool odd_origin = false);
+    void add_active_cells(NodeId id, uint32_t row, uint32_t col,
+        std::vector<uint64_t>& cells) const;
+    NodeId copy_reachable(NodeId id, std::vector<Node>& nodes, std::vector<NodeId>& new_ids) const;
+};
+
+}  // namespace
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+
+#include "keyframe_seeker.h"
+#include "snapshot.h"
+
+namespace Critters {
+
+namespace {
+    uint64_t frame_distance(int64_t a, int64_t b) {
+        return (a > b) ? (uint64_t)a - b : (uint64_t)b - a;
+    }
+}
+
+int64_t next_multiple_towards(int64_t frame, int64_t target, uint64_t step) {
+    if (step == 0) {
+        return target;
+    }
+    int64_t s = step;
+    // Round towards negative infinity, which C++ division doesn't do for negative numbers.
+    int64_t floor_multiple = s * (frame / s - ((frame % s < 0) ? 1 : 0));
+    if (target > frame) {
+        return std::min(floor_multiple + s, target);
+    }
+    int64_t previous = (floor_multiple == frame) ? frame - s : floor_multiple;
+    return std::max(previous, target);
+}
+
+KeyframeSeeker::KeyframeSeeker(MargolusEngine& grid, uint64_t spacing, size_t max_memory_bytes) :
+        m_grid(grid),
+        m_first_frame(grid.frame_number()),
+        m_reversed(grid.is_reversed()),
+        m_spacing(std::max<uint64_t>(spacing, 1)),
+        m_max_memory_bytes(max_memory_bytes) {
+    record();
+}
+
+bool KeyframeSeeker::is_keyframe(int64_t frame) const {
+    return (frame - m_first_frame) % (int64_t)m_spacing == 0;
+}
+
+void KeyframeSeeker::record() {
+    uint8_t encoding = encode_snapshot_body(
+        m_grid, 0, m_grid.num_rows(), m_runs_body, m_raw_body);
+    const std::vector<uint8_t>& body = (encoding == SNAPSHOT_RUNS) ? m_runs_body : m_raw_body;
+    // Copied rather than moved, so that the scratch buffers keep their memory.
+    m_keyframes[m_grid.frame_number()] = Keyframe {encoding, body};
+    m_memory_bytes += body.size();
+    // Thin out the keyframes until they fit. The first frame is a keyframe at any spacing, so
+    // it's never removed.
+    while (m_memory_bytes > m_max_memory_bytes && m_keyframes.size() > 1) {
+        m_spacing *= 2;
+        for (auto it = m_keyframes.begin(); it != m_keyframes.end();) {
+            if (is_keyframe(it->first)) {
+                ++it;
+            }
+            else {
+                m_memory_bytes -= it->second.body.size();
+                it = m_keyframes.erase(it);
+            }
+        }
+    }
+}
+
+void KeyframeSeeker::run_to(int64_t frame) {
+    m_grid.set_reversed(frame < m_grid.frame_number());
+    while (m_grid.frame_number() != frame) {
+        // Tick to the next keyframe position in this direction, or to `frame` if that's closer.
+        int64_t next = m_first_frame + next_multiple_towards(
+            m_grid.frame_number() - m_first_frame, frame - m_first_frame, m_spacing);
+        m_grid.advance(std::abs(next - m_grid.frame_number()));
+        if (is_keyframe(next) && m_keyframes.count(next) == 0) {
+            record();
+        }
+    }
+    m_grid.set_reversed(m_reversed);
+}
+
+void KeyframeSeeker::advance(uint64_t num_frames) {
+    run_to(m_grid.frame_number() + (m_reversed ? -(int64_t)num_frames : (int64_t)num_frames));
+}
+
+int64_t KeyframeSeeker::nearest_keyframe(int64_t frame) const {
+    auto after = m_keyframes.lower_bound(frame);
+    if (after == m_keyframes.end()) {
+        return std::prev(after)->first;
+    }
+    if (after == m_keyframes.begin()) {
+        return after->first;
+    }
+    int64_t before = std::prev(after)->first;
+    return (frame_distance(before, frame) <= frame_distance(after->first, frame)) ?
+        before : after->first;
+}
+
+void KeyframeSeeker::seek(int64_t frame) {
+    int64_t keyframe = nearest_keyframe(frame);
+    if (frame_distance(keyframe, frame) < frame_distance(m_grid.frame_number(), frame)) {
+        const Keyframe& k = m_keyframes.at(keyframe);
+        decode_snapshot_body(k.body.data(), k.body.size(), k.encoding, m_grid);
+        m_grid.set_frame_number(keyframe);
+    }
+    run_to(frame);
+}
+
+}  // namespace
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "ca.h"
+
+namespace Critters {
+
+/**
+ * Returns the next frame after `frame`, moving towards `target`, that is either `target` or a
+ * multiple of `step` (if nonzero).
+ */
+int64_t next_multiple_towards(int64_t frame, int64_t target, uint64_t step);
+
+/**
+ * Moves a grid to any frame, forwards or backwards, without ticking through every frame from
+ * the start. Since the rules are reversible, a frame can be reached from either side, so as
+ * the grid runs, keyframes are stored in memory (compressed as in snapshot files), and `seek`
+ * restores whichever keyframe is closest to the target and ticks from there.
+ *
+ * Keyframes are the frames that differ from the starting frame by a multiple of the spacing.
+ * If they take more than the memory budget, the spacing is doubled and every other keyframe is
+ * dropped, so long runs end up with fewer, more widely spaced keyframes rather than using more
+ * memory. The starting frame is always kept.
+ */
+class KeyframeSeeker {
+public:
+    static const uint64_t DEFAULT_SPACING = 64;
+    static const size_t DEFAULT_MAX_MEMORY_BYTES = 256 << 20;
+
+    /**
+     * Records the current frame of `grid` as the first keyframe. The grid must outlive the
+     * seeker, and should only be changed through it.
+     */
+    explicit KeyframeSeeker(MargolusEngine& grid, uint64_t spacing = DEFAULT_SPACING,
+        size_t max_memory_bytes = DEFAULT_MAX_MEMORY_BYTES);
+
+    /**
+     * Advances the grid by `num_frames` in its direction when the seeker was created, recording
+     * keyframes along the way.
+     */
+    void advance(uint64_t num_frames);
+
+    /**
+     * Moves the grid to `frame`, from the keyframe or the current frame that needs the fewest
+     * ticks. Keyframes are recorded for frames passed that don't have them yet.
+     */
+    void seek(int64_t frame);
+
+    uint64_t spacing() const {return m_spacing;}
+    size_t num_keyframes() const {return m_keyframes.size();}
+    size_t memory_bytes() const {return m_memory_bytes;}
+
+    /**
+     * Returns the frame of the keyframe closest to `frame`.
+     */
+    int64_t nearest_keyframe(int64_t frame) const;
+
+private:
+    struct Keyframe {
+        uint8_t encoding;
+        std::vector<uint8_t> body;
+    };
+
+    MargolusEngine& m_grid;
+    int64_t m_first_frame;
+    bool m_reversed;
+    uint64_t m_spacing;
+    size_t m_max_memory_bytes;
+    size_t m_memory_bytes = 0;
+    std::map<int64_t, Keyframe> m_keyframes;
+    std::vector<uint8_t> m_runs_body;
+    std::vector<uint8_t> m_raw_body;
+
+    bool is_keyframe(int64_t frame) const;
+    void record();
+    // Ticks the grid to `frame`, recording keyframes that are missing.
+    void run_to(int64_t frame);
+};
+
+}  // namespace
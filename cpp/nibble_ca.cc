@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "nibble_ca.h"
+
+namespace Critters {
+
+namespace {
+    // Each of these selects one cell of every block in a word: bottom right, bottom left,
+    // top right, and top left.
+    const uint64_t BR_BITS = 0x1111111111111111ULL;
+    const uint64_t BL_BITS = 0x2222222222222222ULL;
+    const uint64_t TR_BITS = 0x4444444444444444ULL;
+    const uint64_t TL_BITS = 0x8888888888888888ULL;
+
+    inline uint64_t map_word(uint64_t blocks, const std::array<uint8_t, 256>& byte_map) {
+        uint64_t result = 0;
+        for (uint32_t i = 0; i < 64; i += 8) {
+            result |= (uint64_t)byte_map[(blocks >> i) & 0xFF] << i;
+        }
+        return result;
+    }
+
+    // Takes the top or bottom cells of the 16 blocks in `blocks` (selected by `shift`, 2 for
+    // top and 0 for bottom) as a row of 32 cells.
+    inline uint64_t row_cells_from_blocks(uint64_t blocks, uint32_t shift) {
+        uint64_t x = (blocks >> shift) & 0x3333333333333333ULL;
+        // The left cell is the higher bit of each pair, and needs to be the lower one.
+        x = ((x >> 1) & BR_BITS) | ((x & BR_BITS) << 1);
+        x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+        x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+        x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+        return (x | (x >> 16)) & 0xFFFFFFFFULL;
+    }
+
+    // Inverse of `row_cells_from_blocks`: spreads 32 cells into the top or bottom cells of 16
+    // blocks, with the other cells zero.
+    inline uint64_t blocks_from_row_cells(uint64_t cells, uint32_t shift) {
+        uint64_t x = cells & 0xFFFFFFFFULL;
+        x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+        x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+        x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        x = (x | (x << 2)) & 0x3333333333333333ULL;
+        x = ((x & BR_BITS) << 1) | ((x >> 1) & BR_BITS);
+        return x << shift;
+    }
+}
+
+NibbleMargolusCA::NibbleMargolusCA(
+        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transition_table) :
+        MargolusEngine(num_rows, num_cols, transition_table) {
+    m_words_per_block_row = (num_block_cols() + 15) / 16;
+    uint32_t last_blocks = num_block_cols() % 16;
+    m_last_word_mask = (last_blocks == 0) ? ~0ULL : ((1ULL << (4 * last_blocks)) - 1);
+    m_blocks.resize((size_t)num_block_rows() * m_words_per_block_row, 0);
+    for (int even = 0; even < 2; even++) {
+        for (int forward = 0; forward < 2; forward++) {
+            const StateArray& states = transition_table->states(even, forward);
+            for (uint32_t b = 0; b < 256; b++) {
+                m_byte_maps[even][forward][b] = states[b & 0xF] | (states[b >> 4] << 4);
+            }
+        }
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        m_identity[b] = b;
+    }
+}
+
+void NibbleMargolusCA::locate_cell(
+        uint32_t row, uint32_t col, size_t& word, uint32_t& bit) const {
+    uint32_t offset = m_even_blocks ? 0 : 1;
+    // Odd blocks start at row and column 1, so the cells in row and column 0 are in the last
+    // row and column of blocks.
+    uint32_t r = (row >= offset) ? row - offset : num_rows() - 1;
+    uint32_t c = (col >= offset) ? col - offset : num_cols() - 1;
+    uint32_t block_col = c / 2;
+    word = (size_t)(r / 2) * m_words_per_block_row + block_col / 16;
+    bit = 4 * (block_col % 16) + 3 - (2 * (r % 2) + c % 2);
+}
+
+bool NibbleMargolusCA::at(uint32_t row, uint32_t col) const {
+    size_t word;
+    uint32_t bit;
+    locate_cell(row, col, word, bit);
+    return (m_blocks[word] >> bit) & 1;
+}
+
+void NibbleMargolusCA::set_cells(const uint32_t* coords, size_t num_cells, bool active) {
+    for (size_t i = 0; i < num_cells; i++) {
+        size_t word;
+        uint32_t bit;
+        locate_cell(coords[2 * i], coords[2 * i + 1], word, bit);
+        m_blocks[word] = active ? (m_blocks[word] | (1ULL << bit)) :
+            (m_blocks[word] & ~(1ULL << bit));
+    }
+}
+
+void NibbleMargolusCA::get_row_bits(uint32_t row, uint64_t* words) const {
+    uint32_t offset = m_even_blocks ? 0 : 1;
+    uint32_t r = (row >= offset) ? row - offset : num_rows() - 1;
+    const uint64_t* blocks = block_row(r / 2);
+    uint32_t shift = (r % 2 == 0) ? 2 : 0;
+    uint32_t nwords = num_row_words();
+    // Bit `c` of `words` is first the cell at column `c + offset`, wrapping around, and then
+    // it's shifted into place.
+    std::fill(words, words + nwords, 0);
+    for (uint32_t w = 0; w < m_words_per_block_row; w++) {
+        words[w / 2] |= row_cells_from_blocks(blocks[w], shift) << (32 * (w % 2));
+    }
+    if (offset == 0) {
+        return;
+    }
+    uint32_t last = num_cols() - 1;
+    uint64_t wrapped = (words[last / 64] >> (last % 64)) & 1;
+    for (uint32_t i = nwords - 1; i > 0; i--) {
+        words[i] = (words[i] << 1) | (words[i - 1] >> 63);
+    }
+    words[0] = (words[0] << 1) | wrapped;
+    if (num_cols() % 64 != 0) {
+        words[nwords - 1] &= (1ULL << (num_cols() % 64)) - 1;
+    }
+}
+
+void NibbleMargolusCA::set_row_bits(uint32_t row, const uint64_t* words) {
+    uint32_t offset = m_even_blocks ? 0 : 1;
+    uint32_t r = (row >= offset) ? row - offset : num_rows() - 1;
+    uint64_t* blocks = block_row(r / 2);
+    uint32_t shift = (r % 2 == 0) ? 2 : 0;
+    uint32_t nwords = num_row_words();
+    uint32_t last = num_cols() - 1;
+    uint64_t last_word_mask = (num_cols() % 64 != 0) ? (1ULL << (num_cols() % 64)) - 1 : ~0ULL;
+    auto masked = [words, nwords, last_word_mask](uint32_t i) -> uint64_t {
+        return (i + 1 < nwords) ? words[i] : words[i] & last_word_mask;
+    };
+    // Bit `c` of `aligned(i)` is the cell at column `64 * i + c + offset`, wrapping around.
+    auto aligned = [&masked, words, nwords, offset, last](uint32_t i) -> uint64_t {
+        if (offset == 0) {
+            return masked(i);
+        }
+        uint64_t bits = masked(i) >> 1;
+        if (i + 1 < nwords) {
+            bits |= masked(i + 1) << 63;
+        }
+        if (i == last / 64) {
+            bits |= (words[0] & 1) << (last % 64);
+        }
+        return bits;
+    };
+    uint64_t mask = 0x3333333333333333ULL << shift;
+    for (uint32_t w = 0; w < m_words_per_block_row; w++) {
+        uint64_t cells = aligned(w / 2) >> (32 * (w % 2));
+        blocks[w] = (blocks[w] & ~mask) | blocks_from_row_cells(cells, shift);
+    }
+}
+
+void NibbleMargolusCA::reset() {
+    m_reversed = false;
+    m_frame_number = 0;
+    m_even_blocks = true;
+    std::fill(m_blocks.begin(), m_blocks.end(), 0);
+}
+
+// Updates rows of blocks from `start_row` up to `end_row` in place. Each new row of blocks
+// depends on two old ones: going to odd blocks, the row and the one below it, and going to even
+// blocks, the row and the one above it. Rows are updated in the order that reads each old row
+// before it's overwritten, except for the one past the end, which the neighboring range may have
+// already updated, so it's read from `boundary_row`. `mapped_rows` has room for two rows.
+void NibbleMargolusCA::update_block_rows(const std::array<uint8_t, 256>& byte_map,
+        uint32_t start_row, uint32_t end_row, const uint64_t* boundary_row,
+        uint64_t* mapped_rows) {
+    uint32_t nwords = m_words_per_block_row;
+    uint32_t last_shift = 4 * ((num_block_cols() - 1) % 16);
+    auto map_row = [&](const uint64_t* src, uint64_t* dst) {
+        for (uint32_t w = 0; w < nwords; w++) {
+            dst[w] = map_word(src[w], byte_map);
+        }
+        // Blocks past the right edge are empty, but an empty block isn't always mapped to one.
+        dst[nwords - 1] &= m_last_word_mask;
+    };
+
+    if (m_even_blocks) {
+        // Odd block (i, j) has the bottom right cell of even block (i, j), the bottom left of
+        // (i, j + 1), the top right of (i + 1, j), and the top left of (i + 1, j + 1).
+        uint64_t* top = mapped_rows;
+        uint64_t* bottom = mapped_rows + nwords;
+        map_row(block_row(start_row), top);
+        for (uint32_t i = start_row; i < end_row; i++) {
+            map_row((i + 1 < end_row) ? block_row(i + 1) : boundary_row, bottom);
+            uint64_t* out = block_row(i);
+            for (uint32_t w = 0; w < nwords; w++) {
+                // The blocks one to the right, wrapping around from the last block to the first.
+                uint64_t top_next;
+                uint64_t bottom_next;
+                if (w + 1 < nwords) {
+                    top_next = (top[w] >> 4) | (top[w + 1] << 60);
+                    bottom_next = (bottom[w] >> 4) | (bottom[w + 1] << 60);
+                }
+                else {
+                    top_next = (top[w] >> 4) | ((top[0] & 0xF) << last_shift);
+                    bottom_next = (bottom[w] >> 4) | ((bottom[0] & 0xF) << last_shift);
+                }
+                out[w] = ((top[w] & BR_BITS) << 3) | ((top_next & BL_BITS) << 1) |
+                    ((bottom[w] & TR_BITS) >> 1) | ((bottom_next & TL_BITS) >> 3);
+            }
+            std::swap(top, bottom);
+        }
+    }
+    else {
+        // Even block (i, j) has the bottom right cell of odd block (i - 1, j - 1), the bottom
+        // left of (i - 1, j), the top right of (i, j - 1), and the top left of (i, j).
+        uint64_t* top = mapped_rows;
+        uint64_t* bottom = mapped_rows + nwords;
+        map_row(block_row(end_row - 1), bottom);
+        for (uint32_t i = end_row; i-- > start_row;) {
+            map_row((i > start_row) ? block_row(i - 1) : boundary_row, top);
+            uint64_t* out = block_row(i);
+            for (uint32_t w = 0; w < nwords; w++) {
+                // The blocks one to the left, wrapping around from the first block to the last.
+                uint64_t top_previous;
+                uint64_t bottom_previous;
+                if (w > 0) {
+                    top_previous = (top[w] << 4) | (top[w - 1] >> 60);
+                    bottom_previous = (bottom[w] << 4) | (bottom[w - 1] >> 60);
+                }
+                else {
+                    top_previous = (top[0] << 4) | ((top[nwords - 1] >> last_shift) & 0xF);
+                    bottom_previous =
+                        (bottom[0] << 4) | ((bottom[nwords - 1] >> last_shift) & 0xF);
+                }
+                out[w] = ((top_previous & BR_BITS) << 3) | ((top[w] & BL_BITS) << 1) |
+                    ((bottom_previous & TR_BITS) >> 1) | ((bottom[w] & TL_BITS) >> 3);
+            }
+            out[nwords - 1] &= m_last_word_mask;
+            std::swap(top, bottom);
+        }
+    }
+}
+
+// Decides whether to split the next pass across the worker pool, starting it if needed.
+bool NibbleMargolusCA::should_use_pool() {
+    uint32_t nthreads = num_threads();
+    if (nthreads <= 1) {
+        return false;
+    }
+    if (!m_pool || m_pool->num_threads() != nthreads) {
+        m_pool = std::make_unique<WorkerPool>(nthreads);
+    }
+    return m_pool_crossover.should_use_pool(*m_pool);
+}
+
+// Splits the rows of blocks into one band per thread, which are updated independently.
+void NibbleMargolusCA::update_blocks(const std::array<uint8_t, 256>& byte_map) {
+    uint32_t nrows = num_block_rows();
+    uint32_t nwords = m_words_per_block_row;
+    bool parallel = should_use_pool();
+    uint32_t nbands = parallel ? std::min(m_pool->num_threads(), nrows) : 1;
+    m_boundary_rows.resize((size_t)nbands * nwords);
+    m_mapped_rows.resize((size_t)nbands * 2 * nwords);
+    // The old row past the end of each band, copied before any band is updated.
+    for (uint32_t i = 0; i < nbands; i++) {
+        uint32_t start_row = i * nrows / nbands;
+        uint32_t end_row = (i + 1) * nrows / nbands;
+        uint32_t boundary = m_even_blocks ? end_row % nrows : (start_row + nrows - 1) % nrows;
+        std::copy(block_row(boundary), block_row(boundary) + nwords,
+            &m_boundary_rows[(size_t)i * nwords]);
+    }
+    auto update_band = [this, &byte_map, nrows, nwords, nbands](uint32_t i, uint32_t) {
+        update_block_rows(byte_map, i * nrows / nbands, (i + 1) * nrows / nbands,
+            &m_boundary_rows[(size_t)i * nwords], &m_mapped_rows[(size_t)i * 2 * nwords]);
+    };
+    if (parallel) {
+        m_pool->run(nbands, update_band);
+    }
+    else if (num_threads() > 1 && m_pool_crossover.is_timing()) {
+        auto start = std::chrono::steady_clock::now();
+        update_band(0, 0);
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        m_pool_crossover.record_serial_tick(elapsed.count());
+    }
+    else {
+        update_band(0, 0);
+    }
+    m_even_blocks = !m_even_blocks;
+}
+
+void NibbleMargolusCA::tick() {
+    bool is_even = use_even_grid();
+    if (m_even_blocks != is_even) {
+        // The frame number or direction changed since the last tick, so the blocks are for the
+        // other phase.
+        update_blocks(m_identity);
+    }
+    update_blocks(m_byte_maps[is_even][!is_reversed()]);
+    m_frame_number += (is_reversed()) ? -1 : 1;
+}
+
+}  // namespace
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include "ca.h"
+#include "worker_pool.h"
+
+namespace Critters {
+
+/**
+ * An engine that stores the grid block major: each 2x2 block of the phase that the next tick
+ * updates is a 4-bit nibble, in the same bit order as block states (top left is the highest
+ * bit), so updating a block is a single table lookup on its nibble. Each row of blocks is
+ * packed 16 to a 64-bit word, and rows of blocks follow each other, so the two rows of cells in
+ * a block are never far apart in memory. Like `PackedMargolusCA`, it uses one bit per cell.
+ *
+ * After the lookup, the blocks are regrouped into the blocks of the other phase, which are
+ * offset by one row and column. Each new block takes one cell from each of four old blocks:
+ * the one at the same position, the next one in the row, and the two below them (or above them
+ * going back to even blocks), so whole words are regrouped with shifts and masks. Both steps
+ * are done in one pass over the grid.
+ */
+class NibbleMargolusCA : public MargolusEngine {
+public:
+    NibbleMargolusCA(
+        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transition_table);
+
+    inline uint32_t num_block_rows() const {return num_rows() / 2;}
+    inline uint32_t num_block_cols() const {return num_cols() / 2;}
+    inline uint32_t words_per_block_row() const {return m_words_per_block_row;}
+
+    bool at(uint32_t row, uint32_t col) const override;
+
+    using MargolusEngine::set_cells;
+    void set_cells(const uint32_t* coords, size_t num_cells, bool active = true) override;
+
+    void get_row_bits(uint32_t row, uint64_t* words) const override;
+    void set_row_bits(uint32_t row, const uint64_t* words) override;
+
+    void reset() override;
+
+    void tick() override;
+
+private:
+    uint32_t m_words_per_block_row;
+    // Mask of the nibbles of the last word in each row of blocks that are inside the grid.
+    uint64_t m_last_word_mask;
+    // Whether `m_blocks` holds even blocks (with the top left cell at an even row and column)
+    // rather than odd ones.
+    bool m_even_blocks = true;
+    std::vector<uint64_t> m_blocks;
+    // Next states for a byte of two blocks, indexed by [even][forward]. `m_identity` regroups
+    // blocks without changing them.
+    std::array<std::array<std::array<uint8_t, 256>, 2>, 2> m_byte_maps;
+    std::array<uint8_t, 256> m_identity;
+    std::unique_ptr<WorkerPool> m_pool;
+    PoolCrossover m_pool_crossover;
+    // For `update_blocks`: the old row past the end of each band of rows, and two rows of
+    // mapped blocks per band.
+    std::vector<uint64_t> m_boundary_rows;
+    std::vector<uint64_t> m_mapped_rows;
+
+    inline uint64_t* block_row(uint32_t row) {
+        return &m_blocks[(size_t)row * m_words_per_block_row];
+    }
+    inline const uint64_t* block_row(uint32_t row) const {
+        return &m_blocks[(size_t)row * m_words_per_block_row];
+    }
+
+    // The word and bit of the cell at `row` and `col` in the current blocks.
+    void locate_cell(uint32_t row, uint32_t col, size_t& word, uint32_t& bit) const;
+
+    bool should_use_pool();
+    // Maps every block through `byte_map`, and regroups them into blocks of the other phase.
+    void update_blocks(const std::array<uint8_t, 256>& byte_map);
+    void update_block_rows(const std::array<uint8_t, 256>& byte_map, uint32_t start_row,
+        uint32_t end_row, const uint64_t* boundary_row, uint64_t* mapped_rows);
+};
+
+}  // namespace
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include <dirent.h>
+#include <sched.h>
+
+#include "numa_topology.h"
+
+namespace Critters {
+
+namespace {
+    const char* NODE_DIRECTORY = "/sys/devices/system/node";
+
+    // Parses a CPU list like "0-3,8,10-11", as used in sysfs.
+    std::vector<uint32_t> parse_cpu_list(const std::string& list) {
+        std::vector<uint32_t> cpus;
+        std::istringstream stream(list);
+        std::string range;
+        while (std::getline(stream, range, ',')) {
+            size_t dash = range.find('-');
+            char* end = nullptr;
+            uint32_t first = std::strtoul(range.c_str(), &end, 10);
+            if (end == range.c_str()) {
+                continue;
+            }
+            uint32_t last = (dash == std::string::npos) ?
+                first : std::strtoul(range.c_str() + dash + 1, nullptr, 10);
+            for (uint32_t cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // Node numbers and the contents of their cpulist files.
+    std::vector<std::pair<uint32_t, std::string>> read_node_cpu_lists() {
+        std::vector<std::pair<uint32_t, std::string>> nodes;
+        DIR* dir = opendir(NODE_DIRECTORY);
+        if (!dir) {
+            return nodes;
+        }
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+                    name.find_first_not_of("0123456789", 4) != std::string::npos) {
+                continue;
+            }
+            std::ifstream file(std::string(NODE_DIRECTORY) + "/" + name + "/cpulist");
+            std::string list;
+            if (std::getline(file, list)) {
+                nodes.push_back({(uint32_t)std::stoul(name.substr(4)), list});
+            }
+        }
+        closedir(dir);
+        std::sort(nodes.begin(), nodes.end());
+        return nodes;
+    }
+}
+
+NumaTopology NumaTopology::detect() {
+    NumaTopology topology;
+    std::vector<uint32_t> allowed = thread_cpus();
+    for (auto& node : read_node_cpu_lists()) {
+        std::vector<uint32_t> cpus;
+        for (uint32_t cpu : parse_cpu_list(node.second)) {
+            if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            topology.m_node_cpus.push_back(cpus);
+        }
+    }
+    if (topology.m_node_cpus.empty() && !allowed.empty()) {
+        topology.m_node_cpus.push_back(allowed);
+    }
+    return topology;
+}
+
+uint32_t NumaTopology::node_for_cpu(uint32_t cpu) const {
+    for (uint32_t node = 0; node < num_nodes(); node++) {
+        const auto& cpus = m_node_cpus[node];
+        if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+std::vector<uint32_t> NumaTopology::cpus_for_threads(uint32_t num_threads) const {
+    std::vector<uint32_t> cpus;
+    for (uint32_t node = 0; node < num_nodes(); node++) {
+        uint32_t first_thread = (uint64_t)num_threads * node / num_nodes();
+        uint32_t end_thread = (uint64_t)num_threads * (node + 1) / num_nodes();
+        const auto& node_cpus = m_node_cpus[node];
+        for (uint32_t i = 0; i < end_thread - first_thread; i++) {
+            cpus.push_back(node_cpus[i % node_cpus.size()]);
+        }
+    }
+    return cpus;
+}
+
+std::vector<uint32_t> thread_cpus() {
+    std::vector<uint32_t> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return cpus;
+    }
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+bool set_thread_cpus(const std::vector<uint32_t>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint32_t cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    // On Linux, pid 0 means the calling thread rather than the whole process.
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+}  // namespace
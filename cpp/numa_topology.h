@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace Critters {
+
+/**
+ * The NUMA nodes of this machine, and the CPUs in each of them that this process is allowed to
+ * run on, read from /sys/devices/system/node. Nodes without any allowed CPUs are left out, and
+ * if there's no NUMA information (or no NUMA), every allowed CPU is in a single node. There are
+ * no nodes at all if the allowed CPUs can't be determined.
+ */
+class NumaTopology {
+public:
+    static NumaTopology detect();
+
+    uint32_t num_nodes() const {return m_node_cpus.size();}
+    const std::vector<uint32_t>& node_cpus(uint32_t node) const {return m_node_cpus[node];}
+
+    /**
+     * Returns the node containing `cpu`, or 0 if it isn't in any of them.
+     */
+    uint32_t node_for_cpu(uint32_t cpu) const;
+
+    /**
+     * Chooses a CPU for each of `num_threads` threads. Threads are split into contiguous groups
+     * of (as nearly as possible) equal size, one per node, so that threads working on
+     * neighboring parts of a grid share a node. Within a node, threads take its CPUs in order,
+     * wrapping around if there are more threads than CPUs.
+     */
+    std::vector<uint32_t> cpus_for_threads(uint32_t num_threads) const;
+
+private:
+    std::vector<std::vector<uint32_t>> m_node_cpus;
+};
+
+/**
+ * Returns the CPUs that the calling thread is allowed to run on.
+ */
+std::vector<uint32_t> thread_cpus();
+
+/**
+ * Restricts the calling thread to `cpus`. Returns false if that isn't possible, for example
+ * because none of them are available to this process.
+ */
+bool set_thread_cpus(const std::vector<uint32_t>& cpus);
+
+}  // namespace
@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "packed_ca.h"
+
+namespace Critters {
+
+constexpr uint64_t BitSlicedTransition::EVEN_BITS;
+
+BitSlicedTransition::BitSlicedTransition(const AlgebraicNormalForm& anf) {
+    for (uint32_t i = 0; i < 4; i++) {
+        for (uint32_t s = 0; s < 16; s++) {
+            if ((anf.masks[i] >> s) & 1) {
+                m_terms[i][m_num_terms[i]++] = s;
+            }
+        }
+    }
+}
+
+namespace {
+    void update_words_generic(const BitSlicedTransition& transition,
+            uint64_t* top, uint64_t* bottom, uint32_t num_words) {
+        const uint64_t even_bits = BitSlicedTransition::EVEN_BITS;
+        uint64_t out[4];
+        for (uint32_t i = 0; i < num_words; i++) {
+            uint64_t t = top[i];
+            uint64_t b = bottom[i];
+            transition.apply(t & even_bits, (t >> 1) & even_bits,
+                b & even_bits, (b >> 1) & even_bits, out);
+            top[i] = out[0] | (out[1] << 1);
+            bottom[i] = out[2] | (out[3] << 1);
+        }
+    }
+
+    // Same as `update_words_generic` for one of the built-in mappings, ignoring `transition`.
+    template <const StateArray& States, bool IsForward>
+    void update_words_specialized(const BitSlicedTransition&,
+            uint64_t* top, uint64_t* bottom, uint32_t num_words) {
+        constexpr AlgebraicNormalForm anf = algebraic_normal_form(States, IsForward);
+        const uint64_t even_bits = BitSlicedTransition::EVEN_BITS;
+        uint64_t out[4];
+        for (uint32_t i = 0; i < num_words; i++) {
+            uint64_t t = top[i];
+            uint64_t b = bottom[i];
+            BitSlicedTransition::apply<anf.masks[0], anf.masks[1], anf.masks[2], anf.masks[3]>(
+                t & even_bits, (t >> 1) & even_bits, b & even_bits, (b >> 1) & even_bits, out);
+            top[i] = out[0] | (out[1] << 1);
+            bottom[i] = out[2] | (out[3] << 1);
+        }
+    }
+
+    struct SpecializedKernel {
+        AlgebraicNormalForm anf;
+        PackedMargolusCA::WordsKernel kernel;
+    };
+
+    template <const StateArray& States, bool IsForward>
+    SpecializedKernel specialized_kernel() {
+        return {
+            algebraic_normal_form(States, IsForward), &update_words_specialized<States, IsForward>,
+        };
+    }
+
+    const SpecializedKernel SPECIALIZED_KERNELS[] = {
+        specialized_kernel<CRITTERS_EVEN_STATES, true>(),
+        specialized_kernel<CRITTERS_EVEN_STATES, false>(),
+        specialized_kernel<CRITTERS_ODD_STATES, true>(),
+        specialized_kernel<CRITTERS_ODD_STATES, false>(),
+        specialized_kernel<TRON_STATES, true>(),
+        specialized_kernel<TRON_STATES, false>(),
+        specialized_kernel<HIGHLANDER_STATES, true>(),
+        specialized_kernel<HIGHLANDER_STATES, false>(),
+        specialized_kernel<BILLIARD_BALL_STATES, true>(),
+        specialized_kernel<BILLIARD_BALL_STATES, false>(),
+        specialized_kernel<SCHAEFFER_STATES, true>(),
+        specialized_kernel<SCHAEFFER_STATES, false>(),
+        specialized_kernel<SINGLE_ROTATION_STATES, true>(),
+        specialized_kernel<SINGLE_ROTATION_STATES, false>(),
+    };
+
+    PackedMargolusCA::WordsKernel find_specialized_kernel(const AlgebraicNormalForm& anf) {
+        for (const auto& k : SPECIALIZED_KERNELS) {
+            if (std::equal(std::begin(anf.masks), std::end(anf.masks), std::begin(k.anf.masks))) {
+                return k.kernel;
+            }
+        }
+        return nullptr;
+    }
+
+    // Copies a row so that column `c + 1` is at bit position `c`, and column 0 wraps around to
+    // the last column. This lines up the odd blocks with the even bit positions.
+    void shift_row_for_odd_blocks(
+            const uint64_t* src, uint64_t* dst, uint32_t num_words, uint32_t num_cols) {
+        for (uint32_t i = 0; i + 1 < num_words; i++) {
+            dst[i] = (src[i] >> 1) | (src[i + 1] << 63);
+        }
+        dst[num_words - 1] = src[num_words - 1] >> 1;
+        uint32_t last = num_cols - 1;
+        dst[last / 64] |= (src[0] & 1) << (last % 64);
+    }
+
+    // Inverse of `shift_row_for_odd_blocks`.
+    void unshift_row_for_odd_blocks(const uint64_t* src, uint64_t* dst,
+            uint32_t num_words, uint32_t num_cols, uint64_t last_word_mask) {
+        uint32_t last = num_cols - 1;
+        uint64_t wrapped = (src[last / 64] >> (last % 64)) & 1;
+        for (uint32_t i = num_words - 1; i > 0; i--) {
+            dst[i] = (src[i] << 1) | (src[i - 1] >> 63);
+        }
+        dst[0] = (src[0] << 1) | wrapped;
+        dst[num_words - 1] &= last_word_mask;
+    }
+}
+
+PackedMargolusCA::PackedMargolusCA(
+        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transition_table) :
+        MargolusEngine(num_rows, num_cols, transition_table) {
+    m_words_per_row = (num_cols + 63) / 64;
+    uint32_t last_bits = num_cols % 64;
+    m_last_word_mask = (last_bits == 0) ? ~0ULL : ((1ULL << last_bits) - 1);
+    m_words.resize((size_t)num_rows * m_words_per_row, 0);
+    // The table's backward mappings are already inverted, so they're converted as forward.
+    for (int even = 0; even < 2; even++) {
+        for (int forward = 0; forward < 2; forward++) {
+            AlgebraicNormalForm anf =
+                algebraic_normal_form(transition_table->states(even, forward), true);
+            m_transitions[even][forward] = BitSlicedTransition(anf);
+            m_specialized_kernels[even][forward] = find_specialized_kernel(anf);
+        }
+    }
+}
+
+void PackedMargolusCA::set_use_specialized_kernels(bool use) {
+    m_use_specialized_kernels = use;
+}
+
+bool PackedMargolusCA::is_using_specialized_kernel() const {
+    return m_use_specialized_kernels &&
+        m_specialized_kernels[use_even_grid()][!is_reversed()] != nullptr;
+}
+
+bool PackedMargolusCA::at(uint32_t row, uint32_t col) const {
+    return (row_words(row)[col / 64] >> (col % 64)) & 1;
+}
+
+void PackedMargolusCA::set_cells(const uint32_t* coords, size_t num_cells, bool active) {
+    for (size_t i = 0; i < num_cells; i++) {
+        uint32_t col = coords[2 * i + 1];
+        uint64_t& word = row_words(coords[2 * i])[col / 64];
+        uint64_t bit = 1ULL << (col % 64);
+        word = active ? (word | bit) : (word & ~bit);
+    }
+}
+
+// Rows use the same layout as `get_row_bits`.
+void PackedMargolusCA::get_row_bits(uint32_t row, uint64_t* words) const {
+    std::copy(row_words(row), row_words(row) + words_per_row(), words);
+}
+
+void PackedMargolusCA::set_row_bits(uint32_t row, const uint64_t* words) {
+    std::copy(words, words + words_per_row(), row_words(row));
+    row_words(row)[words_per_row() - 1] &= m_last_word_mask;
+}
+
+void PackedMargolusCA::reset() {
+    m_reversed = false;
+    m_frame_number = 0;
+    std::fill(m_words.begin(), m_words.end(), 0);
+}
+
+// Updates the 32 blocks in each pair of words. `top` and `bottom` are modified in place.
+void PackedMargolusCA::update_words(
+        bool is_even, uint64_t* top, uint64_t* bottom, uint32_t num_words) const {
+    bool is_forward = !is_reversed();
+    const BitSlicedTransition& transition = m_transitions[is_even][is_forward];
+    WordsKernel kernel = m_specialized_kernels[is_even][is_forward];
+    if (!m_use_specialized_kernels || !kernel) {
+        kernel = update_words_generic;
+    }
+    kernel(transition, top, bottom, num_words);
+    // Blocks past the right edge are all zeros, but they can still produce active cells if the
+    // transition doesn't map the empty block to itself.
+    top[num_words - 1] &= m_last_word_mask;
+    bottom[num_words - 1] &= m_last_word_mask;
+}
+
+// Blocks never overlap within a frame, so each pair of rows can be updated in place. Odd blocks
+// are shifted into `odd_rows`, which has room for two rows.
+void PackedMargolusCA::update_row_pairs(
+        uint32_t start_pair, uint32_t end_pair, uint64_t* odd_rows) {
+    bool is_even = use_even_grid();
+    uint32_t nwords = words_per_row();
+    if (is_even) {
+        for (uint32_t p = start_pair; p < end_pair; p++) {
+            update_words(is_even, row_words(2 * p), row_words(2 * p + 1), nwords);
+        }
+        return;
+    }
+    // Odd blocks start at row and column 1, and wrap around the bottom and right edges.
+    uint64_t* top = odd_rows;
+    uint64_t* bottom = odd_rows + nwords;
+    for (uint32_t p = start_pair; p < end_pair; p++) {
+        uint64_t* top_row = row_words(2 * p + 1);
+        uint64_t* bottom_row = row_words((2 * p + 2) % num_rows());
+        shift_row_for_odd_blocks(top_row, top, nwords, num_cols());
+        shift_row_for_odd_blocks(bottom_row, bottom, nwords, num_cols());
+        update_words(is_even, top, bottom, nwords);
+        unshift_row_for_odd_blocks(top, top_row, nwords, num_cols(), m_last_word_mask);
+        unshift_row_for_odd_blocks(bottom, bottom_row, nwords, num_cols(), m_last_word_mask);
+    }
+}
+
+// Decides whether to split the next tick across the worker pool, starting it if needed.
+bool PackedMargolusCA::should_use_pool() {
+    uint32_t nthreads = num_threads();
+    if (nthreads <= 1) {
+        return false;
+    }
+    if (!m_pool || m_pool->num_threads() != nthreads) {
+        m_pool = std::make_unique<WorkerPool>(nthreads);
+    }
+    return m_pool_crossover.should_use_pool(*m_pool);
+}
+
+// Splits the pairs of rows into one band per thread.
+void PackedMargolusCA::tick() {
+    uint32_t num_pairs = num_rows() / 2;
+    uint32_t nwords = words_per_row();
+    bool parallel = should_use_pool();
+    uint32_t nbands = parallel ? std::min(m_pool->num_threads(), num_pairs) : 1;
+    m_odd_rows.resize((size_t)nbands * 2 * nwords);
+    auto update_band = [this, num_pairs, nwords, nbands](uint32_t i, uint32_t) {
+        update_row_pairs(i * num_pairs / nbands, (i + 1) * num_pairs / nbands,
+            &m_odd_rows[(size_t)i * 2 * nwords]);
+    };
+    if (parallel) {
+        m_pool->run(nbands, update_band);
+    }
+    else if (num_threads() > 1 && m_pool_crossover.is_timing()) {
+        auto start = std::chrono::steady_clock::now();
+        update_band(0, 0);
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        m_pool_crossover.record_serial_tick(elapsed.count());
+    }
+    else {
+        update_band(0, 0);
+    }
+    m_frame_number += (is_reversed()) ? -1 : 1;
+}
+
+}  // namespace
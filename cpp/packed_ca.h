@@ -0,0 +1,212 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "ca.h"
+#include "worker_pool.h"
+
+namespace Critters {
+
+/**
+ * The algebraic normal form of each output cell of a mapping: bit `s` of `masks[i]` is set if
+ * the product (AND) of the input cells in block state `s` is one of the terms whose XOR gives
+ * output cell `i`. Output cells are in the order top left, top right, bottom left, and bottom
+ * right.
+ */
+struct AlgebraicNormalForm {
+    uint16_t masks[4];
+};
+
+/**
+ * Returns the algebraic normal form of `states`, or of its inverse if `is_forward` is false.
+ * This is constexpr so that it can be evaluated for the built-in rules at compile time.
+ */
+constexpr AlgebraicNormalForm algebraic_normal_form(const StateArray& states, bool is_forward) {
+    uint32_t next[16] = {};
+    for (uint32_t s = 0; s < 16; s++) {
+        if (is_forward) {
+            next[s] = states[s];
+        }
+        else {
+            next[states[s]] = s;
+        }
+    }
+    AlgebraicNormalForm result {};
+    for (uint32_t i = 0; i < 4; i++) {
+        // Output cell `i` is bit `3 - i` of the next block state (top left is most significant).
+        uint8_t coefficients[16] = {};
+        for (uint32_t s = 0; s < 16; s++) {
+            coefficients[s] = (next[s] >> (3 - i)) & 1;
+        }
+        // Convert the truth table to algebraic normal form with a Moebius transform.
+        for (uint32_t bit = 1; bit < 16; bit <<= 1) {
+            for (uint32_t s = 0; s < 16; s++) {
+                if (s & bit) {
+                    coefficients[s] ^= coefficients[s ^ bit];
+                }
+            }
+        }
+        for (uint32_t s = 0; s < 16; s++) {
+            result.masks[i] |= coefficients[s] << s;
+        }
+    }
+    return result;
+}
+
+/**
+ * A block transition compiled into boolean formulas that operate on 64-bit words. Each word
+ * holds 32 blocks, with the left cell of a block in an even bit position and the right cell in
+ * the odd bit position above it. Every output bit of the transition is expressed in algebraic
+ * normal form, as the XOR of products (ANDs) of the four input bits, so that evaluating the
+ * formulas on whole words updates all 32 blocks at once.
+ */
+class BitSlicedTransition {
+public:
+    BitSlicedTransition() = default;
+    explicit BitSlicedTransition(const AlgebraicNormalForm& anf);
+
+    /**
+     * Applies the transition to 32 blocks. The four inputs hold the top left, top right,
+     * bottom left, and bottom right cells of each block, all aligned to the even bit positions.
+     * The outputs are written in the same order and alignment.
+     */
+    inline void apply(uint64_t tl, uint64_t tr, uint64_t bl, uint64_t br, uint64_t* out) const {
+        uint64_t m[16];
+        products(tl, tr, bl, br, m);
+        for (uint32_t i = 0; i < 4; i++) {
+            uint64_t result = 0;
+            for (uint32_t t = 0; t < m_num_terms[i]; t++) {
+                result ^= m[m_terms[i][t]];
+            }
+            out[i] = result;
+        }
+    }
+
+    /**
+     * Same as `apply` for a transition whose algebraic normal form is known at compile time.
+     * The terms become straight-line code, and products that no term uses are optimized away.
+     */
+    template <uint16_t TL, uint16_t TR, uint16_t BL, uint16_t BR>
+    static inline void apply(uint64_t tl, uint64_t tr, uint64_t bl, uint64_t br, uint64_t* out) {
+        uint64_t m[16];
+        products(tl, tr, bl, br, m);
+        auto terms = std::make_index_sequence<16>();
+        out[0] = xor_terms<TL>(m, terms);
+        out[1] = xor_terms<TR>(m, terms);
+        out[2] = xor_terms<BL>(m, terms);
+        out[3] = xor_terms<BR>(m, terms);
+    }
+
+    static constexpr uint64_t EVEN_BITS = 0x5555555555555555ULL;
+
+private:
+    // Sets `m` to the products of every subset of the inputs, indexed in the same bit order as
+    // block states.
+    static inline void products(uint64_t tl, uint64_t tr, uint64_t bl, uint64_t br, uint64_t* m) {
+        m[0] = EVEN_BITS;
+        m[8] = tl;
+        m[4] = tr;
+        m[2] = bl;
+        m[1] = br;
+        m[12] = tl & tr;
+        m[10] = tl & bl;
+        m[9] = tl & br;
+        m[6] = tr & bl;
+        m[5] = tr & br;
+        m[3] = bl & br;
+        m[14] = m[12] & bl;
+        m[13] = m[12] & br;
+        m[11] = m[10] & br;
+        m[7] = m[6] & br;
+        m[15] = m[14] & br;
+    }
+
+    // Returns the XOR of the products in `Mask`. The pack expansion makes one statement per
+    // product, and the ones that aren't in `Mask` are removed at compile time.
+    template <uint16_t Mask, size_t... Terms>
+    static inline uint64_t xor_terms(const uint64_t* m, std::index_sequence<Terms...>) {
+        uint64_t result = 0;
+        int expand[] = {(((Mask >> Terms) & 1) ? (result ^= m[Terms], 0) : 0)...};
+        (void)expand;
+        return result;
+    }
+
+    // For each output cell, the indices into the product array whose XOR gives its next state.
+    std::array<std::array<uint8_t, 16>, 4> m_terms {};
+    std::array<uint8_t, 4> m_num_terms {};
+};
+
+/**
+ * An engine that stores one bit per cell, packed into 64-bit words along each row, and updates
+ * the grid in place with `BitSlicedTransition`. It uses one eighth of the memory of
+ * `MargolusCA` and produces identical results.
+ *
+ * Mappings of the built-in rules (in either direction) are updated by code generated for them
+ * at compile time, which is chosen by comparing algebraic normal forms, so it's also used for
+ * identical rules created with `TransitionTable::fromHex`. Other mappings use the generic
+ * `BitSlicedTransition::apply`.
+ */
+class PackedMargolusCA : public MargolusEngine {
+public:
+    PackedMargolusCA(
+        uint32_t num_rows, uint32_t num_cols, std::shared_ptr<TransitionTable> transition_table);
+
+    inline uint32_t words_per_row() const {return m_words_per_row;}
+
+    bool at(uint32_t row, uint32_t col) const override;
+
+    using MargolusEngine::set_cells;
+    void set_cells(const uint32_t* coords, size_t num_cells, bool active = true) override;
+
+    void get_row_bits(uint32_t row, uint64_t* words) const override;
+    void set_row_bits(uint32_t row, const uint64_t* words) override;
+
+    void reset() override;
+
+    void tick() override;
+
+    /**
+     * Enables or disables the code generated for built-in rules, which is on by default. Both
+     * produce identical results; this is for comparing them.
+     */
+    void set_use_specialized_kernels(bool use);
+
+    /**
+     * Returns whether the mapping for the current phase and direction has a generated kernel,
+     * and it's in use.
+     */
+    bool is_using_specialized_kernel() const;
+
+    // Updates the blocks in `num_words` pairs of words in place.
+    using WordsKernel = void (*)(const BitSlicedTransition& transition,
+        uint64_t* top, uint64_t* bottom, uint32_t num_words);
+
+private:
+    uint32_t m_words_per_row;
+    // Mask of the bits of the last word in each row that are inside the grid.
+    uint64_t m_last_word_mask;
+    std::vector<uint64_t> m_words;
+    // Indexed by [use_even_grid][is_forward]. Generated kernels are null for mappings without
+    // one.
+    std::array<std::array<BitSlicedTransition, 2>, 2> m_transitions;
+    std::array<std::array<WordsKernel, 2>, 2> m_specialized_kernels {};
+    bool m_use_specialized_kernels = true;
+    std::unique_ptr<WorkerPool> m_pool;
+    PoolCrossover m_pool_crossover;
+    // Two rows per band of `tick`, which odd blocks are shifted into.
+    std::vector<uint64_t> m_odd_rows;
+
+    inline uint64_t* row_words(uint32_t row) {return &m_words[(size_t)row * m_words_per_row];}
+    inline const uint64_t* row_words(uint32_t row) const {
+        return &m_words[(size_t)row * m_words_per_row];
+    }
+
+    bool should_use_pool();
+    void update_row_pairs(uint32_t start_pair, uint32_t end_pair, uint64_t* odd_rows);
+    void update_words(bool is_even, uint64_t* top, uint64_t* bottom, uint32_t num_words) const;
+};
+
+}  // namespace
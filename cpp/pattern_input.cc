@@ -0,0 +1,307 @@
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cell_batcher.h"
+#include "pattern_input.h"
+
+namespace Critters {
+
+namespace {
+    const size_t READ_BLOCK_SIZE = 1 << 20;
+    // More digits than this could overflow an int64.
+    const size_t MAX_DIGITS = 18;
+
+    const uint64_t POWERS_OF_10[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+    inline bool is_digit(char ch) {
+        return static_cast<unsigned char>(ch - '0') < 10;
+    }
+
+    inline bool is_space(char ch) {
+        return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+    }
+
+    // `digits` is 8 bytes read from the input with each byte XORed with '0', so that digits
+    // have their numeric values. Returns the number of leading digits, from 0 to 8. A byte that
+    // isn't a digit either has its high bit set or overflows to set it when adding 0x76, and
+    // only those bytes can carry into the next one.
+    inline uint32_t leading_digit_count(uint64_t digits) {
+        uint64_t non_digits = ((digits + 0x7676767676767676ULL) | digits) & 0x8080808080808080ULL;
+        return non_digits ? __builtin_ctzll(non_digits) / 8 : 8;
+    }
+
+    // Returns the value of the first `count` (1 to 8) digits in `digits`, as above. Shifting
+    // moves them to the end of the word, as if preceded by zeros, and then adjacent digits,
+    // pairs, and quads are combined.
+    inline uint64_t parse_digits(uint64_t digits, uint32_t count) {
+        uint64_t v = digits << (8 * (8 - count));
+        v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFULL;
+        v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFULL;
+        return (v * 10000 + (v >> 32)) & 0xFFFFFFFFULL;
+    }
+
+    // Parses the digits starting at `p`, which must be a digit, and advances past them. Runs of
+    // digits are read 8 bytes at a time while there's room.
+    uint64_t parse_number(const char*& p, const char* end) {
+        const char* start = p;
+        uint64_t value = 0;
+        while (end - p >= 8) {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            uint64_t digits = word ^ 0x3030303030303030ULL;
+            uint32_t count = leading_digit_count(digits);
+            if (count == 0) {
+                break;
+            }
+            value = value * POWERS_OF_10[count] + parse_digits(digits, count);
+            p += count;
+            if (count < 8) {
+                break;
+            }
+        }
+        while (p < end && is_digit(*p)) {
+            value = value * 10 + (*p - '0');
+            p++;
+        }
+        if (static_cast<size_t>(p - start) > MAX_DIGITS) {
+            throw std::runtime_error("Number too large: " + std::string(start, p));
+        }
+        return value;
+    }
+
+    const char* end_of_line(const char* p, const char* end) {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        return newline ? newline : end;
+    }
+}
+
+PatternFormat pattern_format_for_name(const std::string& name) {
+    if (name == "auto") {
+        return PatternFormat::AUTO;
+    }
+    if (name == "coords") {
+        return PatternFormat::COORDINATES;
+    }
+    if (name == "rle") {
+        return PatternFormat::RLE;
+    }
+    if (name == "plaintext") {
+        return PatternFormat::PLAINTEXT;
+    }
+    throw std::invalid_argument("Unknown pattern format: " + name);
+}
+
+std::unique_ptr<PatternInput> PatternInput::from_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't read pattern file " + path);
+    }
+    std::unique_ptr<PatternInput> input(new PatternInput());
+    bool ok = input->map_file(fd);
+    ::close(fd);
+    if (!ok) {
+        throw std::runtime_error("Can't read pattern file " + path);
+    }
+    return input;
+}
+
+std::unique_ptr<PatternInput> PatternInput::from_stdin() {
+    std::unique_ptr<PatternInput> input(new PatternInput());
+    if (!input->map_file(STDIN_FILENO)) {
+        throw std::runtime_error("Can't read standard input");
+    }
+    return input;
+}
+
+PatternInput::~PatternInput() {
+    if (m_is_mapped) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+}
+
+// Maps `fd` if it's a regular file positioned at its start, and otherwise reads it to the end.
+bool PatternInput::map_file(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            m_data = static_cast<const char*>(data);
+            m_size = st.st_size;
+            m_is_mapped = true;
+            return true;
+        }
+    }
+    size_t size = 0;
+    while (true) {
+        m_buffer.resize(size + READ_BLOCK_SIZE);
+        ssize_t n = read(fd, &m_buffer[size], READ_BLOCK_SIZE);
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    m_buffer.resize(size);
+    m_data = m_buffer.data();
+    m_size = size;
+    return true;
+}
+
+PatternFormat PatternInput::detect_format() const {
+    const char* p = m_data;
+    const char* end = m_data + m_size;
+    while (p < end && is_space(*p)) {
+        p++;
+    }
+    if (p == end) {
+        return PatternFormat::COORDINATES;
+    }
+    switch (*p) {
+        case '#': case 'x': case 'b': case 'o':
+            return PatternFormat::RLE;
+        case '!': case '.': case 'O': case '*':
+            return PatternFormat::PLAINTEXT;
+        default:
+            return PatternFormat::COORDINATES;
+    }
+}
+
+void PatternInput::read_cells(PatternFormat format, const CellBatchFn& fn) const {
+    switch (format == PatternFormat::AUTO ? detect_format() : format) {
+        case PatternFormat::RLE:
+            read_rle(fn);
+            break;
+        case PatternFormat::PLAINTEXT:
+            read_plaintext(fn);
+            break;
+        default:
+            read_coordinates(fn);
+            break;
+    }
+}
+
+void PatternInput::read_coordinates(const CellBatchFn& fn) const {
+    CellBatcher<int64_t> batcher(fn);
+    const char* p = m_data;
+    const char* end = m_data + m_size;
+    int64_t row = 0;
+    bool has_row = false;
+    while (true) {
+        while (p < end && !is_digit(*p)) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        bool negative = (p > m_data && p[-1] == '-');
+        int64_t value = parse_number(p, end);
+        if (negative) {
+            value = -value;
+        }
+        if (has_row) {
+            batcher.add(row, value);
+        }
+        else {
+            row = value;
+        }
+        has_row = !has_row;
+    }
+    batcher.flush();
+}
+
+void PatternInput::read_rle(const CellBatchFn& fn) const {
+    CellBatcher<int64_t> batcher(fn);
+    const char* p = m_data;
+    const char* end = m_data + m_size;
+    // Comment and header lines.
+    while (p < end) {
+        const char* line_start = p;
+        while (line_start < end && is_space(*line_start)) {
+            line_start++;
+        }
+        if (line_start < end && (*line_start == '#' || *line_start == 'x')) {
+            p = end_of_line(line_start, end);
+        }
+        else {
+            p = line_start;
+            break;
+        }
+    }
+    int64_t row = 0;
+    int64_t col = 0;
+    while (p < end) {
+        char ch = *p;
+        if (is_space(ch)) {
+            p++;
+            continue;
+        }
+        int64_t count = 1;
+        if (is_digit(ch)) {
+            count = parse_number(p, end);
+            if (p == end) {
+                throw std::runtime_error("RLE pattern ends with a run count");
+            }
+            ch = *p;
+        }
+        p++;
+        if (ch == 'b' || ch == '.') {
+            col += count;
+        }
+        else if (ch == 'o' || (ch >= 'A' && ch <= 'X')) {
+            for (int64_t i = 0; i < count; i++) {
+                batcher.add(row, col + i);
+            }
+            col += count;
+        }
+        else if (ch == '$') {
+            row += count;
+            col = 0;
+        }
+        else if (ch == '!') {
+            break;
+        }
+        else {
+            throw std::runtime_error(std::string("Invalid character in RLE pattern: ") + ch);
+        }
+    }
+    batcher.flush();
+}
+
+void PatternInput::read_plaintext(const CellBatchFn& fn) const {
+    CellBatcher<int64_t> batcher(fn);
+    const char* p = m_data;
+    const char* end = m_data + m_size;
+    int64_t row = 0;
+    while (p < end) {
+        const char* line_end = end_of_line(p, end);
+        if (*p != '!') {
+            for (int64_t col = 0; p + col < line_end; col++) {
+                char ch = p[col];
+                if (ch == 'O' || ch == '*') {
+                    batcher.add(row, col);
+                }
+                else if (ch != '.' && !is_space(ch)) {
+                    throw std::runtime_error(
+                        std::string("Invalid character in plaintext pattern: ") + ch);
+                }
+            }
+            row++;
+        }
+        p = (line_end < end) ? line_end + 1 : end;
+    }
+    batcher.flush();
+}
+
+}  // namespace
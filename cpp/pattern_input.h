@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Critters {
+
+enum class PatternFormat {
+    // Chosen by `PatternInput::detect_format`.
+    AUTO,
+    // Integers separated by anything else, taken as row/column pairs. A minus sign immediately
+    // before digits makes a negative number. In particular, this reads a JSON array of pairs.
+    COORDINATES,
+    // The run length encoded format used by Golly: an optional "x = ..." header line, then
+    // runs of "b" (inactive) and "o" (active) cells, "$" between rows, and "!" at the end.
+    // Lines starting with "#" are comments.
+    RLE,
+    // One line per row, with "." for inactive and "O" or "*" for active cells. Lines starting
+    // with "!" are comments.
+    PLAINTEXT,
+};
+
+/**
+ * Returns the format for a name given on the command line: "auto", "coords", "rle", or
+ * "plaintext". Throws std::invalid_argument for anything else.
+ */
+PatternFormat pattern_format_for_name(const std::string& name);
+
+/**
+ * Receives cells read from a pattern, `num_cells` at a time, as row/column pairs in `coords`.
+ * The same cell may appear more than once.
+ */
+using CellBatchFn = std::function<void(const int64_t* coords, size_t num_cells)>;
+
+/**
+ * The contents of a pattern file. Regular files (including stdin redirected from a file) are
+ * memory mapped, and anything else is read in large blocks. Throws std::runtime_error if the
+ * input can't be read.
+ */
+class PatternInput {
+public:
+    static std::unique_ptr<PatternInput> from_file(const std::string& path);
+    static std::unique_ptr<PatternInput> from_stdin();
+    ~PatternInput();
+
+    PatternInput(const PatternInput&) = delete;
+    PatternInput& operator=(const PatternInput&) = delete;
+
+    const char* data() const {return m_data;}
+    size_t size() const {return m_size;}
+
+    /**
+     * Guesses the format from the first non-whitespace character: "#" or "x" for RLE, "!", ".",
+     * "O", or "*" for plaintext, and otherwise coordinates.
+     */
+    PatternFormat detect_format() const;
+
+    /**
+     * Parses the input, calling `fn` with batches of the active cells. For RLE and plaintext, the
+     * top left cell of the pattern is at row 0 and column 0. Throws std::runtime_error if the
+     * input isn't valid for the format.
+     */
+    void read_cells(PatternFormat format, const CellBatchFn& fn) const;
+
+private:
+    PatternInput() = default;
+
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_is_mapped = false;
+    std::vector<char> m_buffer;
+
+    bool map_file(int fd);
+    void read_coordinates(const CellBatchFn& fn) const;
+    void read_rle(const CellBatchFn& fn) const;
+    void read_plaintext(const CellBatchFn& fn) const;
+};
+
+}  // namespace
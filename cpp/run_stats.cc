@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "run_stats.h"
+
+namespace Critters {
+
+const uint32_t RunStats::MAX_THREADS;
+
+RunStats::RunStats(std::ostream* output, double summary_interval_seconds) :
+        m_output(output), m_summary_interval(summary_interval_seconds),
+        m_slots(new ThreadSlot[MAX_THREADS]),
+        m_idle_ns(MAX_THREADS, 0), m_busy_at_last_summary(MAX_THREADS, 0),
+        m_busy_at_last_frame(MAX_THREADS, 0) {
+    m_start_time = std::chrono::steady_clock::now();
+    m_last_summary_time = m_start_time;
+}
+
+RunStats::~RunStats() {
+    write_summary();
+}
+
+uint32_t RunStats::histogram_bucket(double ns) const {
+    if (ns < 1) {
+        return 0;
+    }
+    double bucket = std::log2(ns) * HISTOGRAM_STEPS;
+    return std::min<double>(bucket, HISTOGRAM_SIZE - 1);
+}
+
+// Returns the middle of the bucket containing the given fraction of ticks.
+double RunStats::tick_percentile(double fraction) const {
+    uint64_t num_ticks = 0;
+    for (uint64_t count : m_tick_histogram) {
+        num_ticks += count;
+    }
+    uint64_t target = std::ceil(fraction * num_ticks);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += m_tick_histogram[i];
+        if (seen >= target && seen > 0) {
+            return std::min(std::exp2((i + 0.5) / HISTOGRAM_STEPS), m_max_tick_ns);
+        }
+    }
+    return 0;
+}
+
+void RunStats::record_frames(int64_t frame_number, uint64_t num_frames, uint64_t num_cells,
+        uint32_t num_threads, double ns) {
+    m_frame_number = frame_number;
+    m_num_frames += num_frames;
+    m_cell_updates += (double)num_frames * num_cells;
+    m_frames_ns += ns;
+    double tick_ns = ns / std::max<uint64_t>(num_frames, 1);
+    m_tick_histogram[histogram_bucket(tick_ns)] += num_frames;
+    m_max_tick_ns = std::max(m_max_tick_ns, tick_ns);
+    // Threads that took part but weren't running tasks were idle. The engine has waited for
+    // all of them, so their counters are up to date.
+    num_threads = std::min(num_threads, MAX_THREADS);
+    m_num_threads_seen = std::max(m_num_threads_seen, num_threads);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        uint64_t busy = m_slots[i].busy_ns.load(std::memory_order_relaxed);
+        m_idle_ns[i] += std::max(ns - (double)(busy - m_busy_at_last_frame[i]), 0.0);
+        m_busy_at_last_frame[i] = busy;
+    }
+    if (m_output && std::chrono::steady_clock::now() - m_last_summary_time >= m_summary_interval) {
+        write_summary();
+    }
+}
+
+void RunStats::write_summary() {
+    auto now = std::chrono::steady_clock::now();
+    m_last_summary_time = now;
+    if (!m_output || m_num_frames == 0) {
+        return;
+    }
+    uint64_t num_changed = m_num_changed.load(std::memory_order_relaxed);
+    double seconds = m_frames_ns / 1e9;
+    std::ostringstream ss;
+    ss << "{\"frame\": " << m_frame_number
+        << ", \"seconds\": " << std::chrono::duration<double>(now - m_start_time).count()
+        << ", \"frames\": " << m_num_frames
+        << ", \"tick_ns_p50\": " << tick_percentile(0.5)
+        << ", \"tick_ns_p99\": " << tick_percentile(0.99)
+        << ", \"tick_ns_max\": " << m_max_tick_ns
+        << ", \"frames_per_second\": " << (seconds > 0 ? m_num_frames / seconds : 0)
+        << ", \"cells_per_second\": " << (seconds > 0 ? m_cell_updates / seconds : 0)
+        << ", \"active_tile_fraction\": "
+        << (m_tile_updates > 0 ? m_active_tile_updates / m_tile_updates : 1)
+        << ", \"changed_cells_per_frame\": "
+        << (double)(num_changed - m_changed_at_last_summary) / m_num_frames
+        << ", \"population\": " << population()
+        << ", \"output_seconds\": " << m_output_ns / 1e9
+        << ", \"threads\": [";
+    for (uint32_t i = 0; i < m_num_threads_seen; i++) {
+        uint64_t busy = m_slots[i].busy_ns.load(std::memory_order_relaxed);
+        ss << (i > 0 ? ", " : "") << "{\"busy_seconds\": "
+            << (busy - m_busy_at_last_summary[i]) / 1e9
+            << ", \"idle_seconds\": " << m_idle_ns[i] / 1e9 << "}";
+        m_busy_at_last_summary[i] = busy;
+        m_idle_ns[i] = 0;
+    }
+    ss << "]}\n";
+    *m_output << ss.str();
+    m_output->flush();
+
+    m_num_frames = 0;
+    m_cell_updates = 0;
+    m_active_tile_updates = 0;
+    m_tile_updates = 0;
+    m_frames_ns = 0;
+    m_max_tick_ns = 0;
+    m_output_ns = 0;
+    m_changed_at_last_summary = num_changed;
+    m_tick_histogram.fill(0);
+}
+
+}  // namespace
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace Critters {
+
+/**
+ * Counters for profiling a run: how long each frame takes, how much of that each thread spends
+ * updating the grid, how long output takes, and how many cells change. An engine records into
+ * it only while it's attached (see `MargolusCA::set_stats`), so there's no cost otherwise.
+ *
+ * Worker threads only add to their own padded slot with relaxed atomic operations, so
+ * recording never takes a lock or contends for a cache line. Everything else is called from
+ * the thread that runs the engine, which also writes the summaries.
+ *
+ * A summary is one line of JSON covering the frames since the previous one, with the keys
+ * "frame", "seconds", "frames", "tick_ns_p50", "tick_ns_p99", "tick_ns_max",
+ * "frames_per_second", "cells_per_second", "active_tile_fraction", "changed_cells_per_frame",
+ * "population", "output_seconds", and "threads" (a list of {"busy_seconds", "idle_seconds"},
+ * one per thread that has run a task), always in that order. Tick percentiles are accurate to
+ * about 5%. "active_tile_fraction" is the fraction of tiles that frames updated while skipping
+ * empty tiles (see `MargolusCA::num_active_tiles`).
+ */
+class RunStats {
+public:
+    static const uint32_t MAX_THREADS = 256;
+
+    /**
+     * If `output` isn't null, a summary is written to it whenever frames are recorded and at
+     * least `summary_interval_seconds` have passed since the last one.
+     */
+    RunStats(std::ostream* output, double summary_interval_seconds);
+
+    /**
+     * Writes a final summary.
+     */
+    ~RunStats();
+
+    RunStats(const RunStats&) = delete;
+    RunStats& operator=(const RunStats&) = delete;
+
+    /**
+     * Adds time that a thread spent running tasks. Thread indices are the ones passed to tasks
+     * by `WorkerPool`, with 0 for the thread that runs the engine. Thread safe.
+     */
+    void add_busy_ns(uint32_t thread_index, uint64_t ns) {
+        slot(thread_index).busy_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    /**
+     * Adds cells that became active or inactive. Thread safe.
+     */
+    void add_changes(uint64_t num_activated, uint64_t num_deactivated) {
+        m_num_changed.fetch_add(num_activated + num_deactivated, std::memory_order_relaxed);
+        m_population.fetch_add(
+            (int64_t)num_activated - (int64_t)num_deactivated, std::memory_order_relaxed);
+    }
+
+    void set_population(uint64_t population) {m_population = population;}
+    uint64_t population() const {return m_population;}
+
+    /**
+     * Records that `num_frames` frames of a grid with `num_cells` cells took `ns` nanoseconds,
+     * with tasks spread over `num_threads` threads. Engines that update several frames in one
+     * pass record each pass, which counts as that many frames of the average duration.
+     */
+    void record_frames(int64_t frame_number, uint64_t num_frames, uint64_t num_cells,
+        uint32_t num_threads, double ns);
+
+    /**
+     * Records that each of the next `num_frames` frames updated `num_active_tiles` of the
+     * grid's `num_tiles` tiles. Called before `record_frames` for the same frames.
+     */
+    void record_active_tiles(uint64_t num_frames, uint64_t num_active_tiles, uint64_t num_tiles) {
+        m_active_tile_updates += (double)num_frames * num_active_tiles;
+        m_tile_updates += (double)num_frames * num_tiles;
+    }
+
+    /**
+     * Records time spent writing a checkpoint.
+     */
+    void record_output(double ns) {m_output_ns += ns;}
+
+    /**
+     * Writes a summary of the frames since the last one, if there were any.
+     */
+    void write_summary();
+
+private:
+    // Padded to keep each thread's counters on their own cache lines.
+    struct ThreadSlot {
+        std::atomic<uint64_t> busy_ns {0};
+        char padding[120];
+    };
+
+    // Tick durations in nanoseconds are counted in buckets of exponentially increasing size,
+    // HISTOGRAM_STEPS per power of two, so percentiles don't require keeping every duration.
+    static const uint32_t HISTOGRAM_STEPS = 8;
+    static const uint32_t HISTOGRAM_SIZE = 48 * HISTOGRAM_STEPS;
+
+    std::ostream* m_output;
+    std::chrono::duration<double> m_summary_interval;
+    std::chrono::steady_clock::time_point m_start_time;
+    std::chrono::steady_clock::time_point m_last_summary_time;
+    std::unique_ptr<ThreadSlot[]> m_slots;
+    std::atomic<uint64_t> m_num_changed {0};
+    std::atomic<int64_t> m_population {0};
+
+    // Since the last summary. Only used by the thread that runs the engine.
+    int64_t m_frame_number = 0;
+    uint64_t m_num_frames = 0;
+    double m_cell_updates = 0;
+    double m_active_tile_updates = 0;
+    double m_tile_updates = 0;
+    double m_frames_ns = 0;
+    double m_max_tick_ns = 0;
+    double m_output_ns = 0;
+    uint64_t m_changed_at_last_summary = 0;
+    std::array<uint64_t, HISTOGRAM_SIZE> m_tick_histogram {};
+    // Per thread, idle time and the busy time at the last summary and the last frame.
+    uint32_t m_num_threads_seen = 0;
+    std::vector<double> m_idle_ns;
+    std::vector<uint64_t> m_busy_at_last_summary;
+    std::vector<uint64_t> m_busy_at_last_frame;
+
+    ThreadSlot& slot(uint32_t thread_index) {
+        return m_slots[thread_index < MAX_THREADS ? thread_index : MAX_THREADS - 1];
+    }
+    uint32_t histogram_bucket(double ns) const;
+    double tick_percentile(double fraction) const;
+};
+
+}  // namespace
@@ -0,0 +1,383 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+namespace Critters {
+
+namespace {
+    const char FILE_MAGIC[] = "CRITSNAP";
+    const char RECORD_MAGIC[] = "CRFR";
+    const char INDEX_MAGIC[] = "CRITINDX";
+    const char TRAILER_MAGIC[] = "CRITEND!";
+    const size_t RECORD_HEADER_SIZE = 4 + 4 + 8 + 8;
+    const size_t TRAILER_SIZE = 8 + 8;
+
+    void put_bytes(std::vector<uint8_t>& out, const char* bytes, size_t size) {
+        out.insert(out.end(), bytes, bytes + size);
+    }
+
+    void put_uint(std::vector<uint8_t>& out, uint64_t value, uint32_t num_bytes) {
+        for (uint32_t i = 0; i < num_bytes; i++) {
+            out.push_back((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(value);
+    }
+
+    uint64_t get_uint(const uint8_t* data, uint32_t num_bytes) {
+        uint64_t value = 0;
+        for (uint32_t i = 0; i < num_bytes; i++) {
+            value |= (uint64_t)data[i] << (8 * i);
+        }
+        return value;
+    }
+
+    // Appends the run length encoding of the cells in `words` (the first `num_cols` bits)
+    // to `out`. `current_bit` and `run_length` carry the run in progress between rows.
+    void encode_runs(const uint64_t* words, uint32_t num_cols,
+            bool& current_bit, uint64_t& run_length, std::vector<uint8_t>& out) {
+        uint32_t col = 0;
+        while (col < num_cols) {
+            // Count the cells from `col` that match the current run, a word at a time.
+            uint64_t word = words[col / 64] >> (col % 64);
+            if (current_bit) {
+                word = ~word;
+            }
+            uint32_t bits_left_in_word = 64 - (col % 64);
+            uint32_t matching = (word == 0) ? bits_left_in_word :
+                std::min<uint32_t>(__builtin_ctzll(word), bits_left_in_word);
+            matching = std::min(matching, num_cols - col);
+            run_length += matching;
+            col += matching;
+            if (col < num_cols && matching < bits_left_in_word) {
+                put_varint(out, run_length);
+                current_bit = !current_bit;
+                run_length = 0;
+            }
+        }
+    }
+}
+
+uint8_t encode_snapshot_body(const MargolusEngine& grid, uint32_t first_row, uint32_t num_rows,
+        std::vector<uint8_t>& runs_body, std::vector<uint8_t>& raw_body) {
+    uint32_t nwords = grid.num_row_words();
+    size_t raw_size = (size_t)num_rows * nwords * 8;
+    std::vector<uint64_t> row(nwords);
+    runs_body.clear();
+    raw_body.clear();
+    // Build both encodings in one pass, and stop run encoding once it's no smaller.
+    bool use_runs = true;
+    bool current_bit = false;
+    uint64_t run_length = 0;
+    for (uint32_t r = 0; r < num_rows; r++) {
+        grid.get_row_bits(first_row + r, row.data());
+        for (uint64_t word : row) {
+            put_uint(raw_body, word, 8);
+        }
+        if (use_runs) {
+            encode_runs(row.data(), grid.num_cols(), current_bit, run_length, runs_body);
+            use_runs = runs_body.size() < raw_size;
+        }
+    }
+    if (use_runs) {
+        put_varint(runs_body, run_length);
+        use_runs = runs_body.size() < raw_size;
+    }
+    return use_runs ? SNAPSHOT_RUNS : SNAPSHOT_RAW;
+}
+
+void decode_snapshot_body(
+        const uint8_t* body, uint64_t body_size, uint8_t encoding, MargolusEngine& grid) {
+    uint32_t num_rows = grid.num_rows();
+    uint32_t num_cols = grid.num_cols();
+    uint32_t nwords = grid.num_row_words();
+    std::vector<uint64_t> row(nwords);
+    if (encoding == SNAPSHOT_RAW) {
+        if (body_size != (uint64_t)num_rows * nwords * 8) {
+            throw std::runtime_error("Invalid snapshot record size");
+        }
+        for (uint32_t r = 0; r < num_rows; r++) {
+            for (uint32_t i = 0; i < nwords; i++) {
+                row[i] = get_uint(body + 8 * ((uint64_t)r * nwords + i), 8);
+            }
+            grid.set_row_bits(r, row.data());
+        }
+        return;
+    }
+    const uint8_t* end = body + body_size;
+    auto next_run = [&body, end]() {
+        uint64_t value = 0;
+        for (uint32_t shift = 0; body < end && shift < 64; shift += 7) {
+            uint8_t byte = *body++;
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Invalid snapshot run encoding");
+    };
+    bool current_bit = false;
+    uint64_t run_left = next_run();
+    for (uint32_t r = 0; r < num_rows; r++) {
+        std::fill(row.begin(), row.end(), 0);
+        uint32_t col = 0;
+        while (col < num_cols) {
+            while (run_left == 0) {
+                current_bit = !current_bit;
+                run_left = next_run();
+            }
+            uint32_t n = std::min<uint64_t>(run_left, num_cols - col);
+            if (current_bit) {
+                for (uint32_t c = col; c < col + n; c++) {
+                    row[c / 64] |= 1ULL << (c % 64);
+                }
+            }
+            col += n;
+            run_left -= n;
+        }
+        grid.set_row_bits(r, row.data());
+    }
+}
+
+SnapshotWriter::SnapshotWriter(const std::string& path,
+        uint32_t num_rows, uint32_t num_cols, const TransitionTable& transition_table) :
+        m_path(path),
+        m_output(path, std::ios::binary | std::ios::trunc),
+        m_num_rows(num_rows),
+        m_num_cols(num_cols) {
+    if (!m_output) {
+        throw std::runtime_error("Can't write snapshot file " + path);
+    }
+    std::string hex = transition_table.toHex();
+    std::vector<uint8_t> header;
+    put_bytes(header, FILE_MAGIC, 8);
+    put_uint(header, SNAPSHOT_VERSION, 4);
+    put_uint(header, num_rows, 4);
+    put_uint(header, num_cols, 4);
+    put_uint(header, hex.size(), 4);
+    put_bytes(header, hex.data(), hex.size());
+    write_bytes(header);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    if (m_output.is_open()) {
+        try {
+            close();
+        }
+        catch (std::exception& ex) {
+        }
+    }
+}
+
+void SnapshotWriter::write_bytes(const std::vector<uint8_t>& bytes) {
+    m_output.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    if (!m_output) {
+        throw std::runtime_error("Error writing snapshot file " + m_path);
+    }
+    m_offset += bytes.size();
+}
+
+void SnapshotWriter::write(const MargolusEngine& grid) {
+    if (grid.num_rows() != m_num_rows || grid.num_cols() != m_num_cols) {
+        throw std::invalid_argument("Grid dimensions don't match snapshot file");
+    }
+    write_rows(grid, 0);
+}
+
+void SnapshotWriter::write_rows(const MargolusEngine& grid, uint32_t first_row) {
+    if ((uint64_t)first_row + m_num_rows > grid.num_rows() || grid.num_cols() != m_num_cols) {
+        throw std::invalid_argument("Grid dimensions don't match snapshot file");
+    }
+    uint8_t encoding = encode_snapshot_body(grid, first_row, m_num_rows, m_body, m_raw_body);
+    const std::vector<uint8_t>& body = (encoding == SNAPSHOT_RUNS) ? m_body : m_raw_body;
+
+    std::vector<uint8_t> header;
+    put_bytes(header, RECORD_MAGIC, 4);
+    header.push_back(encoding);
+    header.push_back(grid.is_reversed());
+    put_uint(header, 0, 2);
+    put_uint(header, grid.frame_number(), 8);
+    put_uint(header, body.size(), 8);
+    m_index.push_back({grid.frame_number(), m_offset});
+    write_bytes(header);
+    write_bytes(body);
+    // Flush every record, so that a reader can resume from it if this process is interrupted.
+    m_output.flush();
+}
+
+void SnapshotWriter::close() {
+    std::vector<uint8_t> index;
+    put_bytes(index, INDEX_MAGIC, 8);
+    put_uint(index, m_index.size(), 8);
+    for (auto& entry : m_index) {
+        put_uint(index, entry.first, 8);
+        put_uint(index, entry.second, 8);
+    }
+    put_uint(index, m_offset, 8);
+    put_bytes(index, TRAILER_MAGIC, 8);
+    write_bytes(index);
+    m_output.close();
+    if (!m_output) {
+        throw std::runtime_error("Error writing snapshot file " + m_path);
+    }
+}
+
+SnapshotReader::SnapshotReader(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't read snapshot file " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        throw std::runtime_error("Can't read snapshot file " + path);
+    }
+    m_size = st.st_size;
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Can't map snapshot file " + path);
+    }
+    m_data = static_cast<const uint8_t*>(data);
+    try {
+        read_header(path);
+    }
+    catch (...) {
+        munmap(data, m_size);
+        throw;
+    }
+}
+
+void SnapshotReader::read_header(const std::string& path) {
+    const size_t fixed_header_size = 8 + 4 + 4 + 4 + 4;
+    if (m_size < fixed_header_size || std::memcmp(m_data, FILE_MAGIC, 8) != 0) {
+        throw std::runtime_error("Not a snapshot file: " + path);
+    }
+    if (get_uint(m_data + 8, 4) != SNAPSHOT_VERSION) {
+        throw std::runtime_error("Unsupported snapshot version in " + path);
+    }
+    m_num_rows = get_uint(m_data + 12, 4);
+    m_num_cols = get_uint(m_data + 16, 4);
+    uint64_t hex_size = get_uint(m_data + 20, 4);
+    if (fixed_header_size + hex_size > m_size) {
+        throw std::runtime_error("Truncated snapshot file: " + path);
+    }
+    m_rule_hex.assign(reinterpret_cast<const char*>(m_data + fixed_header_size), hex_size);
+    try {
+        TransitionTable::fromHex(m_rule_hex);
+    }
+    catch (std::exception&) {
+        throw std::runtime_error("Invalid rule in snapshot file " + path);
+    }
+    if (!read_index()) {
+        scan_records(fixed_header_size + hex_size);
+    }
+}
+
+SnapshotReader::~SnapshotReader() {
+    if (m_data) {
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+}
+
+bool SnapshotReader::read_record(uint64_t offset, Record& record) const {
+    if (offset > m_size || m_size - offset < RECORD_HEADER_SIZE) {
+        return false;
+    }
+    const uint8_t* p = m_data + offset;
+    if (std::memcmp(p, RECORD_MAGIC, 4) != 0 || p[4] > SNAPSHOT_RUNS) {
+        return false;
+    }
+    record.encoding = p[4];
+    record.reversed = p[5];
+    record.frame_number = get_uint(p + 8, 8);
+    record.body_size = get_uint(p + 16, 8);
+    record.body_offset = offset + RECORD_HEADER_SIZE;
+    return record.body_size <= m_size - record.body_offset;
+}
+
+bool SnapshotReader::read_index() {
+    if (m_size < TRAILER_SIZE ||
+            std::memcmp(m_data + m_size - 8, TRAILER_MAGIC, 8) != 0) {
+        return false;
+    }
+    uint64_t index_offset = get_uint(m_data + m_size - TRAILER_SIZE, 8);
+    if (index_offset > m_size - TRAILER_SIZE || m_size - TRAILER_SIZE - index_offset < 16 ||
+            std::memcmp(m_data + index_offset, INDEX_MAGIC, 8) != 0) {
+        return false;
+    }
+    uint64_t count = get_uint(m_data + index_offset + 8, 8);
+    if (count > (m_size - TRAILER_SIZE - index_offset - 16) / 16) {
+        return false;
+    }
+    m_records.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t offset = get_uint(m_data + index_offset + 16 + 16 * i + 8, 8);
+        if (!read_record(offset, m_records[i])) {
+            m_records.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void SnapshotReader::scan_records(uint64_t offset) {
+    Record record;
+    while (read_record(offset, record)) {
+        m_records.push_back(record);
+        offset = record.body_offset + record.body_size;
+    }
+}
+
+size_t SnapshotReader::find_frame(int64_t frame_number) const {
+    for (size_t i = m_records.size(); i > 0; i--) {
+        if (m_records[i - 1].frame_number == frame_number) {
+            return i - 1;
+        }
+    }
+    throw std::out_of_range("No snapshot for frame " + std::to_string(frame_number));
+}
+
+size_t SnapshotReader::nearest_record(int64_t frame_number) const {
+    if (m_records.empty()) {
+        throw std::out_of_range("No records in snapshot");
+    }
+    size_t nearest = 0;
+    uint64_t nearest_distance = UINT64_MAX;
+    for (size_t i = 0; i < m_records.size(); i++) {
+        int64_t frame = m_records[i].frame_number;
+        uint64_t distance = (frame > frame_number) ?
+            (uint64_t)frame - frame_number : (uint64_t)frame_number - frame;
+        // Later records win ties, as in `find_frame`.
+        if (distance <= nearest_distance) {
+            nearest = i;
+            nearest_distance = distance;
+        }
+    }
+    return nearest;
+}
+
+void SnapshotReader::load(size_t record_index, MargolusEngine& grid) const {
+    if (grid.num_rows() != m_num_rows || grid.num_cols() != m_num_cols) {
+        throw std::invalid_argument("Grid dimensions don't match snapshot file");
+    }
+    const Record& record = m_records.at(record_index);
+    decode_snapshot_body(m_data + record.body_offset, record.body_size, record.encoding, grid);
+    grid.set_frame_number(record.frame_number);
+    grid.set_reversed(record.reversed);
+}
+
+}  // namespace
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ca.h"
+
+namespace Critters {
+
+/**
+ * Binary snapshot files, which store a sequence of frames of a torus far more compactly than
+ * the JSON output. All integers are little endian. The layout is:
+ *
+ * - Header: the magic string "CRITSNAP", a 32-bit format version, 32-bit row and column
+ *   counts, and the transition table as a 32-bit length followed by that many hex characters
+ *   (see `TransitionTable::toHex`).
+ * - Records, one per frame: the magic string "CRFR", an 8-bit encoding, an 8-bit reversed
+ *   flag, 16 reserved bits, the 64-bit signed frame number, and the 64-bit size of the body in
+ *   bytes followed by the body.
+ * - Index, written when the file is closed: the magic string "CRITINDX", a 64-bit record
+ *   count, and for each record its 64-bit frame number and 64-bit file offset.
+ * - Trailer: the 64-bit offset of the index and the magic string "CRITEND!".
+ *
+ * A reader can find every record from the trailer without reading the records themselves. If
+ * the writer didn't finish (for example because it was interrupted), there's no trailer, and
+ * the reader scans the records instead, ignoring an incomplete one at the end.
+ *
+ * The body is the grid in row major order, one bit per cell, in one of two encodings:
+ * - SNAPSHOT_RAW: each row as `MargolusEngine::num_row_words` 64-bit words, in the format of
+ *   `MargolusEngine::get_row_bits`.
+ * - SNAPSHOT_RUNS: the lengths of alternating runs of inactive and active cells, starting with
+ *   inactive (possibly a zero length run), as LEB128 varints. Rows aren't separated.
+ * The writer uses whichever is smaller, which for sparse grids is usually runs.
+ */
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint8_t SNAPSHOT_RAW = 0;
+const uint8_t SNAPSHOT_RUNS = 1;
+
+/**
+ * Encodes rows `first_row` through `first_row + num_rows` of `grid` as a record body, returning
+ * the smaller encoding. The body is built in `runs_body` for SNAPSHOT_RUNS, and in `raw_body`
+ * for SNAPSHOT_RAW; both are used while encoding, so that their memory can be reused.
+ */
+uint8_t encode_snapshot_body(const MargolusEngine& grid, uint32_t first_row, uint32_t num_rows,
+    std::vector<uint8_t>& runs_body, std::vector<uint8_t>& raw_body);
+
+/**
+ * Replaces the contents of `grid` with a record body that has its dimensions. Throws
+ * std::runtime_error if the body is invalid.
+ */
+void decode_snapshot_body(
+    const uint8_t* body, uint64_t body_size, uint8_t encoding, MargolusEngine& grid);
+
+/**
+ * Writes frames of a grid to a new snapshot file, replacing any existing file. Throws
+ * std::runtime_error if the file can't be written.
+ */
+class SnapshotWriter {
+public:
+    SnapshotWriter(const std::string& path,
+        uint32_t num_rows, uint32_t num_cols, const TransitionTable& transition_table);
+    // Calls `close` (ignoring errors) if it hasn't been called.
+    ~SnapshotWriter();
+
+    /**
+     * Appends the current state of `grid`, which must have the dimensions given to the
+     * constructor, as a record for its current frame.
+     */
+    void write(const MargolusEngine& grid);
+
+    /**
+     * Appends rows `first_row` through `first_row + num_rows` of `grid`, which can have more
+     * rows than the file, as a record for its current frame. This writes part of a larger grid,
+     * such as one rank's band of a `DistributedMargolusCA`.
+     */
+    void write_rows(const MargolusEngine& grid, uint32_t first_row);
+
+    /**
+     * Writes the index and trailer, and closes the file.
+     */
+    void close();
+
+    size_t num_records() const {return m_index.size();}
+
+private:
+    std::string m_path;
+    std::ofstream m_output;
+    uint64_t m_offset = 0;
+    uint32_t m_num_rows;
+    uint32_t m_num_cols;
+    // Frame number and file offset of each record.
+    std::vector<std::pair<int64_t, uint64_t>> m_index;
+    std::vector<uint8_t> m_body;
+    std::vector<uint8_t> m_raw_body;
+
+    void write_bytes(const std::vector<uint8_t>& bytes);
+};
+
+/**
+ * Reads a snapshot file, which is memory mapped so that a record can be loaded without reading
+ * the ones before it. Throws std::runtime_error if the file can't be read or isn't a valid
+ * snapshot.
+ */
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const std::string& path);
+    ~SnapshotReader();
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    uint32_t num_rows() const {return m_num_rows;}
+    uint32_t num_cols() const {return m_num_cols;}
+    const std::string& rule_hex() const {return m_rule_hex;}
+
+    size_t num_records() const {return m_records.size();}
+    int64_t frame_number(size_t record) const {return m_records[record].frame_number;}
+    bool is_reversed(size_t record) const {return m_records[record].reversed;}
+
+    /**
+     * Returns the index of the last record for `frame_number`. Throws std::out_of_range if
+     * there isn't one.
+     */
+    size_t find_frame(int64_t frame_number) const;
+
+    /**
+     * Returns the index of the record with the frame number closest to `frame_number`, which
+     * is the one to load to get to that frame with the fewest ticks. Throws std::out_of_range if
+     * there aren't any records.
+     */
+    size_t nearest_record(int64_t frame_number) const;
+
+    /**
+     * Replaces the contents of `grid`, which must have the snapshot's dimensions, with the given
+     * record, and sets its frame number and direction.
+     */
+    void load(size_t record, MargolusEngine& grid) const;
+
+private:
+    struct Record {
+        int64_t frame_number;
+        bool reversed;
+        uint8_t encoding;
+        uint64_t body_offset;
+        uint64_t body_size;
+    };
+
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    uint32_t m_num_rows;
+    uint32_t m_num_cols;
+    std::string m_rule_hex;
+    std::vector<Record> m_records;
+
+    void read_header(const std::string& path);
+    // Parses the record at `offset`, returning false if it's truncated or invalid.
+    bool read_record(uint64_t offset, Record& record) const;
+    bool read_index();
+    void scan_records(uint64_t offset);
+};
+
+}  // namespace
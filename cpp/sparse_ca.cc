@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "cell_batcher.h"
+#include "sparse_ca.h"
+
+namespace Critters {
+
+constexpr int64_t SparseMargolusCA::TILE_SIZE;
+constexpr uint32_t SparseMargolusCA::BORDER_TOP;
+constexpr uint32_t SparseMargolusCA::BORDER_BOTTOM;
+constexpr uint32_t SparseMargolusCA::BORDER_LEFT;
+constexpr uint32_t SparseMargolusCA::BORDER_RIGHT;
+
+namespace {
+    // Initial number of hash table slots, which must be a power of two. The table grows when
+    // it's half full.
+    const size_t INITIAL_TILE_SLOTS = 64;
+
+    // Maximum number of freed tiles to keep for reuse.
+    const size_t MAX_FREE_TILES = 256;
+
+    // Below this many tiles, a tick is too short to be worth splitting across threads.
+    const size_t MIN_PARALLEL_TILES = 64;
+
+    // Rounds towards negative infinity, so that tile coordinates are consistent across zero.
+    int64_t floor_div(int64_t n, int64_t d) {
+        return (n >= 0) ? n / d : -((-n - 1) / d) - 1;
+    }
+
+    inline bool is_row_empty(const uint8_t* row) {
+        uint64_t any = 0;
+        for (int64_t i = 0; i < SparseMargolusCA::TILE_SIZE; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, row + i, 8);
+            any |= word;
+        }
+        return any == 0;
+    }
+
+    // Like `is_row_empty`, but skips the first cell, which on odd frames the tile to the left
+    // may be updating at the same time.
+    inline bool is_row_empty_after_first(const uint8_t* row) {
+        uint64_t any;
+        std::memcpy(&any, row + 1, 8);
+        for (int64_t i = 8; i < SparseMargolusCA::TILE_SIZE; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, row + i, 8);
+            any |= word;
+        }
+        return any == 0;
+    }
+
+    inline void update_block(
+            uint8_t& tl, uint8_t& tr, uint8_t& bl, uint8_t& br, const BlockLookup& lookup) {
+        uint32_t state = (tl << 3) | (tr << 2) | (bl << 1) | br;
+        tl = lookup.cells[0][state];
+        tr = lookup.cells[1][state];
+        bl = lookup.cells[2][state];
+        br = lookup.cells[3][state];
+    }
+}
+
+bool SparseMargolusCA::Tile::is_empty() const {
+    uint64_t any = 0;
+    for (size_t i = 0; i < cells.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, &cells[i], 8);
+        any |= word;
+    }
+    return any == 0;
+}
+
+uint32_t SparseMargolusCA::Tile::active_borders() const {
+    const int64_t last = TILE_SIZE - 1;
+    uint32_t borders = 0;
+    if (!is_row_empty(&cells[0])) {
+        borders |= BORDER_TOP;
+    }
+    if (!is_row_empty(&cells[last * TILE_SIZE])) {
+        borders |= BORDER_BOTTOM;
+    }
+    uint8_t left = 0;
+    uint8_t right = 0;
+    for (int64_t r = 0; r < TILE_SIZE; r++) {
+        left |= cells[r * TILE_SIZE];
+        right |= cells[r * TILE_SIZE + last];
+    }
+    return borders | (left ? BORDER_LEFT : 0) | (right ? BORDER_RIGHT : 0);
+}
+
+SparseMargolusCA::TileMap::TileMap() {
+    m_slots.resize(INITIAL_TILE_SLOTS);
+}
+
+size_t SparseMargolusCA::TileMap::slot_index(const TileKey& key) const {
+    uint64_t h = (uint64_t)key.row * 0x9E3779B97F4A7C15ULL + (uint64_t)key.col;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return h & (m_slots.size() - 1);
+}
+
+SparseMargolusCA::Tile* SparseMargolusCA::TileMap::find(const TileKey& key) const {
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = slot_index(key); m_slots[i].tile; i = (i + 1) & mask) {
+        if (m_slots[i].key == key) {
+            return m_slots[i].tile.get();
+        }
+    }
+    return nullptr;
+}
+
+void SparseMargolusCA::TileMap::insert(const TileKey& key, std::unique_ptr<Tile> tile) {
+    if (2 * (m_size + 1) > m_slots.size()) {
+        grow();
+    }
+    size_t mask = m_slots.size() - 1;
+    size_t i = slot_index(key);
+    while (m_slots[i].tile) {
+        i = (i + 1) & mask;
+    }
+    m_slots[i].key = key;
+    m_slots[i].tile = std::move(tile);
+    m_size++;
+}
+
+std::unique_ptr<SparseMargolusCA::Tile> SparseMargolusCA::TileMap::remove(const TileKey& key) {
+    size_t mask = m_slots.size() - 1;
+    size_t i = slot_index(key);
+    while (!(m_slots[i].key == key)) {
+        i = (i + 1) & mask;
+    }
+    std::unique_ptr<Tile> tile = std::move(m_slots[i].tile);
+    m_size--;
+    // Move back any later entry in the same run whose home slot isn't between the hole and
+    // its current slot, so that lookups for it don't stop at the hole.
+    for (size_t j = (i + 1) & mask; m_slots[j].tile; j = (j + 1) & mask) {
+        size_t home = slot_index(m_slots[j].key);
+        bool reachable_from_hole = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (reachable_from_hole) {
+            m_slots[i] = std::move(m_slots[j]);
+            i = j;
+        }
+    }
+    return tile;
+}
+
+void SparseMargolusCA::TileMap::clear() {
+    m_slots.clear();
+    m_slots.resize(INITIAL_TILE_SLOTS);
+    m_size = 0;
+}
+
+void SparseMargolusCA::TileMap::grow() {
+    std::vector<Slot> old_slots(m_slots.size() * 2);
+    old_slots.swap(m_slots);
+    m_size = 0;
+    for (Slot& slot : old_slots) {
+        if (slot.tile) {
+            insert(slot.key, std::move(slot.tile));
+        }
+    }
+}
+
+void SparseMargolusCA::TileMap::for_each(
+        const std::function<void(const TileKey&, Tile&)>& fn) const {
+    for (const Slot& slot : m_slots) {
+        if (slot.tile) {
+            fn(slot.key, *slot.tile);
+        }
+    }
+}
+
+SparseMargolusCA::SparseMargolusCA(std::shared_ptr<TransitionTable> transition_table) :
+        m_transition_table(transition_table) {
+    for (int even = 0; even < 2; even++) {
+        for (int forward = 0; forward < 2; forward++) {
+            if (transition_table->states(even, forward)[0] != 0) {
+                throw std::invalid_argument("Sparse grids require empty blocks to stay empty");
+            }
+            m_lookups[even][forward] = BlockLookup(transition_table->states(even, forward));
+        }
+    }
+    m_kernel = block_row_kernel(KernelType::AUTO);
+}
+
+bool SparseMargolusCA::use_even_grid() const {
+    return (frame_number() % 2 == 0) != is_reversed();
+}
+
+bool SparseMargolusCA::at(int64_t row, int64_t col) const {
+    TileKey key {floor_div(row, TILE_SIZE), floor_div(col, TILE_SIZE)};
+    const Tile* tile = m_tiles.find(key);
+    if (!tile) {
+        return false;
+    }
+    return tile->cells[(row - key.row * TILE_SIZE) * TILE_SIZE + (col - key.col * TILE_SIZE)];
+}
+
+SparseMargolusCA::Tile& SparseMargolusCA::tile_for_key(const TileKey& key) {
+    Tile* tile = m_tiles.find(key);
+    if (tile) {
+        return *tile;
+    }
+    std::unique_ptr<Tile> new_tile;
+    if (!m_free_tiles.empty()) {
+        new_tile = std::move(m_free_tiles.back());
+        m_free_tiles.pop_back();
+    }
+    else {
+        new_tile = std::make_unique<Tile>();
+    }
+    tile = new_tile.get();
+    m_tiles.insert(key, std::move(new_tile));
+    return *tile;
+}
+
+void SparseMargolusCA::set_cells(const int64_t* coords, size_t num_cells, bool active) {
+    for (size_t i = 0; i < num_cells; i++) {
+        int64_t row = coords[2 * i];
+        int64_t col = coords[2 * i + 1];
+        TileKey key {floor_div(row, TILE_SIZE), floor_div(col, TILE_SIZE)};
+        if (!active && !m_tiles.find(key)) {
+            continue;
+        }
+        Tile& tile = tile_for_key(key);
+        tile.cells[(row - key.row * TILE_SIZE) * TILE_SIZE + (col - key.col * TILE_SIZE)] =
+            active;
+    }
+    if (!active) {
+        remove_empty_tiles();
+    }
+}
+
+void SparseMargolusCA::set_cells(const std::vector<std::vector<int64_t>>& cells, bool active) {
+    std::vector<int64_t> coords;
+    coords.reserve(2 * cells.size());
+    for (auto& rc : cells) {
+        coords.push_back(rc[0]);
+        coords.push_back(rc[1]);
+    }
+    set_cells(coords.data(), cells.size(), active);
+}
+
+// Sorts the tiles rather than the cells: for each row of tiles, each row of cells is scanned
+// across all of the tiles in order of their columns.
+void SparseMargolusCA::visit_active_cells(
+        const std::function<void(const int64_t* coords, size_t num_cells)>& visit) const {
+    std::vector<std::pair<TileKey, const Tile*>> tiles;
+    m_tiles.for_each([&tiles](const TileKey& key, Tile& tile) {
+        tiles.push_back({key, &tile});
+    });
+    std::sort(tiles.begin(), tiles.end(), [](const std::pair<TileKey, const Tile*>& a,
+            const std::pair<TileKey, const Tile*>& b) {
+        return std::make_pair(a.first.row, a.first.col) < std::make_pair(b.first.row, b.first.col);
+    });
+    CellBatcher<int64_t> batcher(visit);
+    size_t begin = 0;
+    while (begin < tiles.size()) {
+        int64_t tile_row = tiles[begin].first.row;
+        size_t end = begin;
+        while (end < tiles.size() && tiles[end].first.row == tile_row) {
+            end++;
+        }
+        for (int64_t r = 0; r < TILE_SIZE; r++) {
+            for (size_t i = begin; i < end; i++) {
+                const uint8_t* cells = &tiles[i].second->cells[r * TILE_SIZE];
+                for (int64_t c = 0; c < TILE_SIZE; c += 8) {
+                    uint64_t word;
+                    std::memcpy(&word, cells + c, 8);
+                    for (; word != 0; word &= word - 1) {
+                        batcher.add(tile_row * TILE_SIZE + r,
+                            tiles[i].first.col * TILE_SIZE + c + __builtin_ctzll(word) / 8);
+                    }
+                }
+            }
+        }
+        begin = end;
+    }
+    batcher.flush();
+}
+
+std::vector<std::vector<int64_t>> SparseMargolusCA::get_active_cells() const {
+    std::vector<std::vector<int64_t>> cells;
+    visit_active_cells([&cells](const int64_t* coords, size_t num_cells) {
+        for (size_t i = 0; i < num_cells; i++) {
+            cells.push_back({coords[2 * i], coords[2 * i + 1]});
+        }
+    });
+    return cells;
+}
+
+void SparseMargolusCA::reset() {
+    m_reversed = false;
+    m_frame_number = 0;
+    m_tiles.clear();
+    m_free_tiles.clear();
+}
+
+// On odd frames, blocks along the edges of a tile extend into the neighboring tiles, so those
+// neighbors are needed for edges with active cells. Cells that aren't on an edge can't reach
+// another tile in one frame. A cell in a corner is in a block with the diagonal neighbor, which
+// is only needed if both of the adjacent edges are active.
+void SparseMargolusCA::add_border_neighbors() {
+    m_keys.clear();
+    m_borders.clear();
+    m_tiles.for_each([this](const TileKey& key, Tile& tile) {
+        uint32_t borders = tile.active_borders();
+        if (borders) {
+            m_keys.push_back(key);
+            m_borders.push_back(borders);
+        }
+    });
+    for (size_t i = 0; i < m_keys.size(); i++) {
+        const TileKey& key = m_keys[i];
+        uint32_t borders = m_borders[i];
+        int64_t min_dr = (borders & BORDER_TOP) ? -1 : 0;
+        int64_t max_dr = (borders & BORDER_BOTTOM) ? 1 : 0;
+        int64_t min_dc = (borders & BORDER_LEFT) ? -1 : 0;
+        int64_t max_dc = (borders & BORDER_RIGHT) ? 1 : 0;
+        for (int64_t dr = min_dr; dr <= max_dr; dr++) {
+            for (int64_t dc = min_dc; dc <= max_dc; dc++) {
+                if (dr != 0 || dc != 0) {
+                    tile_for_key(TileKey {key.row + dr, key.col + dc});
+                }
+            }
+        }
+    }
+}
+
+void SparseMargolusCA::remove_empty_tiles() {
+    m_keys.clear();
+    m_tiles.for_each([this](const TileKey& key, Tile& tile) {
+        if (tile.is_empty()) {
+            m_keys.push_back(key);
+        }
+    });
+    for (const TileKey& key : m_keys) {
+        std::unique_ptr<Tile> tile = m_tiles.remove(key);
+        if (m_free_tiles.size() < MAX_FREE_TILES) {
+            m_free_tiles.push_back(std::move(tile));
+        }
+    }
+}
+
+void SparseMargolusCA::update_even_tile(const TileUpdate& update, const BlockLookup& lookup) const {
+    Tile& tile = *update.tile;
+    for (int64_t r = 0; r < TILE_SIZE; r += 2) {
+        uint8_t* top = tile.row(r);
+        uint8_t* bottom = tile.row(r + 1);
+        if (!is_row_empty(top) || !is_row_empty(bottom)) {
+            m_kernel(top, bottom, top, bottom, TILE_SIZE / 2, lookup);
+        }
+    }
+}
+
+// Updates the blocks whose top left cell is in the tile, which on odd frames are offset by one
+// row and column. A missing neighbor has no active cells, and after `add_border_neighbors` no
+// active cells are next to it, so the blocks that extend into it stay empty there. Those parts
+// of the blocks read from and write to zeroed local buffers. Empty blocks stay empty, so pairs
+// of empty rows are skipped. Column 0 belongs to the blocks of the tile to the left, so it isn't
+// read when checking for empty rows.
+void SparseMargolusCA::update_odd_tile(const TileUpdate& update, const BlockLookup& lookup) const {
+    const int64_t last = TILE_SIZE - 1;
+    const uint32_t num_inner_blocks = TILE_SIZE / 2 - 1;
+    std::array<uint8_t, TILE_SIZE> missing_row {};
+    std::array<uint8_t, 2> missing_right {};
+    uint8_t missing_corner = 0;
+    Tile& tile = *update.tile;
+    for (int64_t r = 1; r < last; r += 2) {
+        uint8_t* top = tile.row(r);
+        uint8_t* bottom = tile.row(r + 1);
+        if (!is_row_empty_after_first(top) || !is_row_empty_after_first(bottom)) {
+            m_kernel(top + 1, bottom + 1, top + 1, bottom + 1, num_inner_blocks, lookup);
+        }
+        uint8_t& top_right = update.right ? update.right->row(r)[0] : missing_right[0];
+        uint8_t& bottom_right = update.right ? update.right->row(r + 1)[0] : missing_right[1];
+        update_block(top[last], top_right, bottom[last], bottom_right, lookup);
+    }
+    // The last row of blocks extends into the tiles below.
+    uint8_t* top = tile.row(last);
+    uint8_t* bottom = update.below ? update.below->row(0) : missing_row.data();
+    if (!is_row_empty_after_first(top) || !is_row_empty_after_first(bottom)) {
+        m_kernel(top + 1, bottom + 1, top + 1, bottom + 1, num_inner_blocks, lookup);
+    }
+    uint8_t& top_right = update.right ? update.right->row(last)[0] : missing_right[0];
+    uint8_t& bottom_right = update.below_right ? update.below_right->row(0)[0] : missing_corner;
+    update_block(top[last], top_right, bottom[last], bottom_right, lookup);
+}
+
+void SparseMargolusCA::tick() {
+    bool even = use_even_grid();
+    if (!even) {
+        add_border_neighbors();
+    }
+    m_updates.clear();
+    m_tiles.for_each([this, even](const TileKey& key, Tile& tile) {
+        TileUpdate update {&tile, nullptr, nullptr, nullptr};
+        if (!even) {
+            update.right = m_tiles.find(TileKey {key.row, key.col + 1});
+            update.below = m_tiles.find(TileKey {key.row + 1, key.col});
+            update.below_right = m_tiles.find(TileKey {key.row + 1, key.col + 1});
+        }
+        m_updates.push_back(update);
+    });
+
+    // Blocks don't overlap, so tiles can be updated in any order, including concurrently.
+    const BlockLookup& lookup = m_lookups[even][!is_reversed()];
+    auto task = [this, even, &lookup](uint32_t index, uint32_t) {
+        if (even) {
+            update_even_tile(m_updates[index], lookup);
+        }
+        else {
+            update_odd_tile(m_updates[index], lookup);
+        }
+    };
+    if (num_threads() > 1 && m_updates.size() >= MIN_PARALLEL_TILES) {
+        if (!m_pool || m_pool->num_threads() != num_threads()) {
+            m_pool = std::make_unique<WorkerPool>(num_threads());
+        }
+        m_pool->run(m_updates.size(), task);
+    }
+    else {
+        for (uint32_t i = 0; i < m_updates.size(); i++) {
+            task(i, 0);
+        }
+    }
+
+    // New tiles are only added on odd frames, so removing empty tiles after those is enough to
+    // keep them from accumulating.
+    if (!even) {
+        remove_empty_tiles();
+    }
+    m_frame_number += (is_reversed()) ? -1 : 1;
+}
+
+void SparseMargolusCA::advance(uint64_t num_frames) {
+    for (uint64_t i = 0; i < num_frames; i++) {
+        tick();
+    }
+}
+
+}  // namespace
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "ca.h"
+
+namespace Critters {
+
+/**
+ * An unbounded grid, made of fixed size square tiles that are allocated when cells in or next
+ * to them become active and freed when they become empty. Unlike the `MargolusEngine` classes
+ * there's no wraparound, so patterns can travel arbitrarily far, and coordinates are signed.
+ * Blocks use the same alignment as the torus engines: on even frames the top left cell of each
+ * block is at an even row and column.
+ *
+ * The transition table must map an empty block to an empty block (in which case so does its
+ * inverse), since otherwise the infinite empty region would change on every frame.
+ */
+class SparseMargolusCA {
+public:
+    static constexpr int64_t TILE_SIZE = 64;
+
+    explicit SparseMargolusCA(std::shared_ptr<TransitionTable> transition_table);
+
+    inline uint32_t num_threads() const {return m_num_threads;}
+    inline void set_num_threads(uint32_t nt) {m_num_threads = nt;}
+
+    int64_t frame_number() const {return m_frame_number;}
+    void set_frame_number(int64_t fnum) {m_frame_number = fnum;}
+
+    bool is_reversed() const {return m_reversed;}
+    void set_reversed(bool r) {m_reversed = r;}
+
+    const TransitionTable& transition_table() const {return *m_transition_table;}
+
+    bool at(int64_t row, int64_t col) const;
+
+    /**
+     * Sets or clears `num_cells` cells, given as row/column pairs in `coords`.
+     */
+    void set_cells(const int64_t* coords, size_t num_cells, bool active = true);
+    void set_cells(const std::vector<std::vector<int64_t>>& cells, bool active = true);
+
+    /**
+     * Calls `visit` with the active cells in row major order, in batches, as for
+     * `MargolusEngine::visit_active_cells`.
+     */
+    void visit_active_cells(
+        const std::function<void(const int64_t* coords, size_t num_cells)>& visit) const;
+    std::vector<std::vector<int64_t>> get_active_cells() const;
+
+    void reset();
+
+    void tick();
+    void advance(uint64_t num_frames);
+
+    /**
+     * Number of tiles currently allocated. Every active cell is in one of them.
+     */
+    size_t num_tiles() const {return m_tiles.size();}
+
+private:
+    struct Tile {
+        std::array<uint8_t, TILE_SIZE * TILE_SIZE> cells {};
+
+        uint8_t* row(int64_t r) {return &cells[r * TILE_SIZE];}
+        bool is_empty() const;
+        // Returns the bits of BORDER_TOP etc. for the edges that have active cells.
+        uint32_t active_borders() const;
+    };
+
+    static constexpr uint32_t BORDER_TOP = 1;
+    static constexpr uint32_t BORDER_BOTTOM = 2;
+    static constexpr uint32_t BORDER_LEFT = 4;
+    static constexpr uint32_t BORDER_RIGHT = 8;
+
+    struct TileKey {
+        int64_t row;
+        int64_t col;
+        bool operator==(const TileKey& other) const {
+            return row == other.row && col == other.col;
+        }
+    };
+
+    /**
+     * Open addressed hash table from tile coordinates to tiles, with linear probing. Removal
+     * shifts later entries of the probe sequence back, so there are no tombstones.
+     */
+    class TileMap {
+    public:
+        TileMap();
+
+        size_t size() const {return m_size;}
+        Tile* find(const TileKey& key) const;
+        // Inserts `tile` for `key`, which must not already be present.
+        void insert(const TileKey& key, std::unique_ptr<Tile> tile);
+        // Removes and returns the tile for `key`, which must be present.
+        std::unique_ptr<Tile> remove(const TileKey& key);
+        void clear();
+
+        void for_each(const std::function<void(const TileKey&, Tile&)>& fn) const;
+
+    private:
+        struct Slot {
+            TileKey key;
+            std::unique_ptr<Tile> tile;
+        };
+        std::vector<Slot> m_slots;
+        size_t m_size = 0;
+
+        size_t slot_index(const TileKey& key) const;
+        void grow();
+    };
+
+    // A tile and the neighbors that its odd frame blocks extend into, or null for neighbors
+    // that aren't allocated.
+    struct TileUpdate {
+        Tile* tile;
+        Tile* right;
+        Tile* below;
+        Tile* below_right;
+    };
+
+    int64_t m_frame_number = 0;
+    bool m_reversed = false;
+    uint32_t m_num_threads = 1;
+    std::shared_ptr<TransitionTable> m_transition_table;
+    // Indexed by [use_even_grid][is_forward].
+    std::array<std::array<BlockLookup, 2>, 2> m_lookups;
+    BlockRowKernel m_kernel;
+    std::unique_ptr<WorkerPool> m_pool;
+
+    TileMap m_tiles;
+    // Freed tiles, kept to avoid reallocating them. They're all empty.
+    std::vector<std::unique_ptr<Tile>> m_free_tiles;
+    std::vector<TileKey> m_keys;
+    std::vector<uint32_t> m_borders;
+    std::vector<TileUpdate> m_updates;
+
+    bool use_even_grid() const;
+    Tile& tile_for_key(const TileKey& key);
+    void add_border_neighbors();
+    void remove_empty_tiles();
+    void update_even_tile(const TileUpdate& update, const BlockLookup& lookup) const;
+    void update_odd_tile(const TileUpdate& update, const BlockLookup& lookup) const;
+};
+
+}  // namespace
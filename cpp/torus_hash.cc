@@ -0,0 +1,282 @@
+#include <stdexcept>
+
+#include "torus_hash.h"
+
+namespace Critters {
+
+namespace {
+    // Fixed so that hashes are the same across runs.
+    const uint64_t KEY_SEED = 0x243F6A8885A308D3ULL;
+    const uint64_t MAX_PRIME = 1ULL << 62;
+    // Grids with at most this many cells use every coefficient of the Fourier transform.
+    const uint32_t MAX_CELLS_FOR_FULL_TRANSFORM = 64;
+    // Larger grids use this many randomly chosen coefficients in addition to the fixed ones.
+    const uint32_t NUM_RANDOM_COEFFICIENTS = 3;
+
+    uint64_t splitmix64(uint64_t& state) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t gcd(uint64_t x, uint64_t y) {
+        while (y != 0) {
+            uint64_t t = x % y;
+            x = y;
+            y = t;
+        }
+        return x;
+    }
+
+    uint64_t mul_mod(uint64_t x, uint64_t y, uint64_t m) {
+        return (unsigned __int128)x * y % m;
+    }
+
+    uint64_t pow_mod(uint64_t x, uint64_t n, uint64_t m) {
+        uint64_t result = 1;
+        x %= m;
+        while (n > 0) {
+            if (n & 1) {
+                result = mul_mod(result, x, m);
+            }
+            x = mul_mod(x, x, m);
+            n >>= 1;
+        }
+        return result;
+    }
+
+    // Miller-Rabin with bases that are known to be sufficient for all 64-bit numbers.
+    bool is_prime(uint64_t n) {
+        if (n < 2) {
+            return false;
+        }
+        const uint64_t bases[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+        for (uint64_t p : bases) {
+            if (n % p == 0) {
+                return n == p;
+            }
+        }
+        uint64_t d = n - 1;
+        int s = 0;
+        while (d % 2 == 0) {
+            d /= 2;
+            s++;
+        }
+        for (uint64_t a : bases) {
+            uint64_t x = pow_mod(a, d, n);
+            if (x == 1 || x == n - 1) {
+                continue;
+            }
+            bool composite = true;
+            for (int i = 1; i < s && composite; i++) {
+                x = mul_mod(x, x, n);
+                composite = (x != n - 1);
+            }
+            if (composite) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<uint32_t> prime_factors(uint32_t n) {
+        std::vector<uint32_t> factors;
+        for (uint32_t f = 2; (uint64_t)f * f <= n; f++) {
+            if (n % f == 0) {
+                factors.push_back(f);
+                while (n % f == 0) {
+                    n /= f;
+                }
+            }
+        }
+        if (n > 1) {
+            factors.push_back(n);
+        }
+        return factors;
+    }
+
+    // Returns an element of order exactly `order` modulo `prime`, where `order` divides
+    // `prime - 1`.
+    uint64_t root_of_unity(uint32_t order, uint64_t prime, uint64_t& random_state) {
+        std::vector<uint32_t> factors = prime_factors(order);
+        while (true) {
+            uint64_t x = 2 + splitmix64(random_state) % (prime - 3);
+            uint64_t root = pow_mod(x, (prime - 1) / order, prime);
+            bool exact = true;
+            for (uint32_t f : factors) {
+                if (pow_mod(root, order / f, prime) == 1) {
+                    exact = false;
+                    break;
+                }
+            }
+            if (exact) {
+                return root;
+            }
+        }
+    }
+}
+
+TorusHash::TorusHash(uint32_t num_rows, uint32_t num_cols) :
+        m_num_rows(num_rows), m_num_cols(num_cols) {
+    if (num_rows == 0 || num_cols == 0) {
+        throw std::invalid_argument("Grid dimensions must be positive");
+    }
+    // The largest prime below MAX_PRIME of the form k*lcm+1, so that p-1 is divisible by both
+    // dimensions and there are elements of those orders. Primes are common enough in such
+    // sequences that this doesn't take long.
+    uint64_t lcm = (uint64_t)num_rows / gcd(num_rows, num_cols) * num_cols;
+    if (lcm > (MAX_PRIME >> 16)) {
+        throw std::invalid_argument("Grid dimensions are too large to hash");
+    }
+    uint64_t k = (MAX_PRIME - 1) / lcm;
+    while (!is_prime(k * lcm + 1)) {
+        k--;
+    }
+    m_prime = k * lcm + 1;
+    // Newton's method for the inverse modulo 2^64; each step doubles the number of correct bits.
+    uint64_t inverse = m_prime;
+    for (int i = 0; i < 5; i++) {
+        inverse *= 2 - m_prime * inverse;
+    }
+    m_neg_prime_inverse = -inverse;
+    m_one = to_montgomery(1);
+
+    uint64_t random_state = KEY_SEED;
+    uint64_t a = root_of_unity(num_rows, m_prime, random_state);
+    uint64_t b = root_of_unity(num_cols, m_prime, random_state);
+    std::vector<std::pair<uint32_t, uint32_t>> powers = {
+        {0, 0},
+        {1 % num_rows, 0},
+        {num_rows - 1, 0},
+        {0, 1 % num_cols},
+        {0, num_cols - 1},
+        {num_rows - 1, num_cols - 1},
+    };
+    if ((uint64_t)num_rows * num_cols <= MAX_CELLS_FOR_FULL_TRANSFORM) {
+        for (uint32_t u = 0; u < num_rows; u++) {
+            for (uint32_t v = 0; v < num_cols; v++) {
+                powers.push_back({u, v});
+            }
+        }
+    }
+    else {
+        for (uint32_t i = 0; i < NUM_RANDOM_COEFFICIENTS; i++) {
+            uint64_t r = splitmix64(random_state);
+            powers.push_back({(r & 0xFFFFFFFF) % num_rows, (r >> 32) % num_cols});
+        }
+    }
+    m_num_coefficients = powers.size();
+    for (auto& uv : powers) {
+        uint64_t row_step = to_montgomery(pow_mod(a, uv.first, m_prime));
+        uint64_t col_step = to_montgomery(pow_mod(b, uv.second, m_prime));
+        std::vector<uint64_t> row_keys(num_rows);
+        std::vector<uint64_t> col_keys(num_cols);
+        uint64_t key = m_one;
+        for (uint32_t r = 0; r < num_rows; r++) {
+            row_keys[r] = key;
+            key = mul(key, row_step);
+        }
+        key = m_one;
+        for (uint32_t c = 0; c < num_cols; c++) {
+            col_keys[c] = key;
+            key = mul(key, col_step);
+        }
+        m_row_keys.push_back(std::move(row_keys));
+        m_col_keys.push_back(std::move(col_keys));
+    }
+    for (uint32_t r = 0; r < num_rows; r++) {
+        m_row_for_key[m_row_keys[ROW][r]] = r;
+    }
+    for (uint32_t c = 0; c < num_cols; c++) {
+        m_col_for_key[m_col_keys[COL][c]] = c;
+    }
+}
+
+uint64_t TorusHash::pow(uint64_t x, uint64_t n) const {
+    uint64_t result = m_one;
+    while (n > 0) {
+        if (n & 1) {
+            result = mul(result, x);
+        }
+        x = mul(x, x);
+        n >>= 1;
+    }
+    return result;
+}
+
+// Translating multiplies a coefficient and the one for the opposite powers by inverse factors,
+// and the ROW, COL, and NEG_DIAGONAL factors also cancel out.
+uint64_t TorusHash::translation_invariant(const Value& hash) const {
+    uint64_t invariants[] = {
+        hash[POPULATION],
+        mul(hash[ROW], hash[NEG_ROW]),
+        mul(hash[COL], hash[NEG_COL]),
+        mul(mul(hash[ROW], hash[COL]), hash[NEG_DIAGONAL]),
+    };
+    uint64_t result = 0;
+    for (uint64_t x : invariants) {
+        uint64_t state = result ^ x;
+        result = splitmix64(state);
+    }
+    return result;
+}
+
+bool TorusHash::is_translation(
+        const Value& from, const Value& to, uint32_t dr, uint32_t dc) const {
+    for (uint32_t i = 0; i < m_num_coefficients; i++) {
+        if (mul(from[i], mul(m_row_keys[i][dr], m_col_keys[i][dc])) != to[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TorusHash::find_offsets(uint64_t from, uint64_t to, const std::vector<uint64_t>& keys,
+        const std::unordered_map<uint64_t, uint32_t>& offset_for_key,
+        std::vector<uint32_t>& offsets) const {
+    offsets.clear();
+    if (from == 0 || to == 0) {
+        if (from != to) {
+            return false;
+        }
+        // Any offset is consistent with this coefficient.
+        for (uint32_t i = 0; i < keys.size(); i += 2) {
+            offsets.push_back(i);
+        }
+        return true;
+    }
+    auto it = offset_for_key.find(mul(to, inverse(from)));
+    if (it == offset_for_key.end() || it->second % 2 != 0) {
+        return false;
+    }
+    offsets.push_back(it->second);
+    return true;
+}
+
+bool TorusHash::find_even_translation(
+        const Value& from, const Value& to, uint32_t& dr, uint32_t& dc) const {
+    if (from[POPULATION] != to[POPULATION]) {
+        return false;
+    }
+    // The ROW coefficient only depends on the row offset and COL on the column offset, so
+    // unless they're zero they each determine one offset.
+    std::vector<uint32_t> row_offsets;
+    std::vector<uint32_t> col_offsets;
+    if (!find_offsets(from[ROW], to[ROW], m_row_keys[ROW], m_row_for_key, row_offsets) ||
+            !find_offsets(from[COL], to[COL], m_col_keys[COL], m_col_for_key, col_offsets)) {
+        return false;
+    }
+    for (uint32_t r : row_offsets) {
+        for (uint32_t c : col_offsets) {
+            if (is_translation(from, to, r, c)) {
+                dr = r;
+                dc = c;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+}  // namespace
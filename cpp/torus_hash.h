@@ -0,0 +1,134 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace Critters {
+
+/**
+ * Hashes of torus grids that change predictably when the grid is translated. Like Zobrist
+ * hashing, each hash is a sum of keys for the active cells, so it can be updated as cells change
+ * without looking at the rest of the grid. The keys aren't independent random numbers though:
+ * the key for (row, col) is a^row * b^col modulo a prime p, where a^num_rows = b^num_cols = 1.
+ * That makes the hash a coefficient of the grid's discrete Fourier transform over the integers
+ * modulo p, and translating the grid by (dr, dc), including wrapping around, multiplies it by
+ * a^dr * b^dc.
+ *
+ * A single coefficient is a weak hash (it only sees the grid projected onto one direction), so a
+ * `Value` has several, for different powers of a and b. Products of coefficients whose factors
+ * cancel out give a hash that's the same for every translation of the grid, and comparing all
+ * the coefficients checks whether one grid is a translation of another. For small grids the
+ * coefficients are the whole Fourier transform, so that check is exact.
+ */
+class TorusHash {
+public:
+    static const uint32_t MAX_COEFFICIENTS = 70;
+    using Value = std::array<uint64_t, MAX_COEFFICIENTS>;
+
+    TorusHash(uint32_t num_rows, uint32_t num_cols);
+
+    uint32_t num_rows() const {return m_num_rows;}
+    uint32_t num_cols() const {return m_num_cols;}
+
+    /**
+     * Updates `hash` for the cell at `row` and `col` becoming active or inactive. The cell must
+     * have had the opposite state.
+     */
+    void update(Value& hash, uint32_t row, uint32_t col, bool active) const {
+        for (uint32_t i = 0; i < m_num_coefficients; i++) {
+            uint64_t key = mul(m_row_keys[i][row], m_col_keys[i][col]);
+            hash[i] = active ? add(hash[i], key) : sub(hash[i], key);
+        }
+    }
+
+    /**
+     * Same as calling `update` for each of the cells in `row` at the columns in `activated`,
+     * which became active, and `deactivated`, which became inactive, but faster.
+     */
+    void update_row(Value& hash, uint32_t row, const uint32_t* activated, size_t num_activated,
+            const uint32_t* deactivated, size_t num_deactivated) const {
+        for (uint32_t i = 0; i < m_num_coefficients; i++) {
+            // The keys for a row share a factor, so only add the column factors.
+            const uint64_t* col_keys = m_col_keys[i].data();
+            uint64_t sum = 0;
+            for (size_t j = 0; j < num_activated; j++) {
+                sum = add(sum, col_keys[activated[j]]);
+            }
+            for (size_t j = 0; j < num_deactivated; j++) {
+                sum = sub(sum, col_keys[deactivated[j]]);
+            }
+            hash[i] = add(hash[i], mul(m_row_keys[i][row], sum));
+        }
+    }
+
+    /**
+     * Adds the changes accumulated in `delta`, starting from zero, to `hash`.
+     */
+    void combine(Value& hash, const Value& delta) const {
+        for (uint32_t i = 0; i < m_num_coefficients; i++) {
+            hash[i] = add(hash[i], delta[i]);
+        }
+    }
+
+    /**
+     * Returns a 64-bit hash of the grid that doesn't depend on its translation.
+     */
+    uint64_t translation_invariant(const Value& hash) const;
+
+    /**
+     * If `to` is the hash of `from` translated by some (dr, dc) with both even, sets `dr` and
+     * `dc` to that translation (as nonnegative offsets) and returns true.
+     */
+    bool find_even_translation(
+        const Value& from, const Value& to, uint32_t& dr, uint32_t& dc) const;
+
+private:
+    // Indices of the coefficients for the powers (0, 0), (1, 0), (-1, 0), (0, 1), (0, -1), and
+    // (-1, -1) of a and b. Their products are used for `translation_invariant`.
+    enum {POPULATION, ROW, NEG_ROW, COL, NEG_COL, NEG_DIAGONAL, NUM_FIXED_COEFFICIENTS};
+
+    uint32_t m_num_rows;
+    uint32_t m_num_cols;
+    uint32_t m_num_coefficients;
+    // Values are in Montgomery form: x is stored as x * 2^64 mod p, so that multiplying doesn't
+    // need a division.
+    uint64_t m_prime;
+    uint64_t m_neg_prime_inverse;
+    uint64_t m_one;
+    // Row and column factors of the keys for each coefficient.
+    std::vector<std::vector<uint64_t>> m_row_keys;
+    std::vector<std::vector<uint64_t>> m_col_keys;
+    // Row for each power of a and column for each power of b, to find offsets from the ROW and
+    // COL coefficients.
+    std::unordered_map<uint64_t, uint32_t> m_row_for_key;
+    std::unordered_map<uint64_t, uint32_t> m_col_for_key;
+
+    uint64_t add(uint64_t x, uint64_t y) const {
+        uint64_t sum = x + y;
+        return (sum >= m_prime) ? sum - m_prime : sum;
+    }
+    uint64_t sub(uint64_t x, uint64_t y) const {
+        return (x >= y) ? x - y : x + m_prime - y;
+    }
+    uint64_t mul(uint64_t x, uint64_t y) const {
+        unsigned __int128 t = (unsigned __int128)x * y;
+        uint64_t m = (uint64_t)t * m_neg_prime_inverse;
+        uint64_t u = (t + (unsigned __int128)m * m_prime) >> 64;
+        return (u >= m_prime) ? u - m_prime : u;
+    }
+    uint64_t pow(uint64_t x, uint64_t n) const;
+    uint64_t inverse(uint64_t x) const {return pow(x, m_prime - 2);}
+    uint64_t to_montgomery(uint64_t x) const {
+        return ((unsigned __int128)x << 64) % m_prime;
+    }
+    bool is_translation(const Value& from, const Value& to, uint32_t dr, uint32_t dc) const;
+    // Sets `offsets` to the possible even offsets given the coefficients of `from` and `to` that
+    // are multiplied by `keys[offset]` when translated.
+    bool find_offsets(uint64_t from, uint64_t to, const std::vector<uint64_t>& keys,
+        const std::unordered_map<uint64_t, uint32_t>& offset_for_key,
+        std::vector<uint32_t>& offsets) const;
+};
+
+}  // namespace
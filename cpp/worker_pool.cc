@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <chrono>
+
+#include "numa_topology.h"
+#include "worker_pool.h"
+
+namespace Critters {
+
+namespace {
+    // Number of polls before a waiting thread goes to sleep. With the pause instruction this
+    // is on the order of tens of microseconds, which covers the gap between consecutive ticks
+    // of a grid that is large enough to be worth splitting.
+    const uint32_t SPIN_COUNT = 4000;
+
+    // See `PoolCrossover`.
+    const uint32_t SERIAL_TICKS_TO_TIME = 2;
+    const double POOL_OVERHEAD_MARGIN = 2.0;
+
+    inline void cpu_relax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+WorkerPool::WorkerPool(uint32_t num_threads, const std::vector<uint32_t>& thread_cpus) {
+    m_num_threads = std::max(num_threads, 1U);
+    m_ranges.reset(new TaskRange[m_num_threads]);
+    if (!thread_cpus.empty()) {
+        for (uint32_t i = 0; i < m_num_threads; i++) {
+            m_thread_cpus.push_back(thread_cpus[i % thread_cpus.size()]);
+        }
+        m_caller_cpus = Critters::thread_cpus();
+        set_thread_cpus({m_thread_cpus[0]});
+    }
+    for (uint32_t i = 1; i < m_num_threads; i++) {
+        m_workers.emplace_back([this, i] {worker_loop(i);});
+    }
+    // Measure the cost of a round trip through the workers, to decide when a batch is too
+    // small to be worth splitting. Take the median to ignore startup and scheduling noise.
+    std::function<void(uint32_t, uint32_t)> noop = [](uint32_t, uint32_t) {};
+    std::vector<double> samples;
+    for (uint32_t i = 0; i < 15; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run(m_num_threads, noop);
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        samples.push_back(elapsed.count());
+    }
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    m_dispatch_overhead_ns = samples[samples.size() / 2];
+}
+
+WorkerPool::~WorkerPool() {
+    m_stopping = true;
+    m_generation.fetch_add(1);
+    notify_all();
+    for (auto& t : m_workers) {
+        t.join();
+    }
+    if (is_pinned() && !m_caller_cpus.empty()) {
+        set_thread_cpus(m_caller_cpus);
+    }
+}
+
+template <typename Predicate>
+void WorkerPool::wait_until(Predicate done) {
+    for (uint32_t i = 0; i < SPIN_COUNT; i++) {
+        if (done()) {
+            return;
+        }
+        cpu_relax();
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_num_parked.fetch_add(1);
+    m_wakeup.wait(lock, done);
+    m_num_parked.fetch_sub(1);
+}
+
+void WorkerPool::notify_all() {
+    // A waiter increments `m_num_parked` before checking its condition under the lock, so
+    // either it sees the change that triggered this call or we see it parked.
+    if (m_num_parked.load() > 0) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wakeup.notify_all();
+    }
+}
+
+void WorkerPool::worker_loop(uint32_t thread_index) {
+    if (is_pinned()) {
+        set_thread_cpus({m_thread_cpus[thread_index]});
+    }
+    uint64_t last_generation = 0;
+    while (true) {
+        wait_until([this, last_generation] {return m_generation.load() != last_generation;});
+        last_generation = m_generation.load();
+        if (m_stopping) {
+            return;
+        }
+        run_tasks(thread_index);
+        if (m_pending.fetch_sub(1) == 1) {
+            notify_all();
+        }
+    }
+}
+
+void WorkerPool::run_tasks(uint32_t thread_index) {
+    const auto& task = *m_task;
+    // Work through our own share first, then help the others, starting with the next thread
+    // so that thieves spread out over different shares.
+    uint32_t num_shares = is_pinned() ? 1 : m_num_threads;
+    for (uint32_t i = 0; i < num_shares; i++) {
+        uint32_t victim = (thread_index + i) % m_num_threads;
+        TaskRange& range = m_ranges[victim];
+        while (true) {
+            uint32_t index = range.next.fetch_add(1);
+            if (index >= range.end) {
+                break;
+            }
+            task(index, thread_index);
+        }
+    }
+}
+
+void WorkerPool::run(uint32_t num_tasks, const std::function<void(uint32_t, uint32_t)>& task) {
+    if (m_num_threads == 1) {
+        for (uint32_t i = 0; i < num_tasks; i++) {
+            task(i, 0);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < m_num_threads; i++) {
+        m_ranges[i].next = (uint64_t) i * num_tasks / m_num_threads;
+        m_ranges[i].end = (uint64_t) (i + 1) * num_tasks / m_num_threads;
+    }
+    m_task = &task;
+    m_pending = m_num_threads - 1;
+    m_generation.fetch_add(1);
+    notify_all();
+    run_tasks(0);
+    wait_until([this] {return m_pending.load() == 0;});
+}
+
+bool PoolCrossover::should_use_pool(const WorkerPool& pool) const {
+    uint32_t nthreads = pool.num_threads();
+    if (nthreads <= 1 || is_timing()) {
+        return false;
+    }
+    double savings_ns = m_serial_tick_ns * (nthreads - 1) / nthreads;
+    return savings_ns > POOL_OVERHEAD_MARGIN * pool.dispatch_overhead_ns();
+}
+
+bool PoolCrossover::is_timing() const {
+    return m_num_ticks_timed < SERIAL_TICKS_TO_TIME;
+}
+
+void PoolCrossover::record_serial_tick(double ns) {
+    // The first tick is slowed down by page faults, so keep the fastest.
+    if (m_num_ticks_timed == 0 || ns < m_serial_tick_ns) {
+        m_serial_tick_ns = ns;
+    }
+    m_num_ticks_timed++;
+}
+
+}  // namespace
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Critters {
+
+/**
+ * A fixed set of long-lived threads that run batches of independent tasks. The thread that
+ * calls `run` takes part in the batch, so a pool with N threads starts N-1 workers.
+ *
+ * Each participant starts on a contiguous share of the task indices and steals tasks from the
+ * other shares once its own is done, so a slow or descheduled thread doesn't hold up the
+ * batch. Between batches, threads wait by spinning briefly and then sleeping on a condition
+ * variable, which keeps the handoff cheap when batches follow each other closely without
+ * burning CPU when they don't.
+ *
+ * A pool can also be pinned, with each thread restricted to one CPU. Pinned pools don't steal
+ * tasks, so every thread always gets the same share of a batch, and memory that it first wrote
+ * (which the kernel allocates on its NUMA node) is what it works on in later batches.
+ */
+class WorkerPool {
+public:
+    /**
+     * Creates a pool of `num_threads` threads. If `thread_cpus` isn't empty, thread i runs only
+     * on CPU `thread_cpus[i % thread_cpus.size()]`, and the calling thread, as thread 0, is
+     * pinned until the pool is destroyed. In that case `run` must be called from the thread that
+     * created the pool.
+     */
+    explicit WorkerPool(uint32_t num_threads, const std::vector<uint32_t>& thread_cpus = {});
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    uint32_t num_threads() const {return m_num_threads;}
+    bool is_pinned() const {return !m_thread_cpus.empty();}
+
+    /**
+     * Calls `task(task_index, thread_index)` for every task index in [0, num_tasks), and
+     * returns when all of them have completed. `thread_index` is between 0 and
+     * `num_threads() - 1`, with 0 being the calling thread.
+     */
+    void run(uint32_t num_tasks, const std::function<void(uint32_t, uint32_t)>& task);
+
+    /**
+     * Returns the typical time in nanoseconds to dispatch an empty batch and wait for it to
+     * complete, measured when the pool is created.
+     */
+    double dispatch_overhead_ns() const {return m_dispatch_overhead_ns;}
+
+private:
+    // Task indices not yet claimed from one participant's share. Padded so that no two
+    // counters share a cache line and participants don't contend on each other's counters.
+    // (C++14 `new` doesn't support alignas(64), so padding is used instead.)
+    struct TaskRange {
+        std::atomic<uint32_t> next {0};
+        uint32_t end = 0;
+        char padding[120];
+    };
+
+    uint32_t m_num_threads;
+    std::vector<std::thread> m_workers;
+    std::vector<uint32_t> m_thread_cpus;
+    // The CPUs that the calling thread could run on before it was pinned.
+    std::vector<uint32_t> m_caller_cpus;
+    std::unique_ptr<TaskRange[]> m_ranges;
+    const std::function<void(uint32_t, uint32_t)>* m_task = nullptr;
+
+    // Incremented to start a batch. Workers compare it to the last batch they ran.
+    std::atomic<uint64_t> m_generation {0};
+    // Number of workers that haven't finished the current batch.
+    std::atomic<uint32_t> m_pending {0};
+    std::atomic<bool> m_stopping {false};
+    // Number of threads sleeping on `m_wakeup`, so that notifiers can skip locking the mutex
+    // when everyone is still spinning.
+    std::atomic<uint32_t> m_num_parked {0};
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+
+    double m_dispatch_overhead_ns = 0;
+
+    void worker_loop(uint32_t thread_index);
+    void run_tasks(uint32_t thread_index);
+    void notify_all();
+
+    template <typename Predicate>
+    void wait_until(Predicate done);
+};
+
+/**
+ * Decides whether the ticks of a grid are worth splitting across a `WorkerPool`. Dispatching to
+ * the pool has a fixed cost, so for small grids a single thread is faster. Rather than guessing
+ * the grid size where that changes, the first couple of single threaded ticks are timed and
+ * compared with the pool's measured dispatch overhead. Splitting the work N ways saves (N-1)/N
+ * of a tick, and that has to comfortably exceed the overhead.
+ */
+class PoolCrossover {
+public:
+    /**
+     * Returns whether the next tick should be split across `pool`, which is false until enough
+     * single threaded ticks have been timed.
+     */
+    bool should_use_pool(const WorkerPool& pool) const;
+
+    /**
+     * Returns whether single threaded ticks still need to be passed to `record_serial_tick`.
+     */
+    bool is_timing() const;
+
+    void record_serial_tick(double ns);
+
+private:
+    double m_serial_tick_ns = 0;
+    uint32_t m_num_ticks_timed = 0;
+};
+
+}  // namespace